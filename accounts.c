@@ -0,0 +1,794 @@
+#define _GNU_SOURCE
+#include "accounts.h"
+#include "proc_utils.h"
+#include "sm_alloc.h"
+#include "taskd_log.h"
+#include "xxhash.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ETC_PASSWD "/etc/passwd"
+#define ETC_GROUP "/etc/group"
+#define ETC_SHADOW "/etc/shadow"
+#define ETC_GSHADOW "/etc/gshadow"
+#define ETC_SKEL "/etc/skel"
+
+#define MAP_BUCKETS 1024 /* power of two */
+#define NOT_FOUND UINT32_MAX
+#define NO_INFO UINT32_MAX
+#define SKEL_DEPTH 8
+
+/* ----- Name map: chained, keyed by XXH64 like the kv store ----- */
+
+typedef struct map_entry {
+  struct map_entry *next;
+  uint64_t hash;
+  uint32_t id;
+  uint32_t info; /* index into the provisioning group table, or NO_INFO */
+  char name[];
+} map_entry;
+
+typedef struct {
+  map_entry **buckets; /* allocated on first put */
+  size_t count;
+} name_map;
+
+static map_entry *map_find(const name_map *m, const char *name, size_t len) {
+  if (!m->buckets)
+    return NULL;
+  uint64_t h = XXH64(name, len, 0);
+  map_entry *e = m->buckets[h & (MAP_BUCKETS - 1)];
+  while (e && (e->hash != h || strncmp(e->name, name, len) != 0 ||
+               e->name[len] != '\0'))
+    e = e->next;
+  return e;
+}
+
+static map_entry *map_put(name_map *m, const char *name, size_t len,
+                          uint32_t id) {
+  if (!m->buckets &&
+      !(m->buckets = sm_calloc(MAP_BUCKETS, sizeof(*m->buckets))))
+    return NULL;
+  map_entry *e = sm_malloc(sizeof(*e) + len + 1);
+  if (!e)
+    return NULL;
+  e->hash = XXH64(name, len, 0);
+  e->id = id;
+  e->info = NO_INFO;
+  memcpy(e->name, name, len);
+  e->name[len] = '\0';
+  map_entry **b = &m->buckets[e->hash & (MAP_BUCKETS - 1)];
+  e->next = *b;
+  *b = e;
+  m->count++;
+  return e;
+}
+
+static void map_clear(name_map *m) {
+  for (size_t i = 0; m->buckets && i < MAP_BUCKETS; ++i) {
+    while (m->buckets[i]) {
+      map_entry *e = m->buckets[i];
+      m->buckets[i] = e->next;
+      sm_free(e);
+    }
+  }
+  sm_free(m->buckets);
+  m->buckets = NULL;
+  m->count = 0;
+}
+
+/* ----- ID set: sorted array ----- */
+
+typedef struct {
+  uint32_t *v;
+  size_t n;
+  size_t cap;
+} id_set;
+
+/* Index of the first element >= id */
+static size_t ids_lower(const id_set *s, uint32_t id) {
+  size_t lo = 0, hi = s->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (s->v[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static bool ids_has(const id_set *s, uint32_t id) {
+  size_t i = ids_lower(s, id);
+  return i < s->n && s->v[i] == id;
+}
+
+static bool ids_add(id_set *s, uint32_t id) {
+  size_t i = ids_lower(s, id);
+  if (i < s->n && s->v[i] == id)
+    return true;
+  if (s->n == s->cap) {
+    size_t cap = s->cap ? s->cap * 2 : 256;
+    uint32_t *v = sm_realloc(s->v, cap * sizeof(*v));
+    if (!v)
+      return false;
+    s->v = v;
+    s->cap = cap;
+  }
+  memmove(s->v + i + 1, s->v + i, (s->n - i) * sizeof(*s->v));
+  s->v[i] = id;
+  s->n++;
+  return true;
+}
+
+/* Lowest ID from *cursor up that is free in a and, if given, in b. IDs are
+ * only ever added, so the cursor moves forward. NOT_FOUND when the range
+ * is used up. */
+static uint32_t ids_next_free(const id_set *a, const id_set *b,
+                              uint32_t *cursor) {
+  for (uint32_t id = *cursor; id <= ACCT_ID_MAX; ++id) {
+    if (!ids_has(a, id) && (!b || !ids_has(b, id))) {
+      *cursor = id + 1;
+      return id;
+    }
+  }
+  *cursor = ACCT_ID_MAX + 1;
+  return NOT_FOUND;
+}
+
+/* ----- Batch ----- */
+
+void acct_batch_free(acct_batch *b) {
+  if (!b)
+    return;
+  for (uint32_t i = 0; i < b->ngroups; ++i)
+    sm_free(b->groups[i].name);
+  for (uint32_t i = 0; i < b->nusers; ++i) {
+    acct_user *u = &b->users[i];
+    for (uint32_t k = 0; k < u->ngroups; ++k)
+      sm_free(u->groups[k]);
+    sm_free(u->groups);
+    sm_free(u->name);
+    sm_free(u->group);
+    sm_free(u->home);
+    sm_free(u->shell);
+    sm_free(u->gecos);
+    sm_free(u->password);
+  }
+  sm_free(b->groups);
+  sm_free(b->users);
+  memset(b, 0, sizeof(*b));
+}
+
+static bool name_valid(const char *name) {
+  size_t len = name ? strlen(name) : 0;
+  if (len == 0 || len > ACCT_MAX_NAME || name[0] == '-')
+    return false;
+  bool digits = true;
+  for (size_t i = 0; i < len; ++i) {
+    char c = name[i];
+    if (c == '$' && i == len - 1 && i > 0)
+      break;
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-'))
+      return false;
+    digits &= c >= '0' && c <= '9';
+  }
+  return !digits;
+}
+
+/* Free text that goes into a field: no separators */
+static bool field_valid(const char *s) {
+  return !s || !strpbrk(s, ":\n");
+}
+
+/* ----- Provisioning ----- */
+
+typedef struct {
+  char *data; /* whole file, NUL-terminated; NULL if it does not exist */
+  size_t len;
+  struct stat st;
+} etc_file;
+
+static bool read_etc(const char *path, etc_file *f) {
+  memset(f, 0, sizeof(*f));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno == ENOENT;
+  bool ok = fstat(fd, &f->st) == 0 &&
+            (f->data = sm_malloc((size_t)f->st.st_size + 1)) != NULL;
+  while (ok && f->len < (size_t)f->st.st_size) {
+    ssize_t n = read(fd, f->data + f->len, (size_t)f->st.st_size - f->len);
+    if (n <= 0)
+      break; /* shrank under us: take what is there */
+    f->len += (size_t)n;
+  }
+  close(fd);
+  if (f->data)
+    f->data[f->len] = '\0';
+  return ok;
+}
+
+/* Field idx (0-based) of a ':'-separated line */
+static const char *line_field(const char *line, const char *end, int idx,
+                              size_t *len) {
+  const char *p = line;
+  for (int i = 0; i < idx; ++i) {
+    p = memchr(p, ':', (size_t)(end - p));
+    if (!p)
+      return NULL;
+    ++p;
+  }
+  const char *q = memchr(p, ':', (size_t)(end - p));
+  *len = (size_t)((q ? q : end) - p);
+  return p;
+}
+
+/* Name -> ID of every entry, with every ID in ids unless it is NULL */
+static bool index_etc(const etc_file *f, name_map *names, id_set *ids) {
+  const char *p = f->data, *end = f->data + f->len;
+  while (p && p < end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    const char *eol = nl ? nl : end;
+    size_t nlen, ilen;
+    const char *id = line_field(p, eol, 2, &ilen);
+    const char *name = line_field(p, eol, 0, &nlen);
+    if (id && nlen > 0 && *p != '+' && *p != '-' && *p != '#') {
+      uint32_t v = (uint32_t)strtoul(id, NULL, 10);
+      if (!map_find(names, name, nlen) && !map_put(names, name, nlen, v))
+        return false;
+      if (ids && !ids_add(ids, v))
+        return false;
+    }
+    p = nl ? nl + 1 : NULL;
+  }
+  return true;
+}
+
+typedef struct {
+  const char *name;
+  uint32_t gid;
+  bool added;     /* a new group, written after the existing ones */
+  sm_buf members; /* ",user" for every member added */
+} grp_info;
+
+typedef struct {
+  const acct_batch *b;
+  etc_file passwd, group, shadow, gshadow;
+  name_map users, groups;
+  id_set uids, gids;
+  grp_info *info;
+  uint32_t ninfo;
+  uint32_t *uid;  /* per user */
+  uint32_t *pgrp; /* per user: info index of a private group, or NO_INFO */
+} prov;
+
+static void prov_free(prov *p) {
+  sm_free(p->passwd.data);
+  sm_free(p->group.data);
+  sm_free(p->shadow.data);
+  sm_free(p->gshadow.data);
+  map_clear(&p->users);
+  map_clear(&p->groups);
+  sm_free(p->uids.v);
+  sm_free(p->gids.v);
+  for (uint32_t i = 0; p->info && i < p->ninfo; ++i)
+    sm_free(p->info[i].members.data);
+  sm_free(p->info);
+  sm_free(p->uid);
+  sm_free(p->pgrp);
+}
+
+/* A new group; false if the name is taken */
+static bool add_group(prov *p, const char *name, uint32_t gid) {
+  size_t len = strlen(name);
+  if (map_find(&p->groups, name, len)) {
+    TLOG_S(TLOG_WARN, "accounts: group %s exists", name);
+    return false;
+  }
+  if (gid != ACCT_ID_AUTO && ids_has(&p->gids, gid)) {
+    TLOG(TLOG_WARN, "accounts: gid %lld in use", gid);
+    return false;
+  }
+  map_entry *e = map_put(&p->groups, name, len, gid);
+  if (!e || (gid != ACCT_ID_AUTO && !ids_add(&p->gids, gid)))
+    return false;
+  e->info = p->ninfo;
+  p->info[p->ninfo++] = (grp_info){.name = e->name, .gid = gid, .added = true};
+  return true;
+}
+
+/* Check the batch against the files and assign every ID. */
+static bool plan(prov *p) {
+  const acct_batch *b = p->b;
+  for (uint32_t i = 0; i < b->ngroups; ++i)
+    if (!add_group(p, b->groups[i].name, b->groups[i].gid))
+      return false;
+  /* Explicit UIDs first so automatic ones go around them */
+  for (uint32_t i = 0; i < b->nusers; ++i) {
+    const acct_user *u = &b->users[i];
+    size_t len = strlen(u->name);
+    if (map_find(&p->users, u->name, len)) {
+      TLOG_S(TLOG_WARN, "accounts: user %s exists", u->name);
+      return false;
+    }
+    if (u->uid != ACCT_ID_AUTO && ids_has(&p->uids, u->uid)) {
+      TLOG(TLOG_WARN, "accounts: uid %lld in use", u->uid);
+      return false;
+    }
+    if (!map_put(&p->users, u->name, len, u->uid) ||
+        (u->uid != ACCT_ID_AUTO && !ids_add(&p->uids, u->uid)))
+      return false;
+    p->uid[i] = u->uid;
+    p->pgrp[i] = NO_INFO;
+    if (!u->group) {
+      p->pgrp[i] = p->ninfo;
+      /* Like useradd, the private group takes the UID's number if free */
+      uint32_t gid = u->uid != ACCT_ID_AUTO && !ids_has(&p->gids, u->uid)
+                         ? u->uid
+                         : ACCT_ID_AUTO;
+      if (!add_group(p, u->name, gid))
+        return false;
+    }
+  }
+  uint32_t both = ACCT_ID_MIN, ucur = ACCT_ID_MIN, gcur = ACCT_ID_MIN;
+  for (uint32_t i = 0; i < b->nusers; ++i) {
+    grp_info *g = p->pgrp[i] != NO_INFO ? &p->info[p->pgrp[i]] : NULL;
+    if (p->uid[i] != ACCT_ID_AUTO)
+      continue;
+    /* A matching UID and GID for a private group, else any UID */
+    uint32_t id = g && g->gid == ACCT_ID_AUTO
+                      ? ids_next_free(&p->uids, &p->gids, &both)
+                      : ids_next_free(&p->uids, NULL, &ucur);
+    if (id == NOT_FOUND || !ids_add(&p->uids, id))
+      return false;
+    p->uid[i] = id;
+    if (g && g->gid == ACCT_ID_AUTO) {
+      if (!ids_add(&p->gids, id))
+        return false;
+      g->gid = id;
+    }
+  }
+  for (uint32_t i = 0; i < p->ninfo; ++i) {
+    if (p->info[i].gid != ACCT_ID_AUTO)
+      continue;
+    uint32_t id = ids_next_free(&p->gids, NULL, &gcur);
+    if (id == NOT_FOUND || !ids_add(&p->gids, id))
+      return false;
+    p->info[i].gid = id;
+  }
+  /* Primary groups must exist; supplementary memberships are collected
+   * per group, existing ones included */
+  for (uint32_t i = 0; i < b->nusers; ++i) {
+    const acct_user *u = &b->users[i];
+    const char *pg = u->group ? u->group : u->name;
+    if (!map_find(&p->groups, pg, strlen(pg))) {
+      TLOG_S(TLOG_WARN, "accounts: no group %s", pg);
+      return false;
+    }
+    for (uint32_t k = 0; k < u->ngroups; ++k) {
+      map_entry *e = map_find(&p->groups, u->groups[k], strlen(u->groups[k]));
+      if (!e) {
+        TLOG_S(TLOG_WARN, "accounts: no group %s", u->groups[k]);
+        return false;
+      }
+      if (e->info == NO_INFO) {
+        e->info = p->ninfo;
+        p->info[p->ninfo++] = (grp_info){.name = e->name, .gid = e->id};
+      }
+      sm_buf *m = &p->info[e->info].members;
+      sm_buf_append(m, ",", 1);
+      sm_buf_append(m, u->name, strlen(u->name));
+      if (m->failed)
+        return false;
+    }
+  }
+  return true;
+}
+
+static void put_str(sm_buf *o, const char *s) {
+  sm_buf_append(o, s, strlen(s));
+}
+
+static void put_num(sm_buf *o, uint32_t v) {
+  char num[16];
+  int n = snprintf(num, sizeof(num), "%u", (unsigned)v);
+  sm_buf_append(o, num, (size_t)n);
+}
+
+/* The old file with new members appended to the last field of existing
+ * group lines, then one line per new group. */
+static void build_groups(const prov *p, const etc_file *f, bool shadow,
+                         sm_buf *o) {
+  const char *s = f->data, *end = f->data + f->len;
+  while (s < end) {
+    const char *nl = memchr(s, '\n', (size_t)(end - s));
+    const char *eol = nl ? nl : end;
+    size_t nlen;
+    const char *name = line_field(s, eol, 0, &nlen);
+    map_entry *e = map_find(&p->groups, name, nlen);
+    sm_buf_append(o, s, (size_t)(eol - s));
+    if (e && e->info != NO_INFO && !p->info[e->info].added &&
+        p->info[e->info].members.len) {
+      /* Skip the comma when the member list was empty */
+      const sm_buf *m = &p->info[e->info].members;
+      size_t skip = eol > s && eol[-1] == ':' ? 1 : 0;
+      sm_buf_append(o, m->data + skip, m->len - skip);
+    }
+    sm_buf_append(o, "\n", 1);
+    s = eol + 1;
+  }
+  for (uint32_t i = 0; i < p->ninfo; ++i) {
+    const grp_info *g = &p->info[i];
+    if (!g->added)
+      continue;
+    put_str(o, g->name);
+    if (shadow) {
+      put_str(o, ":!::");
+    } else {
+      put_str(o, p->gshadow.data ? ":x:" : "::");
+      put_num(o, g->gid);
+      sm_buf_append(o, ":", 1);
+    }
+    if (g->members.len)
+      sm_buf_append(o, g->members.data + 1, g->members.len - 1);
+    sm_buf_append(o, "\n", 1);
+  }
+}
+
+static uint32_t primary_gid(const prov *p, uint32_t i) {
+  const acct_user *u = &p->b->users[i];
+  const char *pg = u->group ? u->group : u->name;
+  map_entry *e = map_find(&p->groups, pg, strlen(pg));
+  return e->info != NO_INFO ? p->info[e->info].gid : e->id;
+}
+
+static void build_users(const prov *p, bool shadow, sm_buf *o) {
+  const etc_file *f = shadow ? &p->shadow : &p->passwd;
+  sm_buf_append(o, f->data, f->len);
+  if (f->len && f->data[f->len - 1] != '\n')
+    sm_buf_append(o, "\n", 1);
+  long days = (long)(time(NULL) / 86400);
+  for (uint32_t i = 0; i < p->b->nusers; ++i) {
+    const acct_user *u = &p->b->users[i];
+    const char *pw = u->password ? u->password : "!";
+    put_str(o, u->name);
+    sm_buf_append(o, ":", 1);
+    if (shadow) {
+      char tail[48];
+      put_str(o, pw);
+      snprintf(tail, sizeof(tail), ":%ld:0:99999:7:::\n", days);
+      put_str(o, tail);
+      continue;
+    }
+    put_str(o, p->shadow.data ? "x" : pw);
+    sm_buf_append(o, ":", 1);
+    put_num(o, p->uid[i]);
+    sm_buf_append(o, ":", 1);
+    put_num(o, primary_gid(p, i));
+    sm_buf_append(o, ":", 1);
+    put_str(o, u->gecos ? u->gecos : "");
+    sm_buf_append(o, ":", 1);
+    if (u->home) {
+      put_str(o, u->home);
+    } else {
+      put_str(o, "/home/");
+      put_str(o, u->name);
+    }
+    sm_buf_append(o, ":", 1);
+    put_str(o, u->shell ? u->shell : "/bin/sh");
+    sm_buf_append(o, "\n", 1);
+  }
+}
+
+/* Write "<path>+" with the original's owner and mode. */
+static bool write_temp(const char *path, const etc_file *f, const sm_buf *b) {
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%s+", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                0600);
+  if (fd < 0)
+    return false;
+  bool ok = !b->failed;
+  for (size_t off = 0; ok && off < b->len;) {
+    ssize_t n = write(fd, b->data + off, b->len - off);
+    ok = n > 0;
+    off += ok ? (size_t)n : 0;
+  }
+  ok = ok && fchown(fd, f->st.st_uid, f->st.st_gid) == 0 &&
+       fchmod(fd, f->st.st_mode & 07777) == 0 && fsync(fd) == 0;
+  close(fd);
+  if (!ok)
+    unlink(tmp);
+  return ok;
+}
+
+static bool commit_temp(const char *path) {
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%s+", path);
+  if (rename(tmp, path) == 0)
+    return true;
+  TLOG_S(TLOG_ERROR, "accounts: cannot replace %s", path);
+  unlink(tmp);
+  return false;
+}
+
+/* Copy /etc/skel into a new home, owned by the user. False if anything
+ * was skipped. */
+static bool copy_skel(int src, int dst, uid_t uid, gid_t gid, int depth) {
+  DIR *d = fdopendir(dup(src));
+  if (!d)
+    return false;
+  rewinddir(d); /* the dup shares the offset of the previous copy */
+  bool ok = true;
+  char buf[8192], link[PATH_MAX];
+  for (struct dirent *de; (de = readdir(d));) {
+    const char *n = de->d_name;
+    struct stat st;
+    if (strcmp(n, ".") == 0 || strcmp(n, "..") == 0 ||
+        fstatat(src, n, &st, AT_SYMLINK_NOFOLLOW) != 0)
+      continue;
+    bool done = false;
+    mode_t mode = st.st_mode & 07777;
+    if (S_ISDIR(st.st_mode) && depth < SKEL_DEPTH) {
+      int s = -1, t = -1;
+      if (mkdirat(dst, n, mode) == 0 &&
+          fchownat(dst, n, uid, gid, AT_SYMLINK_NOFOLLOW) == 0) {
+        s = openat(src, n, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        t = openat(dst, n, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      }
+      done = s >= 0 && t >= 0 && copy_skel(s, t, uid, gid, depth + 1);
+      if (s >= 0)
+        close(s);
+      if (t >= 0)
+        close(t);
+    } else if (S_ISREG(st.st_mode)) {
+      int in = openat(src, n, O_RDONLY | O_CLOEXEC);
+      int out = in < 0 ? -1
+                       : openat(dst, n, O_WRONLY | O_CREAT | O_EXCL |
+                                            O_CLOEXEC, mode);
+      ssize_t r = out < 0 ? -1 : 0;
+      while (out >= 0 && (r = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, (size_t)r) != r)
+          break;
+      if (out >= 0) {
+        done = r == 0 && fchown(out, uid, gid) == 0;
+        close(out);
+      }
+      if (in >= 0)
+        close(in);
+    } else if (S_ISLNK(st.st_mode)) {
+      ssize_t len = readlinkat(src, n, link, sizeof(link) - 1);
+      if (len >= 0) {
+        link[len] = '\0';
+        done = symlinkat(link, dst, n) == 0 &&
+               fchownat(dst, n, uid, gid, AT_SYMLINK_NOFOLLOW) == 0;
+      }
+    }
+    ok &= done;
+  }
+  closedir(d);
+  return ok;
+}
+
+/* mkdir the home, and its parent if missing; an existing one is kept. */
+static void make_home(const char *home, uid_t uid, gid_t gid, int skel) {
+  if (mkdir(home, 0700) != 0) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", home);
+    char *slash = strrchr(parent, '/');
+    if (errno != ENOENT || !slash || slash == parent)
+      return;
+    *slash = '\0';
+    if (mkdir(parent, 0755) != 0 || mkdir(home, 0700) != 0)
+      return;
+  }
+  int fd = open(home, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (fchown(fd, uid, gid) != 0 ||
+      (skel >= 0 && !copy_skel(skel, fd, uid, gid, 0)))
+    TLOG_S(TLOG_WARN, "accounts: %s not fully set up", home);
+  close(fd);
+}
+
+bool acct_batch_valid(const acct_batch *b) {
+  if (!b || b->ngroups > ACCT_MAX_GROUPS || b->nusers > ACCT_MAX_USERS ||
+      b->ngroups + b->nusers == 0)
+    return false;
+  for (uint32_t i = 0; i < b->ngroups; ++i)
+    if (!name_valid(b->groups[i].name))
+      return false;
+  for (uint32_t i = 0; i < b->nusers; ++i) {
+    const acct_user *u = &b->users[i];
+    if (!name_valid(u->name) || (u->group && !name_valid(u->group)) ||
+        (u->home && u->home[0] != '/') || !field_valid(u->home) ||
+        !field_valid(u->shell) || !field_valid(u->gecos) ||
+        !field_valid(u->password))
+      return false;
+    for (uint32_t k = 0; k < u->ngroups; ++k)
+      if (!name_valid(u->groups[k]))
+        return false;
+  }
+  return true;
+}
+
+char *acct_provision(const acct_batch *b) {
+  if (!acct_batch_valid(b))
+    return NULL;
+  if (lckpwdf() != 0) {
+    TLOG(TLOG_WARN, "accounts: cannot lock the shadow files: errno %lld",
+         errno);
+    return NULL;
+  }
+  prov p = {.b = b};
+  sm_buf files[4] = {{0}}, out = {0};
+  bool ok = false;
+  uint32_t nsupp = 0;
+  for (uint32_t i = 0; i < b->nusers; ++i)
+    nsupp += b->users[i].ngroups;
+  p.info = sm_calloc(b->ngroups + b->nusers + nsupp, sizeof(*p.info));
+  p.uid = sm_malloc(b->nusers * sizeof(*p.uid) + 1);
+  p.pgrp = sm_malloc(b->nusers * sizeof(*p.pgrp) + 1);
+  if (!p.info || !p.uid || !p.pgrp || !read_etc(ETC_PASSWD, &p.passwd) ||
+      !read_etc(ETC_GROUP, &p.group) || !read_etc(ETC_SHADOW, &p.shadow) ||
+      !read_etc(ETC_GSHADOW, &p.gshadow) || !p.passwd.data || !p.group.data)
+    goto done;
+  if (!index_etc(&p.passwd, &p.users, &p.uids) ||
+      !index_etc(&p.group, &p.groups, &p.gids) || !plan(&p))
+    goto done;
+  /* Every file is written before any is replaced */
+  build_groups(&p, &p.group, false, &files[0]);
+  build_users(&p, false, &files[1]);
+  if (p.gshadow.data)
+    build_groups(&p, &p.gshadow, true, &files[2]);
+  if (p.shadow.data)
+    build_users(&p, true, &files[3]);
+  static const char *const paths[4] = {ETC_GROUP, ETC_PASSWD, ETC_GSHADOW,
+                                       ETC_SHADOW};
+  const etc_file *src[4] = {&p.group, &p.passwd, &p.gshadow, &p.shadow};
+  int written = 0;
+  for (; written < 4; ++written)
+    if (src[written]->data &&
+        !write_temp(paths[written], src[written], &files[written]))
+      break;
+  if (written < 4) {
+    for (int i = 0; i < written; ++i) {
+      char tmp[64];
+      snprintf(tmp, sizeof(tmp), "%s+", paths[i]);
+      if (src[i]->data)
+        unlink(tmp);
+    }
+    goto done;
+  }
+  ok = true;
+  for (int i = 0; i < 4; ++i)
+    if (src[i]->data)
+      ok &= commit_temp(paths[i]);
+  for (uint32_t i = 0; i < p.ninfo; ++i) {
+    if (!p.info[i].added)
+      continue;
+    put_str(&out, "group\t");
+    put_str(&out, p.info[i].name);
+    sm_buf_append(&out, "\t", 1);
+    put_num(&out, p.info[i].gid);
+    sm_buf_append(&out, "\n", 1);
+  }
+  int skel = open(ETC_SKEL, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  for (uint32_t i = 0; i < b->nusers; ++i) {
+    const acct_user *u = &b->users[i];
+    uint32_t gid = primary_gid(&p, i);
+    if (u->create_home) {
+      char home[PATH_MAX];
+      snprintf(home, sizeof(home), "/home/%s", u->name);
+      make_home(u->home ? u->home : home, p.uid[i], gid, skel);
+    }
+    put_str(&out, "user\t");
+    put_str(&out, u->name);
+    sm_buf_append(&out, "\t", 1);
+    put_num(&out, p.uid[i]);
+    sm_buf_append(&out, "\t", 1);
+    put_num(&out, gid);
+    sm_buf_append(&out, "\n", 1);
+  }
+  if (skel >= 0)
+    close(skel);
+done:
+  ulckpwdf();
+  for (int i = 0; i < 4; ++i)
+    sm_free(files[i].data);
+  prov_free(&p);
+  if (!ok || out.failed) {
+    sm_free(out.data);
+    return NULL;
+  }
+  return out.data;
+}
+
+/* ----- Lookup cache ----- */
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+} file_stamp;
+
+typedef struct {
+  const char *path;
+  file_stamp stamp;
+  bool loaded;
+  name_map names; /* name -> ID of every entry in the file */
+} id_cache;
+
+static id_cache user_cache = {.path = ETC_PASSWD};
+static id_cache group_cache = {.path = ETC_GROUP};
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static file_stamp stamp_of(const struct stat *st) {
+  return (file_stamp){st->st_dev, st->st_ino, st->st_size, st->st_mtim};
+}
+
+/* Read the file again if it changed since the names were taken from it */
+static void cache_check(id_cache *c) {
+  struct stat st;
+  file_stamp now = {0};
+  if (stat(c->path, &st) == 0)
+    now = stamp_of(&st);
+  const file_stamp *old = &c->stamp;
+  if (c->loaded && now.dev == old->dev && now.ino == old->ino &&
+      now.size == old->size && now.mtime.tv_sec == old->mtime.tv_sec &&
+      now.mtime.tv_nsec == old->mtime.tv_nsec)
+    return;
+  map_clear(&c->names);
+  etc_file f;
+  c->loaded = read_etc(c->path, &f) &&
+              (!f.data || index_etc(&f, &c->names, NULL));
+  if (!c->loaded)
+    map_clear(&c->names);
+  c->stamp = f.data ? stamp_of(&f.st) : now;
+  sm_free(f.data);
+}
+
+static bool cache_lookup(id_cache *c, const char *name, uint32_t *out) {
+  if (!name || !*name)
+    return false;
+  size_t len = strlen(name);
+  pthread_mutex_lock(&cache_lock);
+  cache_check(c);
+  map_entry *e = map_find(&c->names, name, len);
+  uint32_t id = e ? e->id : NOT_FOUND;
+  pthread_mutex_unlock(&cache_lock);
+  if (id == NOT_FOUND && strspn(name, "0123456789") == len) {
+    unsigned long v = strtoul(name, NULL, 10);
+    id = v < NOT_FOUND ? (uint32_t)v : NOT_FOUND;
+  }
+  *out = id;
+  return id != NOT_FOUND;
+}
+
+bool acct_uid(const char *name, uid_t *out) {
+  uint32_t id;
+  if (!cache_lookup(&user_cache, name, &id))
+    return false;
+  *out = (uid_t)id;
+  return true;
+}
+
+bool acct_gid(const char *name, gid_t *out) {
+  uint32_t id;
+  if (!cache_lookup(&group_cache, name, &id))
+    return false;
+  *out = (gid_t)id;
+  return true;
+}
@@ -0,0 +1,81 @@
+#ifndef ACCOUNTS_H
+#define ACCOUNTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Local users and groups without useradd/groupadd.
+ *
+ * acct_provision() adds a whole batch in one pass: it takes the shadow
+ * lock (lckpwdf), reads /etc/passwd, /etc/group, /etc/shadow and
+ * /etc/gshadow once, assigns IDs, writes each file to "<file>+" and renames
+ * it into place, then creates the home directories from /etc/skel. Either
+ * every entry is added or, if anything is invalid or conflicts, nothing is.
+ *
+ * acct_uid()/acct_gid() resolve names from /etc/passwd and /etc/group
+ * themselves rather than through NSS (getpwnam/getgrnam), which a static
+ * binary cannot use reliably. Each file is indexed once and read again
+ * whenever it changes (inode, size or mtime), which a stat per lookup
+ * checks. Other NSS sources (LDAP, sssd) are not consulted.
+ */
+#define ACCT_MAX_USERS 4096
+#define ACCT_MAX_GROUPS 4096
+#define ACCT_MAX_NAME 32
+#define ACCT_ID_AUTO UINT32_MAX /* pick the lowest free ID */
+#define ACCT_ID_MIN 1000        /* range for automatic IDs */
+#define ACCT_ID_MAX 60000
+
+typedef struct {
+  char *name;
+  uint32_t gid;
+} acct_group;
+
+typedef struct {
+  char *name;
+  uint32_t uid;
+  char *group;     /* primary group; NULL makes one named after the user */
+  char **groups;   /* supplementary groups, existing or in the batch */
+  uint32_t ngroups;
+  char *home;      /* NULL: /home/<name> */
+  char *shell;     /* NULL: /bin/sh */
+  char *gecos;     /* NULL: empty */
+  char *password;  /* crypt(3) hash; NULL: locked */
+  bool create_home;
+} acct_user;
+
+/* Everything is owned by the batch and freed with acct_batch_free(). */
+typedef struct {
+  acct_group *groups;
+  uint32_t ngroups;
+  acct_user *users;
+  uint32_t nusers;
+} acct_batch;
+
+void acct_batch_free(acct_batch *b);
+
+/* Limits that do not depend on the files. Names are 1 to ACCT_MAX_NAME of
+ * [A-Za-z0-9_.-], not starting with '-' and not all digits, optionally
+ * ending in '$'; homes are absolute; no field contains ':' or a newline. */
+bool acct_batch_valid(const acct_batch *b);
+
+/* Add the batch. Returns one line per entry added, groups first:
+ * "group\tname\tgid" and "user\tname\tuid\tgid" (caller frees with
+ * sm_free), or NULL if nothing was added. */
+char *acct_provision(const acct_batch *b);
+
+/* Resolve a user or group name; an all-digit name that does not exist is
+ * taken as the number, as chown(1) does. */
+bool acct_uid(const char *name, uid_t *out);
+bool acct_gid(const char *name, gid_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACCOUNTS_H */
@@ -0,0 +1,59 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <cJSON.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Helpers shared by the benchmark and replay tools. */
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline int bench_cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of an already sorted sample array. */
+static inline uint64_t bench_percentile(const uint64_t *sorted, size_t n,
+                                        double pct) {
+  if (n == 0)
+    return 0;
+  size_t rank = (size_t)(pct / 100.0 * (double)n + 0.999999);
+  if (rank == 0)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+  return sorted[rank - 1];
+}
+
+/* Sort samples in place and add min/p50/p90/p99/max/mean fields to obj. */
+static inline void bench_summary_to_json(cJSON *obj, uint64_t *samples,
+                                         size_t n) {
+  qsort(samples, n, sizeof(*samples), bench_cmp_u64);
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    sum += (double)samples[i];
+  cJSON_AddNumberToObject(obj, "min", n ? (double)samples[0] : 0);
+  cJSON_AddNumberToObject(obj, "p50", (double)bench_percentile(samples, n, 50));
+  cJSON_AddNumberToObject(obj, "p90", (double)bench_percentile(samples, n, 90));
+  cJSON_AddNumberToObject(obj, "p99", (double)bench_percentile(samples, n, 99));
+  cJSON_AddNumberToObject(obj, "max", n ? (double)samples[n - 1] : 0);
+  cJSON_AddNumberToObject(obj, "mean", n ? sum / (double)n : 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_UTIL_H */
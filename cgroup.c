@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include "cgroup.h"
+#include "taskd_log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_PENDING 64
+#define CPU_PERIOD_US 100000
+
+static char root[PATH_MAX / 2]; /* <taskd's cgroup>/taskd */
+static char jobs[PATH_MAX / 2];
+static char controllers[64];
+static bool enabled = false;
+static uint32_t next_id = 1;
+static uint32_t pending[MAX_PENDING]; /* released groups rmdir refused */
+static pthread_mutex_t cg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool write_file(const char *dir, const char *file, const char *s) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path))
+    return false;
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  size_t n = strlen(s);
+  bool ok = write(fd, s, n) == (ssize_t)n;
+  close(fd);
+  return ok;
+}
+
+static ssize_t read_file(const char *dir, const char *file, char *buf,
+                         size_t cap) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path))
+    return -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, cap - 1);
+  close(fd);
+  if (n >= 0)
+    buf[n] = '\0';
+  return n;
+}
+
+/* Mount point of the cgroup2 hierarchy. mountinfo lines are
+ * "id parent major:minor root mountpoint opts... - fstype source opts". */
+static bool find_mount(char *out, size_t cap) {
+  FILE *f = fopen("/proc/self/mountinfo", "re");
+  if (!f)
+    return false;
+  char line[1024];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), f)) {
+    if (!strstr(line, " - cgroup2 "))
+      continue;
+    char *p = line;
+    for (int i = 0; i < 4 && p; ++i)
+      if ((p = strchr(p, ' ')))
+        ++p;
+    char *end = p ? strchr(p, ' ') : NULL;
+    if (!end || (size_t)(end - p) >= cap)
+      continue;
+    memcpy(out, p, (size_t)(end - p));
+    out[end - p] = '\0';
+    found = true;
+  }
+  fclose(f);
+  return found;
+}
+
+/* Our cgroup within the hierarchy, from the "0::/path" line */
+static bool own_cgroup(char *out, size_t cap) {
+  char buf[1024];
+  int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return false;
+  buf[n] = '\0';
+  char *line = strstr(buf, "0::/");
+  if (!line || (line != buf && line[-1] != '\n'))
+    return false;
+  line += 3;
+  size_t len = strcspn(line, "\n");
+  if (len >= cap)
+    return false;
+  /* The hierarchy root is "/"; anything else is appended to the mount */
+  memcpy(out, line, len);
+  out[len == 1 ? 0 : len] = '\0';
+  return true;
+}
+
+static void job_dir(uint32_t id, char *buf, size_t cap) {
+  snprintf(buf, cap, "%s/%u", jobs, (unsigned)id);
+}
+
+/* Write each limit; unset ones are reset to the default if defaults. */
+static bool apply(const char *dir, const cg_limits *lim, bool defaults) {
+  char v[48];
+  bool ok = true;
+  if (lim->cpu_weight != CG_UNSET || defaults) {
+    snprintf(v, sizeof(v), "%ld",
+             lim->cpu_weight != CG_UNSET ? lim->cpu_weight : 100L);
+    ok &= write_file(dir, "cpu.weight", v);
+  }
+  if (lim->cpu_max_pct != CG_UNSET)
+    snprintf(v, sizeof(v), "%lld %d",
+             (long long)lim->cpu_max_pct * CPU_PERIOD_US / 100, CPU_PERIOD_US);
+  if (lim->cpu_max_pct != CG_UNSET || defaults)
+    ok &= write_file(dir, "cpu.max",
+                     lim->cpu_max_pct != CG_UNSET ? v : "max");
+  if (lim->memory_max != CG_UNSET)
+    snprintf(v, sizeof(v), "%lld", lim->memory_max);
+  if (lim->memory_max != CG_UNSET || defaults)
+    ok &= write_file(dir, "memory.max",
+                     lim->memory_max != CG_UNSET ? v : "max");
+  if (lim->pids_max != CG_UNSET)
+    snprintf(v, sizeof(v), "%ld", lim->pids_max);
+  if (lim->pids_max != CG_UNSET || defaults)
+    ok &= write_file(dir, "pids.max", lim->pids_max != CG_UNSET ? v : "max");
+  return ok;
+}
+
+bool cg_init(void) {
+  char mount[PATH_MAX / 4], self[PATH_MAX / 4];
+  if (!find_mount(mount, sizeof(mount)) || !own_cgroup(self, sizeof(self)))
+    return false;
+  char base[PATH_MAX / 2], ctl[PATH_MAX / 2];
+  if (snprintf(base, sizeof(base), "%s%s", mount, self) >= (int)sizeof(base) ||
+      snprintf(root, sizeof(root), "%s/taskd", base) >= (int)sizeof(root) ||
+      snprintf(ctl, sizeof(ctl), "%s/ctl", root) >= (int)sizeof(ctl) ||
+      snprintf(jobs, sizeof(jobs), "%s/jobs", root) >= (int)sizeof(jobs)) {
+    TLOG_S(TLOG_INFO, "cgroups disabled: path too long under %s", mount);
+    return false;
+  }
+  const char *dirs[] = {root, ctl, jobs};
+  for (int i = 0; i < 3; ++i) {
+    if (mkdir(dirs[i], 0755) != 0 && errno != EEXIST) {
+      TLOG_S(TLOG_INFO, "cgroups disabled: cannot create %s", dirs[i]);
+      return false;
+    }
+  }
+  /* "0" moves the writer, with all its threads */
+  if (!write_file(ctl, "cgroup.procs", "0")) {
+    TLOG(TLOG_INFO, "cgroups disabled: cannot move taskd, errno %lld", errno);
+    return false;
+  }
+  /* A controller must be enabled at every level down to the job groups.
+   * Enabling it in base fails while other processes live there (unless it
+   * is the root), so whatever reached jobs is what we have. */
+  const char *names[] = {"+cpu", "+memory", "+pids"};
+  for (int i = 0; i < 3; ++i) {
+    write_file(base, "cgroup.subtree_control", names[i]);
+    if (write_file(root, "cgroup.subtree_control", names[i]))
+      write_file(jobs, "cgroup.subtree_control", names[i]);
+  }
+  /* Job groups an earlier run could not remove; busy ones stay */
+  DIR *d = opendir(jobs);
+  for (struct dirent *de; d && (de = readdir(d));) {
+    if (de->d_name[0] >= '1' && de->d_name[0] <= '9' &&
+        de->d_type == DT_DIR)
+      unlinkat(dirfd(d), de->d_name, AT_REMOVEDIR);
+  }
+  if (d)
+    closedir(d);
+  ssize_t n = read_file(jobs, "cgroup.subtree_control", controllers,
+                        sizeof(controllers));
+  controllers[n > 0 ? strcspn(controllers, "\n") : 0] = '\0';
+  /* The control plane outweighs every command and keeps its memory */
+  write_file(ctl, "cpu.weight", "10000");
+  write_file(ctl, "memory.low", "max");
+  enabled = true;
+  TLOG_S(TLOG_INFO, "cgroups enabled, controllers: %s", controllers);
+  return true;
+}
+
+bool cg_enabled(void) { return enabled; }
+
+const char *cg_controllers(void) { return controllers; }
+
+bool cg_set_session(const cg_limits *lim) {
+  static const cg_limits none = CG_LIMITS_NONE;
+  return enabled && apply(jobs, lim ? lim : &none, true);
+}
+
+/* Caller holds cg_lock. */
+static void retry_pending(void) {
+  char dir[PATH_MAX];
+  for (int i = 0; i < MAX_PENDING; ++i) {
+    if (!pending[i])
+      continue;
+    job_dir(pending[i], dir, sizeof(dir));
+    if (rmdir(dir) == 0 || errno == ENOENT)
+      pending[i] = 0;
+  }
+}
+
+uint32_t cg_create(const cg_limits *lim) {
+  if (!enabled)
+    return 0;
+  char dir[PATH_MAX];
+  uint32_t id = 0;
+  pthread_mutex_lock(&cg_lock);
+  retry_pending();
+  /* Groups left by an earlier run are skipped */
+  for (int tries = 0; tries < 16 && !id; ++tries) {
+    uint32_t n = next_id;
+    next_id = next_id == UINT32_MAX ? 1 : next_id + 1;
+    job_dir(n, dir, sizeof(dir));
+    if (mkdir(dir, 0755) == 0)
+      id = n;
+    else if (errno != EEXIST)
+      break;
+  }
+  pthread_mutex_unlock(&cg_lock);
+  if (!id) {
+    TLOG(TLOG_WARN, "cannot create job cgroup: errno %lld", errno);
+    return 0;
+  }
+  if (lim && !apply(dir, lim, false))
+    TLOG_S(TLOG_WARN, "job cgroup limits not applied, controllers: %s",
+           controllers);
+  return id;
+}
+
+bool cg_procs_path(uint32_t id, char *buf, size_t cap) {
+  return id && snprintf(buf, cap, "%s/%u/cgroup.procs", jobs, (unsigned)id) <
+                   (int)cap;
+}
+
+bool cg_attach(uint32_t id, pid_t pid) {
+  char dir[PATH_MAX], v[24];
+  if (!id)
+    return false;
+  job_dir(id, dir, sizeof(dir));
+  snprintf(v, sizeof(v), "%ld", (long)pid);
+  return write_file(dir, "cgroup.procs", v) || errno == ESRCH;
+}
+
+bool cg_read_usage(uint32_t id, cg_usage *out) {
+  char dir[PATH_MAX], buf[512];
+  out->cpu_usec = out->memory_peak = -1;
+  if (!id)
+    return false;
+  job_dir(id, dir, sizeof(dir));
+  if (read_file(dir, "cpu.stat", buf, sizeof(buf)) <= 0)
+    return false;
+  const char *u = strstr(buf, "usage_usec ");
+  out->cpu_usec = u ? strtoll(u + 11, NULL, 10) : -1;
+  if (read_file(dir, "memory.peak", buf, sizeof(buf)) > 0)
+    out->memory_peak = strtoll(buf, NULL, 10);
+  return true;
+}
+
+void cg_release(uint32_t id, bool kill_left) {
+  if (!id)
+    return;
+  char dir[PATH_MAX], buf[4096];
+  job_dir(id, dir, sizeof(dir));
+  if (rmdir(dir) != 0 && errno == EBUSY) {
+    /* Something the command started is still running. cgroup.kill needs
+     * Linux 5.14; before that signal what cgroup.procs lists. */
+    if (kill_left && !write_file(dir, "cgroup.kill", "1") &&
+        read_file(dir, "cgroup.procs", buf, sizeof(buf)) > 0) {
+      for (char *p = buf; *p;) {
+        char *end;
+        long pid = strtol(p, &end, 10);
+        if (end == p)
+          break;
+        kill((pid_t)pid, SIGKILL);
+        p = end + (*end == '\n');
+      }
+    }
+    if (rmdir(dir) != 0 && errno == EBUSY) {
+      pthread_mutex_lock(&cg_lock);
+      int i = 0;
+      while (i < MAX_PENDING && pending[i])
+        ++i;
+      if (i < MAX_PENDING)
+        pending[i] = id;
+      pthread_mutex_unlock(&cg_lock);
+    }
+  }
+}
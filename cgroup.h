@@ -0,0 +1,90 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * cgroup v2 placement for the commands recipes run, so a runaway command
+ * cannot starve taskd or the rest of the guest.
+ *
+ * cg_init() builds a subtree under taskd's own cgroup:
+ *   taskd/ctl       taskd itself: highest cpu.weight, memory.low=max
+ *   taskd/jobs      every command; the session limits (cg_set_session)
+ *   taskd/jobs/<n>  one per command, with that command's limits
+ * Controllers that cannot be enabled (not delegated to us, or other
+ * processes in the parent) are skipped and their limits are not applied;
+ * placement and CPU accounting still work. Without a writable cgroup2 mount
+ * cg_enabled() is false and commands run where taskd runs, as before.
+ *
+ * The subtree is left in place at exit and reused by the next start.
+ */
+
+/* A limit left at CG_UNSET keeps the kernel default */
+#define CG_UNSET (-1)
+#define CG_LIMITS_NONE {CG_UNSET, CG_UNSET, CG_UNSET, CG_UNSET}
+
+typedef struct {
+  long cpu_weight;      /* cpu.weight, 1..10000 (default 100) */
+  long cpu_max_pct;     /* cpu.max as percent of one CPU, 250 = 2.5 CPUs */
+  long long memory_max; /* memory.max in bytes */
+  long pids_max;        /* pids.max */
+} cg_limits;
+
+/* Whether any limit is set */
+static inline bool cg_limits_set(const cg_limits *lim) {
+  return lim && (lim->cpu_weight != CG_UNSET || lim->cpu_max_pct != CG_UNSET ||
+                 lim->memory_max != CG_UNSET || lim->pids_max != CG_UNSET);
+}
+
+/* -1 where the value is not available */
+typedef struct {
+  int64_t cpu_usec;    /* usage_usec from cpu.stat */
+  int64_t memory_peak; /* memory.peak in bytes (Linux 5.19+) */
+} cg_usage;
+
+/* Build the subtree and move taskd into ctl. Returns false, leaving
+ * everything where it was, if there is no usable cgroup2 hierarchy. */
+bool cg_init(void);
+
+bool cg_enabled(void);
+
+/* Space-separated controllers enabled for jobs, "" if none */
+const char *cg_controllers(void);
+
+/* Apply limits to the jobs group, shared by every command. Limits left
+ * unset, or all of them for NULL, go back to the defaults. */
+bool cg_set_session(const cg_limits *lim);
+
+/* Create a cgroup for one command with lim applied (NULL for none).
+ * Returns its id, or 0 when cgroups are disabled or it cannot be made. */
+uint32_t cg_create(const cg_limits *lim);
+
+/* Path of the group's cgroup.procs; a child writes "0" to it to move itself
+ * in before running anything. */
+bool cg_procs_path(uint32_t id, char *buf, size_t cap);
+
+/* Move pid into the group from outside. True if it is there, or has
+ * already exited; false with errno set otherwise (e.g. EAGAIN at pids.max,
+ * ENOENT once the group is gone). */
+bool cg_attach(uint32_t id, pid_t pid);
+
+bool cg_read_usage(uint32_t id, cg_usage *out);
+
+/* Remove the group. With kill_left, whatever is left in it is killed first;
+ * without, processes the command left running keep going and the group is
+ * removed on a later call once they are gone, as is one whose processes
+ * are still dying. */
+void cg_release(uint32_t id, bool kill_left);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CGROUP_H */
@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include "fill.h"
+#include "sm_alloc.h"
+#include "taskd_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#define MAX_ID INT32_MAX
+#define CHUNK (1ull << 30)  /* bytes per space file */
+#define DIR_INODES 4096     /* inodes per subdirectory, itself included */
+#define TOPUP_TRIES 64
+#define TEMPLATE "/.taskd-fill-XXXXXX"
+
+typedef struct {
+  uint32_t id;
+  bool tree; /* a fill_exhaust directory, else a single file */
+  fill_resource res;
+  uint32_t units; /* files (space) or subdirectories (inodes) */
+  int threads;
+  dev_t dev;
+  ino_t ino;
+  char *path;
+} fill_entry;
+
+static fill_entry *table[FILL_MAX];
+static uint32_t next_id = 1;
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ----- Handle table ----- */
+
+static void entry_free(fill_entry *e) {
+  if (!e)
+    return;
+  sm_free(e->path);
+  sm_free(e);
+}
+
+static bool id_in_use(uint32_t id) {
+  for (int i = 0; i < FILL_MAX; ++i)
+    if (table[i] && table[i]->id == id)
+      return true;
+  return false;
+}
+
+/* Returns the new handle, or 0 if the table is full. */
+static uint32_t add_entry(fill_entry *e) {
+  uint32_t id = 0;
+  pthread_mutex_lock(&fill_lock);
+  for (int i = 0; i < FILL_MAX; ++i) {
+    if (table[i])
+      continue;
+    do {
+      id = next_id;
+      next_id = next_id == MAX_ID ? 1 : next_id + 1;
+    } while (id_in_use(id));
+    e->id = id;
+    table[i] = e;
+    break;
+  }
+  pthread_mutex_unlock(&fill_lock);
+  return id;
+}
+
+static fill_entry *take_entry(uint32_t id) {
+  fill_entry *e = NULL;
+  pthread_mutex_lock(&fill_lock);
+  for (int i = 0; id && i < FILL_MAX && !e; ++i) {
+    if (table[i] && table[i]->id == id) {
+      e = table[i];
+      table[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&fill_lock);
+  return e;
+}
+
+/* ----- Workers ----- */
+
+typedef struct fill_job fill_job;
+struct fill_job {
+  int dir_fd;
+  uint64_t need; /* bytes or inodes to create */
+  uint32_t units;
+  bool (*run)(fill_job *j, uint32_t unit);
+  _Atomic uint32_t next;
+  atomic_bool full; /* the filesystem ran out */
+  atomic_bool failed;
+};
+
+static bool out_of_space(int err) { return err == ENOSPC || err == EDQUOT; }
+
+/* Unit names are their index in decimal */
+static void unit_name(uint32_t unit, char *buf, size_t cap) {
+  snprintf(buf, cap, "%u", (unsigned)unit);
+}
+
+static bool space_unit(fill_job *j, uint32_t unit) {
+  char name[16];
+  unit_name(unit, name, sizeof(name));
+  uint64_t left = j->need - (uint64_t)unit * CHUNK;
+  int fd = openat(j->dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0600);
+  if (fd < 0)
+    return false;
+  /* fallocate where supported; glibc writes a byte per block otherwise */
+  int err = posix_fallocate(fd, 0, (off_t)(left < CHUNK ? left : CHUNK));
+  close(fd);
+  errno = err;
+  return err == 0;
+}
+
+static bool inode_unit(fill_job *j, uint32_t unit) {
+  char name[16];
+  unit_name(unit, name, sizeof(name));
+  uint64_t left = j->need - (uint64_t)unit * DIR_INODES;
+  uint32_t count = left < DIR_INODES ? (uint32_t)left : DIR_INODES;
+  if (mkdirat(j->dir_fd, name, 0700) != 0)
+    return false;
+  int dfd = openat(j->dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0)
+    return false;
+  /* Empty regular files, in order, so release can stop at the first gap */
+  bool ok = true;
+  for (uint32_t k = 1; ok && k < count; ++k) {
+    unit_name(k, name, sizeof(name));
+    ok = mknodat(dfd, name, S_IFREG | 0600, 0) == 0;
+  }
+  int err = errno;
+  close(dfd);
+  errno = err;
+  return ok;
+}
+
+static bool release_space_unit(fill_job *j, uint32_t unit) {
+  char name[16];
+  unit_name(unit, name, sizeof(name));
+  return unlinkat(j->dir_fd, name, 0) == 0 || errno == ENOENT;
+}
+
+static bool release_inode_unit(fill_job *j, uint32_t unit) {
+  char name[16];
+  unit_name(unit, name, sizeof(name));
+  int dfd = openat(j->dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0)
+    return errno == ENOENT;
+  for (uint32_t k = 1; k < DIR_INODES; ++k) {
+    char file[16];
+    unit_name(k, file, sizeof(file));
+    if (unlinkat(dfd, file, 0) != 0)
+      break;
+  }
+  close(dfd);
+  return unlinkat(j->dir_fd, name, AT_REMOVEDIR) == 0 || errno == ENOENT;
+}
+
+static void *fill_worker(void *arg) {
+  fill_job *j = arg;
+  for (;;) {
+    if (atomic_load(&j->full) || atomic_load(&j->failed))
+      break;
+    uint32_t i = atomic_fetch_add(&j->next, 1);
+    if (i >= j->units)
+      break;
+    if (j->run(j, i))
+      continue;
+    if (out_of_space(errno)) {
+      atomic_store(&j->full, true);
+    } else {
+      TLOG(TLOG_WARN, "fill: unit %lld failed: errno %lld", i, errno);
+      atomic_store(&j->failed, true);
+    }
+  }
+  return NULL;
+}
+
+/* Run every unit on up to threads threads, this one included. */
+static void run_job(fill_job *j, int threads) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads == 0)
+    threads = (int)(cpus > 0 ? cpus : 1);
+  if (threads > FILL_MAX_THREADS)
+    threads = FILL_MAX_THREADS;
+  if ((uint32_t)threads > j->units)
+    threads = (int)j->units;
+  pthread_t tids[FILL_MAX_THREADS];
+  int started = 0;
+  for (; started < threads - 1; ++started)
+    if (pthread_create(&tids[started], NULL, fill_worker, j) != 0)
+      break;
+  fill_worker(j);
+  for (int i = 0; i < started; ++i)
+    pthread_join(tids[i], NULL);
+}
+
+/* ----- Public API ----- */
+
+uint32_t fill_allocate(const char *path, uint64_t size, bool allocate) {
+  if (!path || size > (uint64_t)INT64_MAX)
+    return 0;
+  fill_entry *e = sm_calloc(1, sizeof(*e));
+  if (!e || !(e->path = sm_strdup(path))) {
+    entry_free(e);
+    return 0;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    entry_free(e);
+    return 0;
+  }
+  struct stat st;
+  int err = allocate ? posix_fallocate(fd, 0, (off_t)size)
+                     : (ftruncate(fd, (off_t)size) == 0 ? 0 : errno);
+  if (err == 0 && fstat(fd, &st) != 0)
+    err = errno;
+  close(fd);
+  uint32_t id = 0;
+  if (err == 0) {
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    id = add_entry(e);
+  } else {
+    TLOG(TLOG_WARN, "fill: cannot size file: errno %lld", err);
+  }
+  if (!id) {
+    unlink(path);
+    entry_free(e);
+  }
+  return id;
+}
+
+/* After running out of space, take what is left in smaller and smaller
+ * files until nothing of a block's size fits. Returns the next unit. */
+static uint32_t top_up(int dir_fd, uint32_t unit, uint64_t target) {
+  struct statvfs sv;
+  uint64_t size = 0;
+  for (int i = 0; i < TOPUP_TRIES && fstatvfs(dir_fd, &sv) == 0; ++i) {
+    uint64_t avail = (uint64_t)sv.f_bavail * sv.f_frsize;
+    if (avail <= target)
+      break;
+    if (size == 0 || size > avail - target)
+      size = avail - target;
+    if (size < sv.f_frsize)
+      break;
+    char name[16];
+    unit_name(unit, name, sizeof(name));
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0600);
+    if (fd < 0)
+      break;
+    ++unit;
+    int err = posix_fallocate(fd, 0, (off_t)size);
+    close(fd);
+    if (err != 0)
+      size /= 2;
+  }
+  return unit;
+}
+
+static bool release_tree(fill_entry *e) {
+  fill_job j = {.units = e->units};
+  j.run = e->res == FILL_SPACE ? release_space_unit : release_inode_unit;
+  j.dir_fd = open(e->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (j.dir_fd < 0)
+    return errno == ENOENT;
+  run_job(&j, e->threads);
+  close(j.dir_fd);
+  return !atomic_load(&j.failed) && rmdir(e->path) == 0;
+}
+
+uint32_t fill_exhaust(const char *dir, fill_resource res,
+                      uint64_t target_free, int threads) {
+  if (!dir || threads < 0 || threads > FILL_MAX_THREADS)
+    return 0;
+  size_t len = strlen(dir) + sizeof(TEMPLATE);
+  fill_entry *e = sm_calloc(1, sizeof(*e));
+  if (!e || !(e->path = sm_malloc(len))) {
+    entry_free(e);
+    return 0;
+  }
+  e->tree = true;
+  e->res = res;
+  e->threads = threads;
+  snprintf(e->path, len, "%s" TEMPLATE, dir);
+  if (!mkdtemp(e->path)) {
+    entry_free(e);
+    return 0;
+  }
+  fill_job j = {.dir_fd = -1};
+  struct statvfs sv;
+  j.dir_fd = open(e->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (j.dir_fd < 0 || fstatvfs(j.dir_fd, &sv) != 0)
+    goto fail;
+  uint64_t have, unit;
+  if (res == FILL_SPACE) {
+    have = (uint64_t)sv.f_bavail * sv.f_frsize;
+    unit = CHUNK;
+    j.run = space_unit;
+  } else {
+    have = sv.f_favail;
+    unit = DIR_INODES;
+    j.run = inode_unit;
+  }
+  j.need = have > target_free ? have - target_free : 0;
+  if (res == FILL_INODES && (sv.f_files == 0 || j.need > FILL_MAX_INODES)) {
+    TLOG(TLOG_WARN, "fill: cannot take %lld inodes of %lld", j.need,
+         sv.f_files);
+    goto fail;
+  }
+  j.units = (uint32_t)((j.need + unit - 1) / unit);
+  run_job(&j, threads);
+  /* Units past a failure may have started; release tolerates gaps */
+  e->units = j.units;
+  if (atomic_load(&j.failed))
+    goto fail;
+  if (res == FILL_SPACE && atomic_load(&j.full))
+    e->units = top_up(j.dir_fd, j.units, target_free);
+  close(j.dir_fd);
+  uint32_t id = add_entry(e);
+  if (!id) {
+    release_tree(e);
+    entry_free(e);
+  }
+  return id;
+fail:
+  if (j.dir_fd >= 0)
+    close(j.dir_fd);
+  release_tree(e);
+  entry_free(e);
+  return 0;
+}
+
+static bool release(fill_entry *e) {
+  bool ok;
+  if (e->tree) {
+    ok = release_tree(e);
+  } else {
+    /* Only the file we made: it may have been renamed over since */
+    struct stat st;
+    ok = lstat(e->path, &st) == 0 && st.st_dev == e->dev &&
+         st.st_ino == e->ino && unlink(e->path) == 0;
+  }
+  if (!ok)
+    TLOG_S(TLOG_WARN, "fill: %s not fully released", e->path);
+  entry_free(e);
+  return ok;
+}
+
+bool fill_release(uint32_t id) {
+  fill_entry *e = take_entry(id);
+  return e && release(e);
+}
+
+void fill_release_all(void) {
+  fill_entry *all[FILL_MAX];
+  pthread_mutex_lock(&fill_lock);
+  memcpy(all, table, sizeof(all));
+  memset(table, 0, sizeof(table));
+  pthread_mutex_unlock(&fill_lock);
+  for (int i = 0; i < FILL_MAX; ++i)
+    if (all[i])
+      release(all[i]);
+}
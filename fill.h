@@ -0,0 +1,61 @@
+#ifndef FILL_H
+#define FILL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Resource exhaustion for failure scenarios: large files and full
+ * filesystems without writing the bytes.
+ *
+ * fill_allocate() makes one file of a given size, either sparse
+ * (ftruncate: apparent size only) or allocated (fallocate: blocks reserved,
+ * nothing written). fill_exhaust() reads statvfs for the filesystem holding
+ * a directory and creates just enough in a hidden .taskd-fill-XXXXXX
+ * directory there to bring free space or free inodes down to a target:
+ * fallocated chunk files for space, empty files spread over subdirectories
+ * for inodes. Workers split the files between them.
+ *
+ * Every call returns a handle, and fill_release() removes exactly what that
+ * call created. Handles are positive integers, not reused until the
+ * counter wraps; everything still held is released on reset and when
+ * taskd stops.
+ */
+#define FILL_MAX 64
+#define FILL_MAX_THREADS 16
+#define FILL_MAX_INODES (1u << 24)
+
+typedef enum {
+  FILL_SPACE,  /* free bytes (f_bavail), as df reports them */
+  FILL_INODES, /* free inodes (f_favail) */
+} fill_resource;
+
+/* Create path, which must not exist, with the given size: blocks allocated
+ * if allocate, else sparse. Returns a handle, or 0 on failure. */
+uint32_t fill_allocate(const char *path, uint64_t size, bool allocate);
+
+/* Fill the filesystem holding dir until at most target_free bytes or
+ * inodes remain (threads 0: one per CPU). Running out of space on the way
+ * counts as reaching the target. Returns a handle, or 0 on failure with
+ * anything created removed again. Filesystems without a fixed inode count
+ * cannot be filled with inodes. */
+uint32_t fill_exhaust(const char *dir, fill_resource res,
+                      uint64_t target_free, int threads);
+
+/* Remove what the handle's call created. A file that was replaced since is
+ * left alone. False for an unknown handle or if not everything could be
+ * removed. */
+bool fill_release(uint32_t id);
+
+/* Release every handle. */
+void fill_release_all(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILL_H */
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include "flight_recorder.h"
+#include "fs_utils.h"
+// clang-format off
+#include <sys/socket.h>
+#include "protocol.h"
+// clang-format on
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Fixed ring of the last FR_CAPACITY jobs. Recording is a struct copy under
+ * an uncontended mutex, so it stays on for every job. */
+static fr_entry ring[FR_CAPACITY];
+static uint64_t next_seq = 0;
+static pthread_mutex_t fr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void fr_record(uint64_t recipe_hash, uint32_t recipe_bytes,
+               const sm_job_stats *job, int result, uint32_t report_bytes) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  pthread_mutex_lock(&fr_lock);
+  fr_entry *e = &ring[next_seq % FR_CAPACITY];
+  e->seq = next_seq++;
+  e->wall_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  e->recipe_hash = recipe_hash;
+  e->recipe_bytes = recipe_bytes;
+  e->report_bytes = report_bytes;
+  e->result = result;
+  if (job) {
+    e->job = *job;
+    e->err = job->err;
+  } else {
+    memset(&e->job, 0, sizeof(e->job));
+    e->err = -1;
+  }
+  pthread_mutex_unlock(&fr_lock);
+}
+
+static cJSON *entry_to_json(const fr_entry *e) {
+  cJSON *obj = cJSON_CreateObject();
+  if (!obj)
+    return NULL;
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)e->recipe_hash);
+  cJSON_AddNumberToObject(obj, "seq", (double)e->seq);
+  cJSON_AddNumberToObject(obj, "time_ms", (double)(e->wall_ns / 1000000));
+  cJSON_AddStringToObject(obj, "recipe_hash", hash);
+  cJSON_AddNumberToObject(obj, "recipe_bytes", e->recipe_bytes);
+  cJSON_AddNumberToObject(obj, "instrs", e->job.instr_count);
+  cJSON *ops = cJSON_AddObjectToObject(obj, "ops");
+  for (int op = 0; op < SM_OP_COUNT; ++op) {
+    if (e->job.op_hist[op] == 0)
+      continue;
+    const char *name = opcode_to_string((sm_opcode)op);
+    cJSON_AddNumberToObject(ops, name ? name : "?", e->job.op_hist[op]);
+  }
+  cJSON_AddNumberToObject(obj, "duration_us",
+                          (double)(e->job.duration_ns / 1000));
+  cJSON_AddNumberToObject(obj, "result", e->result);
+  cJSON_AddNumberToObject(obj, "err", e->err);
+  cJSON_AddNumberToObject(obj, "report_bytes", e->report_bytes);
+  cJSON_AddNumberToObject(obj, "peak_bytes", (double)e->job.alloc.peak);
+  return obj;
+}
+
+cJSON *fr_dump_json(void) {
+  cJSON *root = cJSON_CreateObject();
+  if (!root)
+    return NULL;
+  cJSON *arr = cJSON_AddArrayToObject(root, "flight");
+  pthread_mutex_lock(&fr_lock);
+  uint64_t first = next_seq > FR_CAPACITY ? next_seq - FR_CAPACITY : 0;
+  for (uint64_t s = first; s < next_seq; ++s) {
+    cJSON *e = entry_to_json(&ring[s % FR_CAPACITY]);
+    if (e)
+      cJSON_AddItemToArray(arr, e);
+  }
+  pthread_mutex_unlock(&fr_lock);
+  return root;
+}
+
+bool fr_dump_file(const char *path) {
+  if (!path)
+    return false;
+  cJSON *root = fr_dump_json();
+  char *out = root ? cJSON_PrintUnformatted(root) : NULL;
+  cJSON_Delete(root);
+  if (!out)
+    return false;
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  bool ok = fs_write(tmp, out, "w") && rename(tmp, path) == 0;
+  sm_free(out);
+  return ok;
+}
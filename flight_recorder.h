@@ -0,0 +1,44 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include "state_machine.h"
+#include <cJSON.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_CAPACITY 64
+#define FR_DUMP_PATH "/root/taskd_flight.json"
+
+/* One finished (or rejected) job. result is the value returned to the host,
+ * err the executor error code; a recipe that failed to parse is recorded
+ * with instr_count 0 and result -1. */
+typedef struct {
+  uint64_t seq;
+  uint64_t wall_ns; /* CLOCK_REALTIME when the job was recorded */
+  uint64_t recipe_hash;
+  uint32_t recipe_bytes;
+  uint32_t report_bytes;
+  int result;
+  int err;
+  sm_job_stats job;
+} fr_entry;
+
+/* Append an entry, overwriting the oldest once FR_CAPACITY is reached. */
+void fr_record(uint64_t recipe_hash, uint32_t recipe_bytes,
+               const sm_job_stats *job, int result, uint32_t report_bytes);
+
+/* Entries oldest first as {"flight": [...]} */
+cJSON *fr_dump_json(void);
+
+/* Write the dump to path via a temporary file and rename(). */
+bool fr_dump_file(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FLIGHT_RECORDER_H */
@@ -1,6 +1,8 @@
 #ifndef FS_UTILS_H
 #define FS_UTILS_H
 
+#include "accounts.h"
+#include "sm_alloc.h"
 #include "xxhash.h"
 #include <dirent.h>
 #include <errno.h>
@@ -22,7 +24,28 @@
 extern "C" {
 #endif
 
-static inline long rand_range(long min, long max);
+/* Random numbers for the executor. Each caller keeps its own state, so VMs
+ * on different threads (the main worker, the scheduler, sm_test
+ * --concurrency) never interleave on the process-wide rand() state. Seeded
+ * with glibc's default TYPE_3 table, it gives the same sequence as
+ * srand()/rand(). */
+typedef struct {
+  struct random_data data;
+  char state[128];
+} fs_rng;
+
+static inline void fs_rng_seed(fs_rng *r, unsigned int seed) {
+  memset(r, 0, sizeof(*r));
+  initstate_r(seed, r->state, sizeof(r->state), &r->data);
+}
+
+static inline long fs_rng_next(fs_rng *r) {
+  int32_t v = 0;
+  random_r(&r->data, &v);
+  return v;
+}
+
+static inline long rand_range(fs_rng *r, long min, long max);
 
 static inline bool fs_create(const char *path, const char *type) {
   if (!path || !type)
@@ -177,13 +200,13 @@ static inline char *fs_read(const char *path) {
     return NULL;
   }
   rewind(f);
-  char *buf = malloc((size_t)sz + 1);
+  char *buf = sm_malloc((size_t)sz + 1);
   if (!buf) {
     fclose(f);
     return NULL;
   }
   if (fread(buf, 1, (size_t)sz, f) != (size_t)sz) {
-    free(buf);
+    sm_free(buf);
     fclose(f);
     return NULL;
   }
@@ -197,7 +220,7 @@ static inline char *fs_list_dir(const char *path) {
   if (!d)
     return NULL;
   size_t cap = 256, len = 0;
-  char *buf = malloc(cap);
+  char *buf = sm_malloc(cap);
   if (!buf) {
     closedir(d);
     return NULL;
@@ -209,9 +232,9 @@ static inline char *fs_list_dir(const char *path) {
     size_t n = strlen(e->d_name);
     if (len + n + 2 > cap) {
       cap = (cap + n + 2) * 2;
-      char *tmp = realloc(buf, cap);
+      char *tmp = sm_realloc(buf, cap);
       if (!tmp) {
-        free(buf);
+        sm_free(buf);
         closedir(d);
         return NULL;
       }
@@ -223,8 +246,8 @@ static inline char *fs_list_dir(const char *path) {
   }
   closedir(d);
   if (len == 0) {
-    free(buf);
-    return strdup("");
+    sm_free(buf);
+    return sm_strdup("");
   }
   buf[len] = '\0';
   return buf;
@@ -247,7 +270,7 @@ static inline char *fs_hash(const char *path) {
   fclose(f);
   unsigned long long h = XXH64_digest(st);
   XXH64_freeState(st);
-  char *out = malloc(17);
+  char *out = sm_malloc(17);
   if (!out)
     return NULL;
   snprintf(out, 17, "%016llx", h);
@@ -269,30 +292,31 @@ static inline bool fs_chmod(const char *path, mode_t mode) {
 static inline bool fs_chown(const char *path, const char *spec) {
   if (!path || !spec)
     return false;
-  char *tmp = strdup(spec);
+  char *tmp = sm_strdup(spec);
   if (!tmp)
     return false;
   char *grp = strchr(tmp, ':');
   if (grp)
     *grp++ = '\0';
-  struct passwd *pw = getpwnam(tmp);
-  uid_t uid = pw ? pw->pw_uid : (uid_t)-1;
+  /* Cached lookups: chown loops resolve the same names over and over */
+  uid_t uid = (uid_t)-1;
   gid_t gid = (gid_t)-1;
-  if (grp) {
-    struct group *g = getgrnam(grp);
-    gid = g ? g->gr_gid : (gid_t)-1;
-  }
-  free(tmp);
+  if (!acct_uid(tmp, &uid))
+    uid = (uid_t)-1;
+  if (grp && !acct_gid(grp, &gid))
+    gid = (gid_t)-1;
+  sm_free(tmp);
   if (uid == (uid_t)-1 && gid == (gid_t)-1)
     return false;
   return chown(path, uid == (uid_t)-1 ? -1 : uid,
                gid == (gid_t)-1 ? -1 : gid) == 0;
 }
 
-static inline const char *rand_choice(const char **options, size_t count) {
+static inline const char *rand_choice(fs_rng *r, const char **options,
+                                      size_t count) {
   if (!options || count == 0)
     return NULL;
-  size_t idx = (size_t)rand() % count;
+  size_t idx = (size_t)fs_rng_next(r) % count;
   return options[idx];
 }
 
@@ -311,7 +335,7 @@ static inline char *list_index(const char *list, size_t idx) {
     return NULL;
   const char *end = strchr(start, '\n');
   size_t len = end ? (size_t)(end - start) : strlen(start);
-  char *out = malloc(len + 1);
+  char *out = sm_malloc(len + 1);
   if (!out)
     return NULL;
   memcpy(out, start, len);
@@ -325,7 +349,7 @@ static inline char *path_join(const char *base, const char *name) {
   size_t lb = strlen(base);
   size_t ln = strlen(name);
   size_t need = lb + ln + 2;
-  char *out = malloc(need);
+  char *out = sm_malloc(need);
   if (!out)
     return NULL;
   memcpy(out, base, lb);
@@ -343,7 +367,7 @@ static inline char *fs_exec(const char *cmd) {
   if (!p)
     return NULL;
   size_t cap = 256, len = 0;
-  char *buf = malloc(cap);
+  char *buf = sm_malloc(cap);
   if (!buf) {
     pclose(p);
     return NULL;
@@ -352,9 +376,9 @@ static inline char *fs_exec(const char *cmd) {
   while ((c = fgetc(p)) != EOF) {
     if (len + 1 >= cap) {
       cap *= 2;
-      char *tmp = realloc(buf, cap);
+      char *tmp = sm_realloc(buf, cap);
       if (!tmp) {
-        free(buf);
+        sm_free(buf);
         pclose(p);
         return NULL;
       }
@@ -367,24 +391,25 @@ static inline char *fs_exec(const char *cmd) {
   return buf;
 }
 
-static inline char *fs_random_walk(const char *root, int depth) {
+static inline char *fs_random_walk(const char *root, int depth,
+                                   fs_rng *r) {
   if (!root || depth < 0)
     return NULL;
-  char *cur = strdup(root);
+  char *cur = sm_strdup(root);
   if (!cur)
     return NULL;
   for (int i = 0; i < depth; ++i) {
     char *list = fs_list_dir(cur);
     if (!list || list[0] == '\0') {
-      free(list);
+      sm_free(list);
       break;
     }
 
     size_t cap = 16, count = 0;
-    char **dirs = malloc(cap * sizeof(*dirs));
+    char **dirs = sm_malloc(cap * sizeof(*dirs));
     if (!dirs) {
-      free(list);
-      free(cur);
+      sm_free(list);
+      sm_free(cur);
       return NULL;
     }
 
@@ -398,21 +423,21 @@ static inline char *fs_random_walk(const char *root, int depth) {
         if (lstat(tmp, &st) == 0 && S_ISDIR(st.st_mode)) {
           if (count == cap) {
             cap *= 2;
-            char **tmp_dirs = realloc(dirs, cap * sizeof(*dirs));
+            char **tmp_dirs = sm_realloc(dirs, cap * sizeof(*dirs));
             if (!tmp_dirs) {
-              free(tmp);
+              sm_free(tmp);
               for (size_t i = 0; i < count; ++i)
-                free(dirs[i]);
-              free(dirs);
-              free(list);
-              free(cur);
+                sm_free(dirs[i]);
+              sm_free(dirs);
+              sm_free(list);
+              sm_free(cur);
               return NULL;
             }
             dirs = tmp_dirs;
           }
           dirs[count++] = tmp; /* keep absolute path */
         } else {
-          free(tmp);
+          sm_free(tmp);
         }
       }
       if (!nl)
@@ -421,20 +446,20 @@ static inline char *fs_random_walk(const char *root, int depth) {
     }
 
     if (count == 0) {
-      free(dirs);
-      free(list);
+      sm_free(dirs);
+      sm_free(list);
       break;
     }
 
-    long idx = rand_range(0, (long)count - 1);
+    long idx = rand_range(r, 0, (long)count - 1);
     char *next = dirs[idx];
     for (size_t j = 0; j < count; ++j) {
       if (j != (size_t)idx)
-        free(dirs[j]);
+        sm_free(dirs[j]);
     }
-    free(dirs);
-    free(list);
-    free(cur);
+    sm_free(dirs);
+    sm_free(list);
+    sm_free(cur);
     cur = next; /* already absolute path */
   }
   return cur;
@@ -475,7 +500,7 @@ static inline bool fs_dir_contains(const char *a, const char *b) {
   return dir_contains_recursive(a, b);
 }
 
-static inline long rand_range(long min, long max) {
+static inline long rand_range(fs_rng *r, long min, long max) {
   if (max < min) {
     long tmp = min;
     min = max;
@@ -484,11 +509,9 @@ static inline long rand_range(long min, long max) {
   long diff = max - min + 1;
   if (diff <= 0)
     return min;
-  return (long)(rand() % diff) + min;
+  return fs_rng_next(r) % diff + min;
 }
 
-static inline void seed_apply(unsigned int seed) { srand(seed); }
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include "fsearch.h"
+#include "proc_utils.h"
+#include "sm_alloc.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+  const char *needle;
+  size_t nlen;
+  const fsearch_opts *o;
+  sm_buf out;
+  uint64_t records;
+  bool done;
+  char *buf;  /* files are read through this in chunks */
+  size_t cap; /* FSEARCH_READ_MAX, or twice a longer needle */
+  char path[PATH_MAX];
+} search;
+
+/* Where the scan of one file stands; offsets are from the start of the
+ * file, base being that of the chunk in the buffer */
+typedef struct {
+  uint64_t base;
+  uint64_t pos;     /* where the next match may start */
+  uint64_t counted; /* lines are counted up to here */
+  uint64_t line, hits;
+  bool skip; /* past a match, looking for the end of its line */
+} file_scan;
+
+static uint64_t count_lines(const char *p, size_t n) {
+  uint64_t lines = 0;
+  for (const char *end = p + n; (p = memchr(p, '\n', (size_t)(end - p)));
+       ++p)
+    ++lines;
+  return lines;
+}
+
+/* memmem() for the needle, 16 positions at a time where SSE2 exists:
+ * compare the first and last needle bytes at once and memcmp() only where
+ * both agree. Far fewer false starts than memmem's first-byte scan on
+ * text full of common letters. */
+static const char *find(const char *h, size_t n, const char *nd, size_t m) {
+  if (m == 1)
+    return memchr(h, nd[0], n);
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(nd[0]);
+  const __m128i last = _mm_set1_epi8(nd[m - 1]);
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(h + at + 1, nd + 1, m - 2) == 0)
+        return h + at;
+    }
+  }
+#endif
+  return memmem(h + i, n - i, nd, m);
+}
+
+/* Count one record against the limit */
+static void emitted(search *s) {
+  if (++s->records == s->o->limit)
+    s->done = true;
+}
+
+/* Search one chunk of len bytes, whose last keep bytes come again at the
+ * start of the next one. Returns false once the file needs no more. */
+static bool scan(search *s, file_scan *f, const char *buf, size_t len,
+                 size_t keep, size_t path_len) {
+  fsearch_mode mode = s->o->mode;
+  size_t pos = (size_t)(f->pos - f->base);
+  char num[48];
+  if (f->skip) {
+    const char *nl = memchr(buf + pos, '\n', len - pos);
+    f->skip = !nl;
+    pos = nl ? (size_t)(nl - buf) + 1 : len;
+  }
+  while (!f->skip && !s->done && len - pos >= s->nlen) {
+    const char *m = find(buf + pos, len - pos, s->needle, s->nlen);
+    if (!m)
+      break;
+    size_t off = (size_t)(m - buf);
+    ++f->hits;
+    if (mode == FSEARCH_FILES)
+      return false;
+    if (mode == FSEARCH_MATCHES) {
+      size_t from = (size_t)(f->counted - f->base);
+      f->line += count_lines(buf + from, off - from);
+      f->counted = f->base + off;
+      proc_put_clean(&s->out, s->path, path_len);
+      int n = snprintf(num, sizeof(num), "\t%llu\t%llu\n",
+                       (unsigned long long)f->line,
+                       (unsigned long long)(f->base + off));
+      sm_buf_append(&s->out, num, (size_t)n);
+      emitted(s);
+    }
+    /* One record per line: carry on after the end of this one */
+    const char *nl = memchr(m, '\n', len - off);
+    f->skip = !nl;
+    pos = nl ? (size_t)(nl - buf) + 1 : len;
+  }
+  if (s->done)
+    return false;
+  /* A match starting in the kept bytes would run past this chunk */
+  size_t end = len - keep;
+  if (mode == FSEARCH_MATCHES && f->counted < f->base + end) {
+    size_t from = (size_t)(f->counted - f->base);
+    f->line += count_lines(buf + from, end - from);
+    f->counted = f->base + end;
+  }
+  f->pos = f->base + (pos > end ? pos : end);
+  return true;
+}
+
+/* Scan an open file if it is regular; takes ownership of fd. The file is
+ * read with pread() in chunks that overlap by nlen - 1 bytes, so a match
+ * across two chunks is found once, and a file cut short while being
+ * scanned just ends early. */
+static void scan_fd(search *s, int fd, size_t path_len) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (uint64_t)st.st_size < s->nlen ||
+      (s->o->max_size && (uint64_t)st.st_size > s->o->max_size)) {
+    close(fd);
+    return;
+  }
+  if ((uint64_t)st.st_size > s->cap)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  file_scan f = {.line = 1};
+  size_t held = 0;
+  for (;;) {
+    ssize_t n = pread(fd, s->buf + held, s->cap - held,
+                      (off_t)(f.base + held));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    size_t len = held + (size_t)n;
+    held = len < s->nlen ? len : s->nlen - 1;
+    if (!scan(s, &f, s->buf, len, held, path_len))
+      break;
+    memmove(s->buf, s->buf + len - held, held);
+    f.base += len - held;
+  }
+  close(fd);
+  fsearch_mode mode = s->o->mode;
+  if (!f.hits || mode == FSEARCH_MATCHES || s->done)
+    return;
+  char num[48];
+  proc_put_clean(&s->out, s->path, path_len);
+  unsigned long long hits = f.hits;
+  int n = mode == FSEARCH_COUNT ? snprintf(num, sizeof(num), "\t%llu\n", hits)
+                                : snprintf(num, sizeof(num), "\n");
+  sm_buf_append(&s->out, num, (size_t)n);
+  emitted(s);
+}
+
+static int open_at(int dir_fd, const char *name, int flags) {
+  flags |= O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+  int fd = openat(dir_fd, name, flags | O_NOATIME);
+  /* O_NOATIME needs ownership or CAP_FOWNER */
+  if (fd < 0 && errno == EPERM)
+    fd = openat(dir_fd, name, flags);
+  return fd;
+}
+
+/* Search a directory; takes ownership of fd. */
+static void walk_dir(search *s, int fd, size_t path_len) {
+  DIR *d = fdopendir(fd);
+  if (!d) {
+    close(fd);
+    return;
+  }
+  for (struct dirent *de; !s->done && (de = readdir(d));) {
+    const char *n = de->d_name;
+    if (strcmp(n, ".") == 0 || strcmp(n, "..") == 0)
+      continue;
+    size_t len = strlen(n);
+    if (path_len + len + 2 > sizeof(s->path))
+      continue;
+    s->path[path_len] = '/';
+    memcpy(s->path + path_len + 1, n, len + 1);
+    unsigned char type = de->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat(fd, n, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    }
+    if (type != DT_DIR && type != DT_REG)
+      continue;
+    int sub = open_at(fd, n, O_NOFOLLOW | (type == DT_DIR ? O_DIRECTORY : 0));
+    if (sub < 0)
+      continue;
+    if (type == DT_DIR)
+      walk_dir(s, sub, path_len + 1 + len);
+    else
+      scan_fd(s, sub, path_len + 1 + len);
+  }
+  closedir(d);
+}
+
+char *fsearch_run(const char *root, const char *needle, size_t nlen,
+                  const fsearch_opts *o) {
+  if (!root || !needle || nlen == 0 || !o)
+    return NULL;
+  size_t path_len = strlen(root);
+  while (path_len > 1 && root[path_len - 1] == '/')
+    --path_len;
+  if (path_len >= sizeof(((search *)0)->path))
+    return NULL;
+  int fd = open_at(AT_FDCWD, root, 0);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    return NULL;
+  size_t cap = nlen > FSEARCH_READ_MAX / 2 ? 2 * nlen : FSEARCH_READ_MAX;
+  search *s = sm_malloc(sizeof(*s));
+  char *buf = cap >= nlen ? sm_malloc(cap) : NULL;
+  if (!s || !buf) {
+    sm_free(s);
+    sm_free(buf);
+    close(fd);
+    return NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  s->needle = needle;
+  s->nlen = nlen;
+  s->o = o;
+  s->buf = buf;
+  s->cap = cap;
+  memcpy(s->path, root, path_len);
+  s->path[path_len] = '\0';
+  sm_buf_append(&s->out, "", 0);
+  if (S_ISDIR(st.st_mode))
+    /* "/" would otherwise give "//etc" */
+    walk_dir(s, fd, strcmp(s->path, "/") == 0 ? 0 : path_len);
+  else
+    scan_fd(s, fd, path_len);
+  char *out = s->out.data;
+  if (s->out.failed) {
+    sm_free(out);
+    out = NULL;
+  }
+  sm_free(buf);
+  sm_free(s);
+  return out;
+}
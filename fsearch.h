@@ -0,0 +1,47 @@
+#ifndef FSEARCH_H
+#define FSEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed-string search over a file or a tree, in place of grep -r.
+ *
+ * The tree is walked with openat/fdopendir without following symbolic
+ * links, and every regular file is scanned with memmem(), skipping to the
+ * next line with memchr() after each match; both are vectorized in libc.
+ * Files are read with pread() in chunks, so one cut short while it is
+ * scanned just ends early. Files are opened with O_NOATIME where allowed,
+ * so a search does not disturb the access times a task may check. The
+ * walk stops as soon as limit records are out.
+ */
+#define FSEARCH_READ_MAX (64u * 1024) /* bytes read at a time */
+
+typedef enum {
+  FSEARCH_MATCHES, /* "path\tline\toffset" per matching line */
+  FSEARCH_FILES,   /* "path" per file with a match */
+  FSEARCH_COUNT,   /* "path\tlines" per file with a match */
+} fsearch_mode;
+
+typedef struct {
+  fsearch_mode mode;
+  uint64_t max_size; /* larger files are skipped; 0: no limit */
+  uint64_t limit;    /* stop after this many records; 0: no limit */
+} fsearch_opts;
+
+/* Search root (a file, or a directory searched recursively) for needle.
+ * Returns the records, one per line ("" when nothing matches; caller frees
+ * with sm_free), or NULL if root cannot be opened or needle is empty. */
+char *fsearch_run(const char *root, const char *needle, size_t nlen,
+                  const fsearch_opts *o);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FSEARCH_H */
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include "fsmeta.h"
+#include "proc_utils.h"
+#include "sm_alloc.h"
+#include "taskd_log.h"
+#include "xxhash.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define QUEUE_MAX 256 /* open directories waiting; past it, walk inline */
+#define INLINE_DEPTH 64
+
+typedef struct {
+  char *path; /* absolute */
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec times[2];
+} meta_rec;
+
+typedef struct {
+  meta_rec *v;
+  size_t n;
+  size_t cap;
+} rec_vec;
+
+/* Everything recorded since the last restore */
+static rec_vec journal;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct dir_item {
+  struct dir_item *next;
+  int fd;
+  char rel[]; /* path below the root, "" for the root */
+} dir_item;
+
+typedef struct {
+  const fsmeta_spec *s;
+  const char *root;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  dir_item *head;
+  uint32_t queued;
+  uint32_t active; /* queued or being walked */
+  _Atomic uint64_t entries;
+  _Atomic uint64_t changed;
+  _Atomic uint64_t failed;
+  _Atomic uint64_t records; /* across threads, for the cap */
+} walk;
+
+static dir_item *item_new(int fd, const char *rel) {
+  size_t len = strlen(rel);
+  dir_item *it = sm_malloc(sizeof(*it) + len + 1);
+  if (!it)
+    return NULL;
+  it->fd = fd;
+  memcpy(it->rel, rel, len + 1);
+  return it;
+}
+
+/* Queue a directory; false if the queue is long, leaving it to the
+ * caller. */
+static bool push(walk *w, int fd, const char *rel, bool force) {
+  pthread_mutex_lock(&w->lock);
+  bool room = force || w->queued < QUEUE_MAX;
+  dir_item *it = room ? item_new(fd, rel) : NULL;
+  if (it) {
+    it->next = w->head;
+    w->head = it;
+    w->queued++;
+    w->active++;
+    pthread_cond_signal(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return it != NULL;
+}
+
+static void record(walk *w, rec_vec *out, const char *rel,
+                   const struct stat *st) {
+  if (atomic_fetch_add(&w->records, 1) >= FSMETA_MAX_RECORDS)
+    return;
+  if (out->n == out->cap) {
+    size_t cap = out->cap ? out->cap * 2 : 256;
+    meta_rec *v = sm_realloc(out->v, cap * sizeof(*v));
+    if (!v)
+      return;
+    out->v = v;
+    out->cap = cap;
+  }
+  size_t len = strlen(w->root) + strlen(rel) + 2;
+  meta_rec *r = &out->v[out->n];
+  if (!(r->path = sm_malloc(len)))
+    return;
+  snprintf(r->path, len, *rel ? "%s/%s" : "%s%s", w->root, rel);
+  r->mode = st->st_mode;
+  r->uid = st->st_uid;
+  r->gid = st->st_gid;
+  r->times[0] = st->st_atim;
+  r->times[1] = st->st_mtim;
+  out->n++;
+}
+
+static bool same_time(const struct timespec *want, const struct timespec *t) {
+  return want->tv_nsec == UTIME_OMIT ||
+         (want->tv_nsec != UTIME_NOW && want->tv_sec == t->tv_sec &&
+          want->tv_nsec == t->tv_nsec);
+}
+
+/* Apply the rules to one entry: through fd when it is set (directories),
+ * else as name relative to dir_fd. Owner first, since chown clears the
+ * setuid bits. */
+static void apply(walk *w, rec_vec *rec, int dir_fd, const char *name, int fd,
+                  const char *rel, const struct stat *st) {
+  const fsmeta_spec *s = w->s;
+  bool link = S_ISLNK(st->st_mode);
+  const fsmeta_mode *rule = S_ISDIR(st->st_mode) ? &s->dir : &s->file;
+  mode_t old = st->st_mode & 07777;
+  mode_t mode = (old & ~rule->clear) | rule->set;
+  if (s->scramble) {
+    uint64_t h = XXH64(rel, strlen(rel), s->seed);
+    mode = (mode & ~s->scramble_mask) | ((mode_t)h & s->scramble_mask);
+  }
+  bool do_chmod = !link && mode != old;
+  bool do_chown = (s->uid != (uid_t)-1 && s->uid != st->st_uid) ||
+                  (s->gid != (gid_t)-1 && s->gid != st->st_gid);
+  bool do_times = !same_time(&s->atime, &st->st_atim) ||
+                  !same_time(&s->mtime, &st->st_mtim);
+  atomic_fetch_add(&w->entries, 1);
+  if (!do_chmod && !do_chown && !do_times)
+    return;
+  if (s->record)
+    record(w, rec, rel, st);
+  bool ok = true;
+  struct timespec ts[2] = {s->atime, s->mtime};
+  if (fd >= 0) {
+    if (do_chown)
+      ok &= fchown(fd, s->uid, s->gid) == 0;
+    if (do_chmod)
+      ok &= fchmod(fd, mode) == 0;
+    if (do_times)
+      ok &= futimens(fd, ts) == 0;
+  } else {
+    if (do_chown)
+      ok &= fchownat(dir_fd, name, s->uid, s->gid,
+                     AT_SYMLINK_NOFOLLOW) == 0;
+    if (do_chmod)
+      ok &= fchmodat(dir_fd, name, mode, 0) == 0;
+    if (do_times)
+      ok &= utimensat(dir_fd, name, ts, AT_SYMLINK_NOFOLLOW) == 0;
+  }
+  atomic_fetch_add(ok ? &w->changed : &w->failed, 1);
+}
+
+/* Walk one directory; takes ownership of fd. */
+static void walk_dir(walk *w, rec_vec *rec, int fd, const char *rel,
+                     int depth) {
+  struct stat self;
+  if (fstat(fd, &self) != 0) {
+    close(fd);
+    atomic_fetch_add(&w->failed, 1);
+    return;
+  }
+  DIR *d = fdopendir(fd);
+  if (!d) {
+    close(fd);
+    atomic_fetch_add(&w->failed, 1);
+    return;
+  }
+  char path[PATH_MAX];
+  size_t base = (size_t)snprintf(path, sizeof(path), *rel ? "%s/" : "%s",
+                                 rel);
+  for (struct dirent *de; (de = readdir(d));) {
+    const char *n = de->d_name;
+    if (strcmp(n, ".") == 0 || strcmp(n, "..") == 0)
+      continue;
+    if (base + strlen(n) >= sizeof(path)) {
+      atomic_fetch_add(&w->failed, 1);
+      continue;
+    }
+    strcpy(path + base, n);
+    struct stat st;
+    if (fstatat(fd, n, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      atomic_fetch_add(&w->failed, 1);
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      apply(w, rec, fd, n, -1, path, &st);
+      continue;
+    }
+    int sub = openat(fd, n, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (sub < 0) {
+      atomic_fetch_add(&w->failed, 1);
+      continue;
+    }
+    if (!push(w, sub, path, depth >= INLINE_DEPTH))
+      walk_dir(w, rec, sub, path, depth + 1);
+  }
+  /* The directory itself last, so its own mode never gets in the way */
+  apply(w, rec, -1, NULL, fd, rel, &self);
+  closedir(d);
+}
+
+typedef struct {
+  walk *w;
+  rec_vec rec;
+} worker_arg;
+
+static void *meta_worker(void *arg) {
+  worker_arg *a = arg;
+  walk *w = a->w;
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->head && w->active > 0)
+      pthread_cond_wait(&w->cond, &w->lock);
+    dir_item *it = w->head;
+    if (it) {
+      w->head = it->next;
+      w->queued--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (!it)
+      break;
+    walk_dir(w, &a->rec, it->fd, it->rel, 0);
+    sm_free(it);
+    pthread_mutex_lock(&w->lock);
+    if (--w->active == 0)
+      pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+/* Append a thread's records to the journal; the vector is emptied. */
+static void journal_add(rec_vec *r) {
+  pthread_mutex_lock(&journal_lock);
+  for (size_t i = 0; i < r->n; ++i) {
+    if (journal.n == journal.cap) {
+      size_t cap = journal.cap ? journal.cap * 2 : 1024;
+      meta_rec *v = sm_realloc(journal.v, cap * sizeof(*v));
+      if (!v) {
+        sm_free(r->v[i].path);
+        continue;
+      }
+      journal.v = v;
+      journal.cap = cap;
+    }
+    journal.v[journal.n++] = r->v[i];
+  }
+  pthread_mutex_unlock(&journal_lock);
+  sm_free(r->v);
+  memset(r, 0, sizeof(*r));
+}
+
+char *fsmeta_apply(const char *root, const fsmeta_spec *s) {
+  if (!root || !s || s->threads < 0 || s->threads > FSMETA_MAX_THREADS)
+    return NULL;
+  int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  walk w = {.s = s, .root = root};
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  worker_arg args[FSMETA_MAX_THREADS];
+  memset(args, 0, sizeof(args));
+  pthread_t tids[FSMETA_MAX_THREADS];
+  int started = 0;
+  if (!push(&w, fd, "", true)) {
+    close(fd);
+  } else {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = s->threads ? s->threads : (int)(cpus > 0 ? cpus : 1);
+    if (threads > FSMETA_MAX_THREADS)
+      threads = FSMETA_MAX_THREADS;
+    for (int i = 0; i < threads; ++i)
+      args[i].w = &w;
+    for (; started < threads - 1; ++started)
+      if (pthread_create(&tids[started], NULL, meta_worker,
+                         &args[started + 1]) != 0)
+        break;
+    meta_worker(&args[0]); /* this thread works too */
+    for (int i = 0; i < started; ++i)
+      pthread_join(tids[i], NULL);
+  }
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.lock);
+  for (int i = 0; i <= started; ++i)
+    journal_add(&args[i].rec);
+  if (atomic_load(&w.records) > FSMETA_MAX_RECORDS)
+    TLOG(TLOG_WARN, "fsmeta: only %lld changes recorded for restore",
+         FSMETA_MAX_RECORDS);
+  if (atomic_load(&w.entries) == 0 && atomic_load(&w.failed) > 0)
+    return NULL;
+  char out[80];
+  snprintf(out, sizeof(out), "%llu\t%llu\t%llu",
+           (unsigned long long)atomic_load(&w.entries),
+           (unsigned long long)atomic_load(&w.changed),
+           (unsigned long long)atomic_load(&w.failed));
+  return sm_strdup(out);
+}
+
+void fsmeta_restore_all(void) {
+  pthread_mutex_lock(&journal_lock);
+  rec_vec r = journal;
+  memset(&journal, 0, sizeof(journal));
+  pthread_mutex_unlock(&journal_lock);
+  size_t failed = 0;
+  /* Newest first, so an entry changed twice ends as it was originally */
+  for (size_t i = r.n; i-- > 0;) {
+    meta_rec *m = &r.v[i];
+    bool ok = fchownat(AT_FDCWD, m->path, m->uid, m->gid,
+                       AT_SYMLINK_NOFOLLOW) == 0 &&
+              (S_ISLNK(m->mode) ||
+               fchmodat(AT_FDCWD, m->path, m->mode & 07777, 0) == 0) &&
+              utimensat(AT_FDCWD, m->path, m->times, AT_SYMLINK_NOFOLLOW) == 0;
+    failed += !ok;
+    sm_free(m->path);
+  }
+  sm_free(r.v);
+  if (failed)
+    TLOG(TLOG_WARN, "fsmeta: %lld entries not restored", failed);
+}
+
+/* statx() mask bits each column needs */
+static const unsigned int stat_masks[FSMETA_FIELD_COUNT] = {
+    [FSMETA_TYPE] = STATX_TYPE,   [FSMETA_MODE] = STATX_MODE,
+    [FSMETA_UID] = STATX_UID,     [FSMETA_GID] = STATX_GID,
+    [FSMETA_SIZE] = STATX_SIZE,   [FSMETA_NLINK] = STATX_NLINK,
+    [FSMETA_INO] = STATX_INO,     [FSMETA_ATIME] = STATX_ATIME,
+    [FSMETA_MTIME] = STATX_MTIME, [FSMETA_CTIME] = STATX_CTIME,
+};
+
+static const char *type_name(unsigned int mode) {
+  switch (mode & S_IFMT) {
+  case S_IFREG:
+    return "file";
+  case S_IFDIR:
+    return "dir";
+  case S_IFLNK:
+    return "link";
+  case S_IFIFO:
+    return "fifo";
+  case S_IFSOCK:
+    return "socket";
+  case S_IFCHR:
+    return "char";
+  case S_IFBLK:
+    return "block";
+  }
+  return "unknown";
+}
+
+/* One column of a statx() result, into num; returns its length. */
+static int stat_column(const struct statx *st, int field, char *num,
+                       size_t cap) {
+  switch (field) {
+  case FSMETA_TYPE:
+    return snprintf(num, cap, "%s", type_name(st->stx_mode));
+  case FSMETA_MODE:
+    return snprintf(num, cap, "%04o", st->stx_mode & 07777);
+  case FSMETA_UID:
+    return snprintf(num, cap, "%u", st->stx_uid);
+  case FSMETA_GID:
+    return snprintf(num, cap, "%u", st->stx_gid);
+  case FSMETA_SIZE:
+    return snprintf(num, cap, "%llu", (unsigned long long)st->stx_size);
+  case FSMETA_NLINK:
+    return snprintf(num, cap, "%u", st->stx_nlink);
+  case FSMETA_INO:
+    return snprintf(num, cap, "%llu", (unsigned long long)st->stx_ino);
+  case FSMETA_ATIME:
+    return snprintf(num, cap, "%lld", (long long)st->stx_atime.tv_sec);
+  case FSMETA_MTIME:
+    return snprintf(num, cap, "%lld", (long long)st->stx_mtime.tv_sec);
+  case FSMETA_CTIME:
+    return snprintf(num, cap, "%lld", (long long)st->stx_ctime.tv_sec);
+  }
+  return 0;
+}
+
+char *fsmeta_stat(const char *base, const char *paths, const uint8_t *fields,
+                  int nfields, bool follow) {
+  if (!paths || !fields || nfields <= 0)
+    return NULL;
+  int dir = AT_FDCWD;
+  if (base && (dir = open(base, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return NULL;
+  unsigned int mask = 0;
+  for (int i = 0; i < nfields; ++i)
+    mask |= stat_masks[fields[i]];
+  int flags = AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW);
+  sm_buf out = {0};
+  sm_buf_append(&out, "", 0);
+  char path[PATH_MAX];
+  char num[32];
+  for (const char *p = paths; *p && !out.failed;) {
+    const char *eol = strchr(p, '\n');
+    size_t len = eol ? (size_t)(eol - p) : strlen(p);
+    const char *line = p;
+    p += len + (eol != NULL);
+    if (len == 0)
+      continue;
+    struct statx st;
+    bool ok = len < sizeof(path);
+    if (ok) {
+      memcpy(path, line, len);
+      path[len] = '\0';
+      ok = statx(dir, path, flags, mask, &st) == 0;
+    }
+    for (int i = 0; i < nfields; ++i) {
+      if (i > 0)
+        sm_buf_append(&out, "\t", 1);
+      int f = fields[i];
+      if (f == FSMETA_PATH) {
+        proc_put_clean(&out, line, len);
+        continue;
+      }
+      int n = ok && (st.stx_mask & stat_masks[f]) == stat_masks[f]
+                  ? stat_column(&st, f, num, sizeof(num))
+                  : snprintf(num, sizeof(num), "-");
+      sm_buf_append(&out, num, (size_t)n);
+    }
+    sm_buf_append(&out, "\n", 1);
+  }
+  if (dir != AT_FDCWD)
+    close(dir);
+  if (out.failed) {
+    sm_free(out.data);
+    return NULL;
+  }
+  return out.data;
+}
@@ -0,0 +1,89 @@
+#ifndef FSMETA_H
+#define FSMETA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Recursive chmod/chown/utimens over a tree, for permission tasks.
+ *
+ * Worker threads share a queue of open directories: each one reads a
+ * directory, applies the rules to its entries with fchmodat/fchownat/
+ * utimensat relative to the directory's descriptor, and queues the
+ * subdirectories it opens (or walks them itself while the queue is long).
+ * A directory's own rules are applied through its descriptor once its
+ * entries are done. Symbolic links are never followed; their owner and
+ * times are changed, their mode cannot be.
+ *
+ * With record set, the original metadata of every entry that changed is
+ * kept, and fsmeta_restore_all() puts it back (taskd does so on reset).
+ *
+ * fsmeta_stat() is the read side: one statx() per path, asking only for
+ * the fields wanted, relative to one base directory descriptor.
+ */
+#define FSMETA_MAX_THREADS 16
+#define FSMETA_MAX_RECORDS (1u << 22)
+
+/* New mode = (old & ~clear) | set; clear 07777 sets an exact value */
+typedef struct {
+  mode_t set;
+  mode_t clear;
+} fsmeta_mode;
+
+typedef struct {
+  fsmeta_mode file; /* everything but directories and symlinks */
+  fsmeta_mode dir;
+  bool scramble;      /* then replace the scramble_mask bits with bits */
+  uint64_t seed;      /* hashed from the seed and the relative path */
+  mode_t scramble_mask;
+  uid_t uid;          /* (uid_t)-1 keeps the owner */
+  gid_t gid;          /* (gid_t)-1 keeps the group */
+  struct timespec atime; /* tv_nsec UTIME_OMIT keeps, UTIME_NOW */
+  struct timespec mtime;
+  bool record;
+  int threads;        /* 0 picks one per CPU */
+} fsmeta_spec;
+
+/* Apply the rules to root and everything below it. Returns
+ * "entries\tchanged\tfailed" (caller frees with sm_free), or NULL if root
+ * cannot be opened. */
+char *fsmeta_apply(const char *root, const fsmeta_spec *s);
+
+/* Restore everything recorded, newest first, and forget it. */
+void fsmeta_restore_all(void);
+
+/* Columns of an fsmeta_stat() record */
+typedef enum {
+  FSMETA_PATH,
+  FSMETA_TYPE,
+  FSMETA_MODE,
+  FSMETA_UID,
+  FSMETA_GID,
+  FSMETA_SIZE,
+  FSMETA_NLINK,
+  FSMETA_INO,
+  FSMETA_ATIME,
+  FSMETA_MTIME,
+  FSMETA_CTIME,
+  FSMETA_FIELD_COUNT,
+} fsmeta_field;
+
+/* Stat every line of paths (relative ones below base, or the working
+ * directory if base is NULL) and return one line per path with the fields
+ * separated by tabs; fields the path has no value for are "-". Returns ""
+ * for no paths and NULL if base cannot be opened. */
+char *fsmeta_stat(const char *base, const char *paths, const uint8_t *fields,
+                  int nfields, bool follow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FSMETA_H */
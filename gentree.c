@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include "gentree.h"
+#include "sm_alloc.h"
+#include "taskd_log.h"
+#include "xxhash.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GOLDEN 0x9e3779b97f4a7c15ull
+#define FILL_BUF (256 * 1024) /* bytes written per write() */
+#define NAME_TRIES 64
+#define SLOT_FREE UINT32_MAX
+
+/* splitmix64 finaliser: the plan draws from it sequentially, and file
+ * contents use it in counter mode, one word per index, which compilers
+ * vectorise and any thread can compute from any offset. */
+static inline uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t rng_next(uint64_t *s) {
+  *s += GOLDEN;
+  return mix64(*s);
+}
+
+/* Uniform in [0, n) */
+static inline uint64_t rng_below(uint64_t *s, uint64_t n) {
+  return (uint64_t)(((unsigned __int128)rng_next(s) * n) >> 64);
+}
+
+typedef struct {
+  uint32_t parent;
+  uint32_t first_file; /* index into plan.order */
+  uint32_t nfiles;
+  uint32_t level; /* 0 for the root */
+} dir_node;
+
+typedef struct {
+  const gentree_spec *s;
+  uint32_t ndirs;
+  dir_node *dirs;    /* depth-first preorder, root first */
+  uint32_t *file_dir;
+  uint64_t *file_size;
+  uint32_t *order; /* file indices grouped by directory */
+  char *names;     /* dirs, then files, name_len + 1 bytes each */
+  uint32_t *set;   /* open addressing over node ids, for unique names */
+  size_t set_cap;
+  uint64_t rng;
+  uint64_t bytes;
+} plan;
+
+static inline char *name_of(const plan *p, uint32_t node) {
+  return p->names + (size_t)node * (size_t)(p->s->name_len + 1);
+}
+
+static inline uint32_t parent_of(const plan *p, uint32_t node) {
+  return node < p->ndirs ? p->dirs[node].parent
+                         : p->file_dir[node - p->ndirs];
+}
+
+/* Directories in a full tree, or 0 when it exceeds GENTREE_MAX_DIRS */
+static uint32_t tree_size(int depth, int fanout) {
+  uint64_t total = 1, level = 1;
+  for (int i = 0; i < depth; ++i) {
+    level *= (uint64_t)fanout;
+    total += level;
+    if (total > GENTREE_MAX_DIRS)
+      return 0;
+  }
+  return (uint32_t)total;
+}
+
+bool gentree_spec_valid(const gentree_spec *s) {
+  size_t alen = strnlen(s->alphabet, sizeof(s->alphabet));
+  return s->depth >= 0 && s->depth <= GENTREE_MAX_DEPTH && s->fanout >= 0 &&
+         (s->depth == 0 || s->fanout > 0) &&
+         tree_size(s->depth, s->fanout) != 0 &&
+         s->files <= GENTREE_MAX_FILES && s->size_min <= s->size_max &&
+         s->size_max <= GENTREE_MAX_SIZE && s->name_len > 0 &&
+         s->name_len <= GENTREE_MAX_NAME && alen > 0 &&
+         alen < sizeof(s->alphabet) && !memchr(s->alphabet, '/', alen) &&
+         s->threads >= 0 && s->threads <= GENTREE_MAX_THREADS;
+}
+
+/* Draw a name for node under its parent that no sibling has. */
+static bool draw_name(plan *p, uint32_t node) {
+  const gentree_spec *s = p->s;
+  size_t alen = strlen(s->alphabet), len = (size_t)s->name_len;
+  char *name = name_of(p, node);
+  uint32_t parent = parent_of(p, node);
+  for (int tries = 0; tries < NAME_TRIES; ++tries) {
+    for (size_t i = 0; i < len; ++i)
+      name[i] = s->alphabet[rng_below(&p->rng, alen)];
+    name[len] = '\0';
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    size_t slot = XXH64(name, len, parent) & (p->set_cap - 1);
+    bool taken = false;
+    for (; p->set[slot] != SLOT_FREE; slot = (slot + 1) & (p->set_cap - 1)) {
+      uint32_t other = p->set[slot];
+      if (parent_of(p, other) == parent &&
+          memcmp(name_of(p, other), name, len) == 0) {
+        taken = true;
+        break;
+      }
+    }
+    if (!taken) {
+      p->set[slot] = node;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Children of d in preorder; *next is the next free directory id. */
+static bool plan_dirs(plan *p, uint32_t d, uint32_t *next) {
+  if ((int)p->dirs[d].level == p->s->depth)
+    return true;
+  for (int i = 0; i < p->s->fanout; ++i) {
+    uint32_t c = (*next)++;
+    p->dirs[c].parent = d;
+    p->dirs[c].level = p->dirs[d].level + 1;
+    if (!draw_name(p, c) || !plan_dirs(p, c, next))
+      return false;
+  }
+  return true;
+}
+
+static uint64_t draw_size(plan *p) {
+  const gentree_spec *s = p->s;
+  uint64_t lo = s->size_min, hi = s->size_max;
+  if (s->dist == GENTREE_LOG2 && hi > 0) {
+    /* Pick a bit width, then clamp [2^(b-1), 2^b - 1] to the range */
+    int blo = lo ? 64 - __builtin_clzll(lo) : 0;
+    int bhi = 64 - __builtin_clzll(hi);
+    int b = blo + (int)rng_below(&p->rng, (uint64_t)(bhi - blo + 1));
+    uint64_t band_lo = b ? 1ull << (b - 1) : 0;
+    uint64_t band_hi = b ? (1ull << b) - 1 : 0;
+    lo = band_lo > lo ? band_lo : lo;
+    hi = band_hi < hi ? band_hi : hi;
+  }
+  return lo + rng_below(&p->rng, hi - lo + 1);
+}
+
+static void plan_free(plan *p) {
+  sm_free(p->dirs);
+  sm_free(p->file_dir);
+  sm_free(p->file_size);
+  sm_free(p->order);
+  sm_free(p->names);
+  sm_free(p->set);
+}
+
+static bool plan_build(plan *p, const gentree_spec *s) {
+  memset(p, 0, sizeof(*p));
+  p->s = s;
+  p->ndirs = tree_size(s->depth, s->fanout);
+  size_t nodes = (size_t)p->ndirs + s->files;
+  p->set_cap = 16;
+  while (p->set_cap < nodes * 2)
+    p->set_cap *= 2;
+  p->dirs = sm_calloc(p->ndirs, sizeof(*p->dirs));
+  p->file_dir = sm_malloc((s->files + 1) * sizeof(*p->file_dir));
+  p->file_size = sm_malloc((s->files + 1) * sizeof(*p->file_size));
+  p->order = sm_malloc((s->files + 1) * sizeof(*p->order));
+  p->names = sm_malloc(nodes * (size_t)(s->name_len + 1));
+  p->set = sm_malloc(p->set_cap * sizeof(*p->set));
+  if (!p->dirs || !p->file_dir || !p->file_size || !p->order || !p->names ||
+      !p->set)
+    return false;
+  memset(p->set, 0xff, p->set_cap * sizeof(*p->set));
+  p->rng = s->seed;
+  uint32_t next = 1;
+  if (!plan_dirs(p, 0, &next))
+    return false;
+  for (uint32_t f = 0; f < s->files; ++f) {
+    uint32_t d = (uint32_t)rng_below(&p->rng, p->ndirs);
+    p->file_dir[f] = d;
+    p->dirs[d].nfiles++;
+    if (!draw_name(p, p->ndirs + f))
+      return false;
+    p->file_size[f] = draw_size(p);
+    p->bytes += p->file_size[f];
+  }
+  /* Group files by directory, keeping draw order within each */
+  uint32_t at = 0;
+  for (uint32_t d = 0; d < p->ndirs; ++d) {
+    p->dirs[d].first_file = at;
+    at += p->dirs[d].nfiles;
+    p->dirs[d].nfiles = 0;
+  }
+  for (uint32_t f = 0; f < s->files; ++f) {
+    dir_node *d = &p->dirs[p->file_dir[f]];
+    p->order[d->first_file + d->nfiles++] = f;
+  }
+  return true;
+}
+
+/* ----- building ----- */
+
+/* A preorder range of directories. Only the first one's parent must exist;
+ * with make_dirs the whole range is created, otherwise it already was. */
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  bool make_dirs;
+} work_unit;
+
+typedef struct {
+  const plan *p;
+  int root_fd;
+  work_unit *units;
+  uint32_t nunits;
+  _Atomic uint32_t next;
+  atomic_bool failed;
+} build_state;
+
+/* Path of d relative to the root */
+static void dir_path(const plan *p, uint32_t d, char *buf, size_t cap) {
+  uint32_t chain[GENTREE_MAX_DEPTH];
+  int n = 0;
+  for (; d != 0; d = p->dirs[d].parent)
+    chain[n++] = d;
+  size_t len = 0;
+  buf[len++] = '.';
+  while (n > 0 && len < cap) {
+    const char *name = name_of(p, chain[--n]);
+    len += (size_t)snprintf(buf + len, cap - len, "/%s", name);
+  }
+  buf[len < cap ? len : cap - 1] = '\0';
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    buf += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static bool make_file(const plan *p, int dir_fd, uint32_t f, uint8_t *buf) {
+  int fd = openat(dir_fd, name_of(p, p->ndirs + f),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  uint64_t key = mix64(p->s->seed ^ mix64((uint64_t)f + 1));
+  uint64_t size = p->file_size[f], word = 0;
+  bool ok = true;
+  for (uint64_t off = 0; ok && off < size;) {
+    size_t n = size - off < FILL_BUF ? (size_t)(size - off) : FILL_BUF;
+    uint64_t *w = (uint64_t *)buf;
+    for (size_t i = 0; i < (n + 7) / 8; ++i)
+      w[i] = htole64(mix64(key + (word + i) * GOLDEN));
+    word += FILL_BUF / 8;
+    ok = write_all(fd, buf, n);
+    off += n;
+  }
+  return close(fd) == 0 && ok;
+}
+
+static bool run_unit(build_state *b, const work_unit *u, uint8_t *buf) {
+  const plan *p = b->p;
+  uint32_t base = p->dirs[u->start].level;
+  /* Open directory per level of the range, indexed from base */
+  int fds[GENTREE_MAX_DEPTH + 1];
+  char path[PATH_MAX];
+  dir_path(p, u->start, path, sizeof(path));
+  if (u->make_dirs && mkdirat(b->root_fd, path, 0755) != 0 && errno != EEXIST)
+    return false;
+  fds[0] = openat(b->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fds[0] < 0)
+    return false;
+  int open_levels = 1;
+  bool ok = true;
+  for (uint32_t d = u->start; ok && d < u->end; ++d) {
+    uint32_t lv = p->dirs[d].level - base;
+    if (d != u->start) {
+      while (open_levels > (int)lv)
+        close(fds[--open_levels]);
+      const char *name = name_of(p, d);
+      ok = mkdirat(fds[lv - 1], name, 0755) == 0 || errno == EEXIST;
+      fds[lv] = ok ? openat(fds[lv - 1], name,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                   : -1;
+      if (fds[lv] < 0) {
+        ok = false;
+        break;
+      }
+      open_levels = (int)lv + 1;
+    }
+    const dir_node *dn = &p->dirs[d];
+    for (uint32_t i = 0; ok && i < dn->nfiles; ++i)
+      ok = make_file(p, fds[lv], p->order[dn->first_file + i], buf);
+  }
+  while (open_levels > 0)
+    close(fds[--open_levels]);
+  return ok;
+}
+
+static void *build_worker(void *arg) {
+  build_state *b = arg;
+  uint8_t *buf = sm_malloc(FILL_BUF);
+  if (!buf) {
+    atomic_store(&b->failed, true);
+    return NULL;
+  }
+  for (;;) {
+    if (atomic_load(&b->failed))
+      break;
+    uint32_t i = atomic_fetch_add(&b->next, 1);
+    if (i >= b->nunits)
+      break;
+    if (!run_unit(b, &b->units[i], buf)) {
+      TLOG(TLOG_WARN, "gentree: unit %lld failed: errno %lld", i, errno);
+      atomic_store(&b->failed, true);
+    }
+  }
+  sm_free(buf);
+  return NULL;
+}
+
+/* Units: each directory above the split level on its own (files only;
+ * created up front) and every subtree rooted at the split level. The
+ * split is the first level with enough subtrees to keep the threads busy. */
+static work_unit *plan_units(const plan *p, int threads, uint32_t *count,
+                             uint32_t *split_level) {
+  const gentree_spec *s = p->s;
+  int split = 0;
+  uint64_t width = 1;
+  while (split < s->depth && width < (uint64_t)threads * 4) {
+    width *= (uint64_t)s->fanout;
+    ++split;
+  }
+  /* Preorder size of a subtree rooted at the split level */
+  uint32_t sub = tree_size(s->depth - split, s->fanout);
+  work_unit *units = sm_malloc(p->ndirs * sizeof(*units));
+  if (!units)
+    return NULL;
+  uint32_t n = 0;
+  for (uint32_t d = 0; d < p->ndirs;) {
+    if ((int)p->dirs[d].level < split) {
+      units[n++] = (work_unit){d, d + 1, false};
+      ++d;
+    } else {
+      units[n++] = (work_unit){d, d + sub, true};
+      d += sub;
+    }
+  }
+  *count = n;
+  *split_level = (uint32_t)split;
+  return units;
+}
+
+char *gentree_build(const char *root, const gentree_spec *s) {
+  if (!root || !gentree_spec_valid(s))
+    return NULL;
+  if (mkdir(root, 0755) != 0 && errno != EEXIST)
+    return NULL;
+  plan p;
+  char *out = NULL;
+  build_state b = {.p = &p, .root_fd = -1};
+  if (!plan_build(&p, s)) {
+    TLOG(TLOG_WARN, "gentree: cannot plan %lld dirs, %lld files", p.ndirs,
+         s->files);
+    goto done;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = s->threads ? s->threads : (int)(cpus > 0 ? cpus : 1);
+  if (threads > GENTREE_MAX_THREADS)
+    threads = GENTREE_MAX_THREADS;
+  uint32_t split = 0;
+  b.units = plan_units(&p, threads, &b.nunits, &split);
+  b.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (!b.units || b.root_fd < 0)
+    goto done;
+  /* Directories above the split level, parents first, so that every
+   * unit's parent exists before the workers start */
+  char path[PATH_MAX];
+  for (uint32_t d = 1; d < p.ndirs; ++d) {
+    if (p.dirs[d].level >= split)
+      continue;
+    dir_path(&p, d, path, sizeof(path));
+    if (mkdirat(b.root_fd, path, 0755) != 0 && errno != EEXIST)
+      goto done;
+  }
+  if ((uint32_t)threads > b.nunits)
+    threads = (int)b.nunits;
+  pthread_t tids[GENTREE_MAX_THREADS];
+  int started = 0;
+  for (; started < threads - 1; ++started)
+    if (pthread_create(&tids[started], NULL, build_worker, &b) != 0)
+      break;
+  build_worker(&b); /* this thread works too */
+  for (int i = 0; i < started; ++i)
+    pthread_join(tids[i], NULL);
+  if (atomic_load(&b.failed))
+    goto done;
+  char summary[64];
+  snprintf(summary, sizeof(summary), "%u\t%u\t%llu", p.ndirs - 1, s->files,
+           (unsigned long long)p.bytes);
+  out = sm_strdup(summary);
+done:
+  if (b.root_fd >= 0)
+    close(b.root_fd);
+  sm_free(b.units);
+  plan_free(&p);
+  return out;
+}
@@ -0,0 +1,60 @@
+#ifndef GENTREE_H
+#define GENTREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Synthetic directory trees for task setup, generated in one instruction
+ * instead of thousands of FS_CREATE/FS_WRITE steps.
+ *
+ * The layout is planned first, single-threaded, from the seed: every
+ * directory has `fanout` subdirectories down to `depth`, and each file gets
+ * a directory, a name and a size drawn in a fixed order. The plan is then
+ * built by worker threads that each take whole subtrees, creating them with
+ * mkdirat/openat and filling files from a counter-based generator keyed by
+ * the file's index. Nothing depends on which thread builds what, so the
+ * same spec always produces the same names, sizes and bytes.
+ */
+#define GENTREE_MAX_DIRS 65536
+#define GENTREE_MAX_DEPTH 32
+#define GENTREE_MAX_FILES (1u << 20)
+#define GENTREE_MAX_SIZE (1ull << 30)
+#define GENTREE_MAX_NAME 64
+#define GENTREE_MAX_THREADS 16
+
+typedef enum {
+  GENTREE_UNIFORM, /* sizes uniform in [size_min, size_max] */
+  GENTREE_LOG2,    /* power-of-two band first, then uniform in it */
+} gentree_dist;
+
+typedef struct {
+  uint64_t seed;
+  int depth;     /* directory levels below the root */
+  int fanout;    /* subdirectories per directory */
+  uint32_t files;
+  uint64_t size_min;
+  uint64_t size_max;
+  gentree_dist dist;
+  int name_len;                        /* characters per name */
+  char alphabet[GENTREE_MAX_NAME + 1]; /* name characters, no '/' */
+  int threads;                         /* 0 picks one per CPU */
+} gentree_spec;
+
+/* Check limits that do not depend on the filesystem. */
+bool gentree_spec_valid(const gentree_spec *s);
+
+/* Build the tree under root, creating root if needed. Returns
+ * "dirs\tfiles\tbytes" (caller frees with sm_free), or NULL if the spec is
+ * invalid, names ran out, or anything could not be created or written. */
+char *gentree_build(const char *root, const gentree_spec *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GENTREE_H */
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "kv_store.h"
+#include "sm_alloc.h"
+#include "state_machine.h"
+#include "xxhash.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define KV_BUCKETS 1024 /* power of two */
+
+typedef struct kv_entry {
+  struct kv_entry *next;
+  uint64_t hash;
+  uint64_t expires_ns; /* CLOCK_MONOTONIC deadline, 0 for none */
+  uint32_t epoch;      /* sm_cache_epoch() when stored, if expires_ns */
+  kv_type type;
+  void *value; /* integer, or an owned string */
+  char key[];
+} kv_entry;
+
+/* Chained table under one lock: jobs are serialised on the worker and the
+ * scheduler thread, so contention is two threads at most. */
+static kv_entry *buckets[KV_BUCKETS];
+static size_t count = 0;
+static pthread_mutex_t kv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool expired(const kv_entry *e, uint64_t now, uint32_t epoch) {
+  return e->expires_ns && (e->expires_ns <= now || e->epoch != epoch);
+}
+
+static void entry_free(kv_entry *e) {
+  if (e->type == KV_STRING)
+    sm_free(e->value);
+  sm_free(e);
+}
+
+/* Unlink and free the entry *link points to. */
+static void unlink_entry(kv_entry **link) {
+  kv_entry *e = *link;
+  *link = e->next;
+  entry_free(e);
+  count--;
+}
+
+/* Link pointing at key's entry, or at the bucket's tail if it is absent. */
+static kv_entry **find(const char *key, uint64_t hash) {
+  kv_entry **link = &buckets[hash & (KV_BUCKETS - 1)];
+  while (*link && ((*link)->hash != hash || strcmp((*link)->key, key) != 0))
+    link = &(*link)->next;
+  return link;
+}
+
+static void sweep_expired(uint64_t now, uint32_t epoch) {
+  for (size_t i = 0; i < KV_BUCKETS; ++i) {
+    kv_entry **link = &buckets[i];
+    while (*link) {
+      if (expired(*link, now, epoch))
+        unlink_entry(link);
+      else
+        link = &(*link)->next;
+    }
+  }
+}
+
+bool kv_set(const char *key, kv_type type, const void *value, uint32_t ttl_ms) {
+  if (!key || type == KV_NONE || (type == KV_STRING && !value))
+    return false;
+  size_t klen = strlen(key);
+  if (klen == 0 || klen > KV_MAX_KEY)
+    return false;
+  kv_entry *e = sm_malloc(sizeof(*e) + klen + 1);
+  if (!e)
+    return false;
+  e->next = NULL;
+  e->hash = XXH64(key, klen, 0);
+  e->type = type;
+  e->value = type == KV_STRING ? sm_strdup(value) : (void *)value;
+  if (type == KV_STRING && !e->value) {
+    sm_free(e);
+    return false;
+  }
+  memcpy(e->key, key, klen + 1);
+  uint64_t now = now_ns();
+  uint32_t epoch = sm_cache_epoch();
+  e->expires_ns = ttl_ms ? now + (uint64_t)ttl_ms * 1000000ull : 0;
+  e->epoch = epoch;
+
+  pthread_mutex_lock(&kv_lock);
+  kv_entry **link = find(key, e->hash);
+  if (*link) {
+    e->next = (*link)->next;
+    entry_free(*link);
+    *link = e;
+    pthread_mutex_unlock(&kv_lock);
+    return true;
+  }
+  if (count >= KV_MAX_ENTRIES) {
+    sweep_expired(now, epoch);
+    if (count >= KV_MAX_ENTRIES) {
+      pthread_mutex_unlock(&kv_lock);
+      entry_free(e);
+      return false;
+    }
+    link = find(key, e->hash);
+  }
+  *link = e;
+  count++;
+  pthread_mutex_unlock(&kv_lock);
+  return true;
+}
+
+kv_type kv_get(const char *key, void **out) {
+  if (!key || !out)
+    return KV_NONE;
+  *out = NULL;
+  uint64_t hash = XXH64(key, strlen(key), 0);
+  kv_type type = KV_NONE;
+  pthread_mutex_lock(&kv_lock);
+  kv_entry **link = find(key, hash);
+  if (*link && expired(*link, now_ns(), sm_cache_epoch())) {
+    unlink_entry(link);
+  } else if (*link) {
+    type = (*link)->type;
+    if (type == KV_STRING) {
+      *out = sm_strdup((*link)->value);
+      if (!*out)
+        type = KV_NONE;
+    } else {
+      *out = (*link)->value;
+    }
+  }
+  pthread_mutex_unlock(&kv_lock);
+  return type;
+}
+
+bool kv_delete(const char *key) {
+  if (!key)
+    return false;
+  uint64_t hash = XXH64(key, strlen(key), 0);
+  pthread_mutex_lock(&kv_lock);
+  kv_entry **link = find(key, hash);
+  bool found = *link && !expired(*link, now_ns(), sm_cache_epoch());
+  if (*link)
+    unlink_entry(link);
+  pthread_mutex_unlock(&kv_lock);
+  return found;
+}
+
+void kv_clear(void) {
+  pthread_mutex_lock(&kv_lock);
+  for (size_t i = 0; i < KV_BUCKETS; ++i) {
+    while (buckets[i])
+      unlink_entry(&buckets[i]);
+  }
+  pthread_mutex_unlock(&kv_lock);
+}
+
+size_t kv_count(void) {
+  pthread_mutex_lock(&kv_lock);
+  size_t n = count;
+  pthread_mutex_unlock(&kv_lock);
+  return n;
+}
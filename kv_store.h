@@ -0,0 +1,53 @@
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Daemon-wide key-value store shared by every recipe, for state that should
+ * outlive a single job (generated paths, baseline hashes) without living in
+ * a register by accident. Values are typed: an integer or a string, which is
+ * copied in and copied out so no register ever aliases a stored value.
+ *
+ * Entries may carry a TTL. Entries with a TTL also expire when the cache
+ * epoch moves (snapshot restore), since their clock is no longer the
+ * guest's. The whole store is cleared by the reset control command.
+ */
+#define KV_MAX_ENTRIES 4096
+#define KV_MAX_KEY 255
+
+typedef enum {
+  KV_NONE, /* missing or expired */
+  KV_INT,
+  KV_STRING,
+} kv_type;
+
+/* Store value under key, replacing any previous entry. For KV_STRING value
+ * points to a NUL-terminated string that is copied. ttl_ms 0 never expires.
+ * Returns false for an empty or too long key, or when the store is full. */
+bool kv_set(const char *key, kv_type type, const void *value, uint32_t ttl_ms);
+
+/* Look up key. An integer is returned in *out; a string as a fresh
+ * sm_strdup() copy the caller frees. */
+kv_type kv_get(const char *key, void **out);
+
+/* Remove key. Returns false if it was not present. */
+bool kv_delete(const char *key);
+
+/* Drop every entry. */
+void kv_clear(void);
+
+/* Live entries, expired ones that were not yet collected included. */
+size_t kv_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_STORE_H */
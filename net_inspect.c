@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include "net_inspect.h"
+#include "proc_utils.h"
+#include "sm_alloc.h"
+#include "state_machine.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define TCP_LISTEN 0x0a
+#define UDP_UNCONNECTED 0x07 /* TCP_CLOSE, what udp reports for bound sockets */
+#define UNIX_ACCEPTCON 0x10000 /* __SO_ACCEPTCON in /proc/net/unix flags */
+
+/* ----- inode -> pid cache ----- */
+
+/* Open addressing, inode 0 marks a free slot */
+static struct {
+  uint64_t *inodes;
+  pid_t *pids;
+  size_t cap; /* power of two */
+  size_t len;
+  uint32_t epoch;
+} cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t slot_of(uint64_t inode, size_t cap) {
+  return (size_t)((inode * 0x9e3779b97f4a7c15ull) >> 17) & (cap - 1);
+}
+
+static bool cache_put(uint64_t inode, pid_t pid) {
+  if ((cache.len + 1) * 2 > cache.cap) {
+    size_t cap = cache.cap ? cache.cap * 2 : 256;
+    uint64_t *inodes = sm_calloc(cap, sizeof(*inodes));
+    pid_t *pids = sm_calloc(cap, sizeof(*pids));
+    if (!inodes || !pids) {
+      sm_free(inodes);
+      sm_free(pids);
+      return false;
+    }
+    for (size_t i = 0; i < cache.cap; ++i) {
+      if (!cache.inodes[i])
+        continue;
+      size_t s = slot_of(cache.inodes[i], cap);
+      while (inodes[s])
+        s = (s + 1) & (cap - 1);
+      inodes[s] = cache.inodes[i];
+      pids[s] = cache.pids[i];
+    }
+    sm_free(cache.inodes);
+    sm_free(cache.pids);
+    cache.inodes = inodes;
+    cache.pids = pids;
+    cache.cap = cap;
+  }
+  size_t s = slot_of(inode, cache.cap);
+  while (cache.inodes[s] && cache.inodes[s] != inode)
+    s = (s + 1) & (cache.cap - 1);
+  if (!cache.inodes[s])
+    cache.len++;
+  cache.inodes[s] = inode;
+  cache.pids[s] = pid;
+  return true;
+}
+
+static pid_t cache_get(uint64_t inode) {
+  if (!cache.cap)
+    return 0;
+  size_t s = slot_of(inode, cache.cap);
+  while (cache.inodes[s]) {
+    if (cache.inodes[s] == inode)
+      return cache.pids[s];
+    s = (s + 1) & (cache.cap - 1);
+  }
+  return 0;
+}
+
+static void cache_reset(void) {
+  if (cache.cap) {
+    memset(cache.inodes, 0, cache.cap * sizeof(*cache.inodes));
+    memset(cache.pids, 0, cache.cap * sizeof(*cache.pids));
+  }
+  cache.len = 0;
+}
+
+/* Record the socket inodes held by one process. */
+static void scan_fds(int proc, const char *pid_name, pid_t pid) {
+  char path[32];
+  snprintf(path, sizeof(path), "%s/fd", pid_name);
+  int dir = openat(proc, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0)
+    return; /* exited, or not ours to inspect */
+  char dents[4096];
+  char link[64];
+  for (;;) {
+    long n = syscall(SYS_getdents64, dir, dents, sizeof(dents));
+    if (n <= 0)
+      break;
+    for (long off = 0; off < n;) {
+      const char *d = dents + off;
+      unsigned short reclen;
+      memcpy(&reclen, d + 16, sizeof(reclen));
+      off += reclen;
+      const char *name = d + 19;
+      if (name[0] < '0' || name[0] > '9')
+        continue;
+      ssize_t len = readlinkat(dir, name, link, sizeof(link) - 1);
+      if (len < 9 || memcmp(link, "socket:[", 8) != 0)
+        continue;
+      link[len] = '\0';
+      uint64_t inode = strtoull(link + 8, NULL, 10);
+      if (inode)
+        cache_put(inode, pid);
+    }
+  }
+  close(dir);
+}
+
+static void cache_rebuild(void) {
+  cache_reset();
+  int proc = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc < 0)
+    return;
+  char dents[8192];
+  for (;;) {
+    long n = syscall(SYS_getdents64, proc, dents, sizeof(dents));
+    if (n <= 0)
+      break;
+    for (long off = 0; off < n;) {
+      const char *d = dents + off;
+      unsigned short reclen;
+      memcpy(&reclen, d + 16, sizeof(reclen));
+      off += reclen;
+      const char *name = d + 19;
+      if (name[0] < '1' || name[0] > '9')
+        continue;
+      scan_fds(proc, name, (pid_t)strtol(name, NULL, 10));
+    }
+  }
+  close(proc);
+}
+
+/* Owner of a socket inode, or 0. A miss or an entry whose process is gone
+ * rebuilds the cache, at most once per scan (*rebuilt). Sockets still
+ * without an owner afterwards (another namespace, no permission) are
+ * cached as -1 so they do not force a rebuild on every scan. */
+static pid_t owner_of(uint64_t inode, bool *rebuilt) {
+  pthread_mutex_lock(&cache_lock);
+  uint32_t epoch = sm_cache_epoch();
+  if (cache.epoch != epoch) {
+    cache_reset();
+    cache.epoch = epoch;
+  }
+  pid_t pid = cache_get(inode);
+  if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+    pid = 0;
+  if (!pid && !*rebuilt) {
+    cache_rebuild();
+    *rebuilt = true;
+    pid = cache_get(inode);
+    if (!pid)
+      cache_put(inode, -1);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return pid > 0 ? pid : 0;
+}
+
+/* ----- /proc/net scanning ----- */
+
+typedef struct {
+  const net_filter *f;
+  const char *proto;
+  int family; /* AF_INET, AF_INET6 or AF_UNIX */
+  sm_buf *out;
+  size_t count;
+  bool rebuilt;
+} scan_state;
+
+/* Next space-separated token; NULL at the end of the line. */
+static char *next_tok(char **p) {
+  char *s = *p;
+  while (*s == ' ')
+    ++s;
+  if (!*s)
+    return NULL;
+  char *e = s;
+  while (*e && *e != ' ')
+    ++e;
+  if (*e)
+    *e++ = '\0';
+  *p = e;
+  return s;
+}
+
+static bool parse_hex32(const char *s, uint32_t *out) {
+  uint32_t v = 0;
+  for (int i = 0; i < 8; ++i) {
+    char c = s[i];
+    unsigned d;
+    if (c >= '0' && c <= '9')
+      d = (unsigned)(c - '0');
+    else if (c >= 'A' && c <= 'F')
+      d = (unsigned)(c - 'A' + 10);
+    else if (c >= 'a' && c <= 'f')
+      d = (unsigned)(c - 'a' + 10);
+    else
+      return false;
+    v = v << 4 | d;
+  }
+  *out = v;
+  return true;
+}
+
+static void emit(scan_state *st, const char *addr, unsigned port,
+                 const char *uid, uint64_t inode) {
+  char num[96];
+  sm_buf *out = st->out;
+  sm_buf_append(out, st->proto, strlen(st->proto));
+  sm_buf_append(out, "\t", 1);
+  sm_buf_append(out, addr, strlen(addr));
+  pid_t pid = st->f->pids && inode ? owner_of(inode, &st->rebuilt) : 0;
+  int n = snprintf(num, sizeof(num), "\t%u\t%s\t%llu\t", port, uid,
+                   (unsigned long long)inode);
+  sm_buf_append(out, num, (size_t)n);
+  if (pid)
+    n = snprintf(num, sizeof(num), "%d\n", (int)pid);
+  else
+    n = snprintf(num, sizeof(num), "-\n");
+  sm_buf_append(out, num, (size_t)n);
+  st->count++;
+}
+
+/* sl local rem st tx:rx tr:when retrnsmt uid timeout inode ... */
+static void inet_line(char *line, scan_state *st) {
+  char *p = line;
+  next_tok(&p); /* sl */
+  char *local = next_tok(&p);
+  next_tok(&p); /* remote */
+  char *state = next_tok(&p);
+  for (int i = 0; i < 3; ++i)
+    next_tok(&p);
+  char *uid = next_tok(&p);
+  next_tok(&p); /* timeout */
+  char *inode = next_tok(&p);
+  if (!inode)
+    return;
+  unsigned long want = st->proto[0] == 'u' ? UDP_UNCONNECTED : TCP_LISTEN;
+  if (strtoul(state, NULL, 16) != want)
+    return;
+  size_t words = st->family == AF_INET6 ? 4 : 1;
+  if (strlen(local) != words * 8 + 5 || local[words * 8] != ':')
+    return;
+  unsigned port = (unsigned)strtoul(local + words * 8 + 1, NULL, 16);
+  if (st->f->port >= 0 && (long)port != st->f->port)
+    return;
+  /* Each word is printed as the host-order value of the raw network
+   * bytes, so storing it back restores the address */
+  uint32_t raw[4];
+  for (size_t i = 0; i < words; ++i)
+    if (!parse_hex32(local + i * 8, &raw[i]))
+      return;
+  char addr[INET6_ADDRSTRLEN];
+  if (!inet_ntop(st->family, raw, addr, sizeof(addr)))
+    return;
+  emit(st, addr, port, uid, strtoull(inode, NULL, 10));
+}
+
+/* Num RefCount Protocol Flags Type St Inode [Path] */
+static void unix_line(char *line, scan_state *st) {
+  char *p = line;
+  for (int i = 0; i < 3; ++i)
+    next_tok(&p);
+  char *flags = next_tok(&p);
+  next_tok(&p); /* type */
+  next_tok(&p); /* state */
+  char *inode = next_tok(&p);
+  if (!inode || !(strtoul(flags, NULL, 16) & UNIX_ACCEPTCON))
+    return;
+  /* unix sockets have no port; a port filter never matches them */
+  if (st->f->port >= 0)
+    return;
+  while (*p == ' ')
+    ++p;
+  emit(st, *p ? p : "-", 0, "-", strtoull(inode, NULL, 10));
+}
+
+/* Feed every line after the header to the parser. Lines are split in a
+ * fixed buffer; one that does not fit is skipped. */
+static void scan_table(const char *path, scan_state *st) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return; /* no IPv6, or no such table in this kernel */
+  char buf[8192];
+  size_t len = 0;
+  bool header = true, skipping = false;
+  for (;;) {
+    ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0)
+      break;
+    len += (size_t)n;
+    char *start = buf, *nl;
+    while ((nl = memchr(start, '\n', len - (size_t)(start - buf)))) {
+      *nl = '\0';
+      if (!header && !skipping) {
+        if (st->family == AF_UNIX)
+          unix_line(start, st);
+        else
+          inet_line(start, st);
+      }
+      header = skipping = false;
+      start = nl + 1;
+    }
+    len -= (size_t)(start - buf);
+    memmove(buf, start, len);
+    if (len == sizeof(buf) - 1) {
+      len = 0;
+      skipping = true;
+    }
+  }
+  close(fd);
+}
+
+char *net_list_listeners(const net_filter *f, size_t *count) {
+  static const struct {
+    unsigned int bit;
+    const char *proto;
+    const char *path;
+    int family;
+  } tables[] = {
+      {NET_TCP, "tcp", "/proc/net/tcp", AF_INET},
+      {NET_TCP6, "tcp6", "/proc/net/tcp6", AF_INET6},
+      {NET_UDP, "udp", "/proc/net/udp", AF_INET},
+      {NET_UDP6, "udp6", "/proc/net/udp6", AF_INET6},
+      {NET_UNIX, "unix", "/proc/net/unix", AF_UNIX},
+  };
+  sm_buf out = {0};
+  sm_buf_append(&out, "", 0);
+  scan_state st = {.f = f, .out = &out};
+  for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); ++i) {
+    if (!(f->protos & tables[i].bit))
+      continue;
+    st.proto = tables[i].proto;
+    st.family = tables[i].family;
+    scan_table(tables[i].path, &st);
+  }
+  if (out.failed) {
+    sm_free(out.data);
+    return NULL;
+  }
+  if (count)
+    *count = st.count;
+  return out.data;
+}
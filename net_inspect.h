@@ -0,0 +1,49 @@
+#ifndef NET_INSPECT_H
+#define NET_INSPECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Listening sockets from /proc/net, for recipes that check "is something
+ * listening on port N and who owns it" without ss or netstat in the rootfs.
+ *
+ * The tables are read through a fixed stack buffer and parsed in place, so
+ * a scan allocates nothing but its result. Owner pids come from a cache of
+ * socket inodes built by scanning /proc/<pid>/fd; it is rebuilt at most
+ * once per scan, when a socket is missing from it, and dropped on snapshot
+ * restore.
+ */
+
+/* Tables to scan (bitmask) */
+#define NET_TCP 0x01u
+#define NET_TCP6 0x02u
+#define NET_UDP 0x04u
+#define NET_UDP6 0x08u
+#define NET_UNIX 0x10u
+#define NET_ALL 0x1fu
+
+typedef struct {
+  unsigned int protos; /* NET_* bits */
+  long port;           /* local port to match, or -1 */
+  bool pids;           /* resolve the owning pid of each socket */
+} net_filter;
+
+/* Listening TCP sockets, bound unconnected UDP sockets and listening unix
+ * stream sockets, one line each:
+ *   proto \t address \t port \t uid \t inode \t pid
+ * uid is "-" for unix sockets, pid "-" if unknown or not requested. Returns
+ * "" when nothing matches and NULL on allocation failure. *count, if given,
+ * receives the number of lines. */
+char *net_list_listeners(const net_filter *f, size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NET_INSPECT_H */
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Collect a PGO profile from an instrumented (TASKD_PGO=GENERATE) build.
+# Run through the pgo-train build target rather than by hand.
+#
+#   pgo_train.sh TASKD SM_TEST TASKD_LOAD CORPUS_DIR LLVM_PROFDATA OUT REPEAT
+#
+# Two passes over the recipe corpus:
+#   1. sm_test replays every recipe REPEAT times: executor and opcode paths.
+#   2. taskd serves the corpus to taskd_load over a unix socket, once per
+#      connection and once pipelined: handshake, framing, parser and reply
+#      building inside the daemon itself.
+# The raw profiles of every process are merged into OUT.
+set -eu
+
+taskd=$1
+sm_test=$2
+taskd_load=$3
+corpus=$4
+profdata=$5
+out=$6
+repeat=$7
+
+raw=$(mktemp -d /tmp/taskd-pgo-raw.XXXXXX)
+pid=
+# Also stops taskd when a step fails under set -e
+trap 'if [ -n "$pid" ]; then kill "$pid" 2>/dev/null; fi
+rm -rf "$raw" /tmp/taskd-pgo' EXIT
+LLVM_PROFILE_FILE="$raw/%p.profraw"
+export LLVM_PROFILE_FILE
+
+"$sm_test" --repeat "$repeat" "$corpus" >/dev/null
+
+sock="$raw/taskd.sock"
+"$taskd" --foreground --no-cgroups "unix:$sock" &
+pid=$!
+i=0
+while [ ! -S "$sock" ]; do
+  i=$((i + 1))
+  if [ "$i" -gt 100 ]; then
+    echo "taskd did not start listening" >&2
+    exit 1
+  fi
+  sleep 0.05
+done
+requests=$((repeat * 4))
+"$taskd_load" --target "unix:$sock" --concurrency 1 \
+  --requests "$requests" "$corpus" >/dev/null
+"$taskd_load" --target "unix:$sock" --pipeline 8 \
+  --requests "$requests" "$corpus" >/dev/null
+# SIGTERM makes taskd return from main(), which writes its profile
+kill -TERM "$pid"
+wait "$pid"
+pid=
+
+"$profdata" merge -output="$out" "$raw"/*.profraw
+echo "profile written to $out"
@@ -0,0 +1,228 @@
+#ifndef PROC_UTILS_H
+#define PROC_UTILS_H
+
+#include "sm_alloc.h"
+#include "state_machine.h"
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process table snapshot straight from /proc, without forking ps or pgrep.
+ * The directory is read with getdents64 into a stack buffer and every file
+ * is opened relative to its /proc/<pid> descriptor, so a scan costs a few
+ * syscalls per process and only for the files the requested fields and
+ * filters need: stat for ppid/state/rss/cpu/comm, cmdline for the command
+ * line, fstat of the directory for the uid.
+ */
+
+/* Read a small /proc file relative to dirfd. Returns bytes read or -1. */
+static inline ssize_t proc_read_at(int dirfd, const char *name, char *buf,
+                                   size_t cap) {
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, cap - 1);
+  close(fd);
+  if (n >= 0)
+    buf[n] = '\0';
+  return n;
+}
+
+/* Fields of /proc/<pid>/stat that the listing uses */
+typedef struct {
+  char comm[64];
+  char state;
+  long ppid;
+  unsigned long long ticks; /* utime + stime */
+  long rss_pages;
+} proc_stat_fields;
+
+/* comm may contain spaces and parentheses, so it runs from the first '('
+ * to the last ')'; the numbered fields follow. */
+static inline bool proc_parse_stat(const char *s, proc_stat_fields *out) {
+  const char *open = strchr(s, '(');
+  const char *close = strrchr(s, ')');
+  if (!open || !close || close < open || close[1] != ' ')
+    return false;
+  size_t n = (size_t)(close - open - 1);
+  if (n >= sizeof(out->comm))
+    n = sizeof(out->comm) - 1;
+  memcpy(out->comm, open + 1, n);
+  out->comm[n] = '\0';
+  const char *p = close + 2;
+  out->state = *p;
+  /* field 3 is state; walk to 4 (ppid), 14/15 (utime/stime), 24 (rss) */
+  unsigned long long utime = 0, stime = 0;
+  for (int field = 3; *p && field <= 24; ++field) {
+    if (field == 4)
+      out->ppid = strtol(p, NULL, 10);
+    else if (field == 14)
+      utime = strtoull(p, NULL, 10);
+    else if (field == 15)
+      stime = strtoull(p, NULL, 10);
+    else if (field == 24)
+      out->rss_pages = strtol(p, NULL, 10);
+    p = strchr(p, ' ');
+    if (!p)
+      break;
+    ++p;
+  }
+  out->ticks = utime + stime;
+  return true;
+}
+
+/* Append s with tabs and newlines replaced, so records stay one line. */
+static inline void proc_put_clean(sm_buf *b, const char *s, size_t n) {
+  size_t start = b->len;
+  sm_buf_append(b, s, n);
+  if (b->failed)
+    return;
+  for (size_t i = start; i < b->len; ++i)
+    if (b->data[i] == '\t' || b->data[i] == '\n' || b->data[i] == '\0')
+      b->data[i] = ' ';
+}
+
+typedef struct {
+  const char *name;    /* exact comm, or NULL */
+  const char *cmdline; /* fnmatch() pattern on the command line, or NULL */
+  bool by_uid;
+  uid_t uid;
+} proc_filter;
+
+/* List processes matching every set filter, one line per process, fields
+ * separated by tabs in the order given. Returns "" when nothing matches and
+ * NULL if /proc cannot be read. */
+static inline char *proc_list(const proc_filter *flt, const uint8_t *fields,
+                              int nfields) {
+  bool need_stat = flt->name != NULL, need_cmd = flt->cmdline != NULL;
+  bool need_uid = flt->by_uid;
+  for (int i = 0; i < nfields; ++i) {
+    if (fields[i] == SM_PROC_CMDLINE)
+      need_cmd = true;
+    else if (fields[i] == SM_PROC_UID)
+      need_uid = true;
+    else if (fields[i] != SM_PROC_PID)
+      need_stat = true;
+  }
+  int proc = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc < 0)
+    return NULL;
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  long hz = sysconf(_SC_CLK_TCK);
+  if (hz <= 0)
+    hz = 100;
+  sm_buf out = {0};
+  sm_buf_append(&out, "", 0);
+  char dents[8192];
+  char stat_buf[1024];
+  char cmd_buf[4096];
+  for (;;) {
+    long n = syscall(SYS_getdents64, proc, dents, sizeof(dents));
+    if (n <= 0)
+      break;
+    for (long off = 0; off < n;) {
+      /* struct linux_dirent64: ino, off, reclen, type, name */
+      const char *d = dents + off;
+      unsigned short reclen;
+      memcpy(&reclen, d + 16, sizeof(reclen));
+      off += reclen;
+      const char *name = d + 19;
+      if (name[0] < '1' || name[0] > '9')
+        continue;
+      int dir = openat(proc, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir < 0)
+        continue; /* exited since getdents */
+      proc_stat_fields st = {0};
+      struct stat sb;
+      ssize_t cmd_len = 0;
+      bool ok = true;
+      if (need_stat) {
+        ok = proc_read_at(dir, "stat", stat_buf, sizeof(stat_buf)) > 0 &&
+             proc_parse_stat(stat_buf, &st);
+        if (ok && flt->name)
+          ok = strcmp(st.comm, flt->name) == 0;
+      }
+      if (ok && need_uid) {
+        ok = fstat(dir, &sb) == 0;
+        if (ok && flt->by_uid)
+          ok = sb.st_uid == flt->uid;
+      }
+      if (ok && need_cmd) {
+        cmd_len = proc_read_at(dir, "cmdline", cmd_buf, sizeof(cmd_buf));
+        ok = cmd_len >= 0;
+        /* arguments are NUL-separated; join them with spaces */
+        while (cmd_len > 0 && cmd_buf[cmd_len - 1] == '\0')
+          --cmd_len;
+        for (ssize_t i = 0; ok && i < cmd_len; ++i)
+          if (cmd_buf[i] == '\0')
+            cmd_buf[i] = ' ';
+        if (ok)
+          cmd_buf[cmd_len] = '\0';
+        if (ok && flt->cmdline)
+          ok = fnmatch(flt->cmdline, cmd_buf, 0) == 0;
+      }
+      close(dir);
+      if (!ok)
+        continue;
+      char num[32];
+      for (int i = 0; i < nfields; ++i) {
+        if (i > 0)
+          sm_buf_append(&out, "\t", 1);
+        int len = 0;
+        switch (fields[i]) {
+        case SM_PROC_PID:
+          sm_buf_append(&out, name, strlen(name));
+          break;
+        case SM_PROC_PPID:
+          len = snprintf(num, sizeof(num), "%ld", st.ppid);
+          break;
+        case SM_PROC_STATE:
+          sm_buf_append(&out, &st.state, 1);
+          break;
+        case SM_PROC_UID:
+          len = snprintf(num, sizeof(num), "%u", (unsigned)sb.st_uid);
+          break;
+        case SM_PROC_RSS:
+          len = snprintf(num, sizeof(num), "%ld", st.rss_pages * page_kb);
+          break;
+        case SM_PROC_CPU:
+          len = snprintf(num, sizeof(num), "%llu", st.ticks * 1000ull / hz);
+          break;
+        case SM_PROC_COMM:
+          proc_put_clean(&out, st.comm, strlen(st.comm));
+          break;
+        case SM_PROC_CMDLINE:
+          proc_put_clean(&out, cmd_buf, (size_t)cmd_len);
+          break;
+        }
+        if (len > 0)
+          sm_buf_append(&out, num, (size_t)len);
+      }
+      sm_buf_append(&out, "\n", 1);
+    }
+  }
+  close(proc);
+  if (out.failed) {
+    sm_free(out.data);
+    return NULL;
+  }
+  return out.data;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROC_UTILS_H */
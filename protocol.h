@@ -1,8 +1,13 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include "cgroup.h"
+#include "net_inspect.h"
+#include "sm_alloc.h"
 #include "state_machine.h"
+#include "supervisor.h"
 #include <cJSON.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -23,6 +28,10 @@ typedef struct {
   int version;
 } handshake_msg;
 
+/* Handshake version from which a connection stays open as a session carrying
+ * any number of NUL-terminated requests (see PROTOCOL.md). */
+#define PROTO_VERSION_SESSION 2
+
 static inline bool parse_handshake(const char *json, handshake_msg *out) {
   if (!json || !out)
     return false;
@@ -51,11 +60,20 @@ static inline char *report_status(int status) {
   return out;
 }
 
-static inline bool proto_parse(const char *json, proto_msg *out) {
-  if (!json || !out)
-    return false;
-  cJSON *root = cJSON_Parse(json);
-  if (!root)
+/* sm_report_cb that splices the executor's report objects, already JSON,
+ * into an array opened with "[" instead of parsing them back into cJSON.
+ * Runs on the worker thread while the submitter waits in sm_wait(). */
+static inline void proto_buf_collect_cb(const char *json, void *ud) {
+  sm_buf *b = (sm_buf *)ud;
+  if (!json || !b)
+    return;
+  if (b->len > 1)
+    sm_buf_append(b, ",", 1);
+  sm_buf_append(b, json, strlen(json));
+}
+
+static inline bool proto_msg_from_json(const cJSON *root, proto_msg *out) {
+  if (!root || !out)
     return false;
   cJSON *cmd = cJSON_GetObjectItemCaseSensitive(root, "command");
   cJSON *val = cJSON_GetObjectItemCaseSensitive(root, "value");
@@ -66,6 +84,16 @@ static inline bool proto_parse(const char *json, proto_msg *out) {
     strncpy(out->value, val->valuestring, sizeof(out->value) - 1);
     out->value[sizeof(out->value) - 1] = '\0';
   }
+  return ok;
+}
+
+static inline bool proto_parse(const char *json, proto_msg *out) {
+  if (!json || !out)
+    return false;
+  cJSON *root = cJSON_Parse(json);
+  if (!root)
+    return false;
+  bool ok = proto_msg_from_json(root, out);
   cJSON_Delete(root);
   return ok;
 }
@@ -88,23 +116,23 @@ static inline bool proto_recv(int fd, proto_msg *out) {
     return false;
   size_t chunk = 256;
   size_t cap = chunk;
-  char *buf = malloc(cap + 1);
+  char *buf = sm_malloc(cap + 1);
   if (!buf)
     return false;
   size_t off = 0;
   while (1) {
     if (off + chunk > cap) {
       cap *= 2;
-      char *tmp = realloc(buf, cap + 1);
+      char *tmp = sm_realloc(buf, cap + 1);
       if (!tmp) {
-        free(buf);
+        sm_free(buf);
         return false;
       }
       buf = tmp;
     }
     ssize_t n = recv(fd, buf + off, chunk, 0);
     if (n <= 0) {
-      free(buf);
+      sm_free(buf);
       return false;
     }
     off += (size_t)n;
@@ -113,41 +141,138 @@ static inline bool proto_recv(int fd, proto_msg *out) {
   }
   buf[off] = '\0';
   bool ok = proto_parse(buf, out);
-  free(buf);
+  sm_free(buf);
   return ok;
 }
 
+/* Send all len bytes. Signals interrupt send() (taskd's handlers are
+ * installed without SA_RESTART), and a partial frame would leave every
+ * later frame on a persistent session misaligned. */
+static inline bool proto_send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
 static inline bool proto_send(int fd, const proto_msg *msg) {
   char *json = proto_build(msg);
   if (!json)
     return false;
-  size_t len = strlen(json);
-  ssize_t n = send(fd, json, len, MSG_NOSIGNAL);
-  free(json);
-  return n == (ssize_t)len;
+  bool ok = proto_send_all(fd, json, strlen(json));
+  sm_free(json);
+  return ok;
+}
+
+/* Send a JSON string followed by its terminating NUL. */
+static inline bool proto_send_frame(int fd, const char *json) {
+  return json && proto_send_all(fd, json, strlen(json) + 1);
+}
+
+/* Receive one NUL-terminated frame as sent by taskd (caller must free).
+ * Returns NULL on error or if the peer closes before the terminator. The
+ * protocol is strictly request/response, so nothing follows the NUL. */
+static inline char *proto_recv_frame(int fd) {
+  size_t cap = 4096, off = 0;
+  char *buf = sm_malloc(cap);
+  if (!buf)
+    return NULL;
+  for (;;) {
+    if (off == cap) {
+      char *tmp = sm_realloc(buf, cap * 2);
+      if (!tmp)
+        break;
+      buf = tmp;
+      cap *= 2;
+    }
+    ssize_t n = recv(fd, buf + off, cap - off, 0);
+    if (n <= 0)
+      break;
+    char *nul = memchr(buf + off, '\0', (size_t)n);
+    off += (size_t)n;
+    if (nul)
+      return buf;
+  }
+  sm_free(buf);
+  return NULL;
+}
+
+/* Incremental splitter for a stream of NUL-terminated frames. Works on
+ * blocking and non-blocking sockets alike; frames returned by
+ * proto_reader_next() stay valid until the next proto_reader_fill(). */
+typedef struct {
+  char *buf;
+  size_t start; /* first unconsumed byte */
+  size_t len;   /* bytes in buf */
+  size_t cap;
+} proto_reader;
+
+/* Read once from fd. Returns the recv() result: >0 bytes, 0 on EOF, -1 on
+ * error (errno set, EAGAIN/EINTR included). */
+static inline ssize_t proto_reader_fill(proto_reader *r, int fd) {
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+  }
+  if (r->cap - r->len < 4096) {
+    size_t cap = r->cap ? r->cap * 2 : 8192;
+    char *tmp = sm_realloc(r->buf, cap);
+    if (!tmp)
+      return -1;
+    r->buf = tmp;
+    r->cap = cap;
+  }
+  ssize_t n = recv(fd, r->buf + r->len, r->cap - r->len, 0);
+  if (n > 0)
+    r->len += (size_t)n;
+  return n;
+}
+
+/* Next complete frame, or NULL if more input is needed. */
+static inline char *proto_reader_next(proto_reader *r) {
+  if (r->start >= r->len)
+    return NULL;
+  char *frame = r->buf + r->start;
+  char *nul = memchr(frame, '\0', r->len - r->start);
+  if (!nul)
+    return NULL;
+  r->start = (size_t)(nul - r->buf) + 1;
+  return frame;
+}
+
+static inline void proto_reader_free(proto_reader *r) {
+  sm_free(r->buf);
+  memset(r, 0, sizeof(*r));
 }
 
 /* Receive raw JSON string (caller must free) */
 static inline char *proto_recv_json(int fd) {
   size_t chunk = 4096;
   size_t cap = chunk;
-  char *buf = malloc(cap + 1);
+  char *buf = sm_malloc(cap + 1);
   if (!buf)
     return NULL;
   size_t off = 0;
   while (1) {
     if (off + chunk > cap) {
       cap *= 2;
-      char *tmp = realloc(buf, cap + 1);
+      char *tmp = sm_realloc(buf, cap + 1);
       if (!tmp) {
-        free(buf);
+        sm_free(buf);
         return NULL;
       }
       buf = tmp;
     }
     ssize_t n = recv(fd, buf + off, chunk, 0);
     if (n <= 0) {
-      free(buf);
+      sm_free(buf);
       return NULL;
     }
     off += (size_t)n;
@@ -158,56 +283,311 @@ static inline char *proto_recv_json(int fd) {
   return buf;
 }
 
-/* Mapping from opcode string to enum */
+/* Mapping between opcode strings and enum values */
+static const struct {
+  const char *name;
+  sm_opcode code;
+} proto_opcode_map[] = {
+    {"SM_OP_LOAD_CONST", SM_OP_LOAD_CONST},
+    {"SM_OP_FS_CREATE", SM_OP_FS_CREATE},
+    {"SM_OP_FS_DELETE", SM_OP_FS_DELETE},
+    {"SM_OP_FS_COPY", SM_OP_FS_COPY},
+    {"SM_OP_FS_MOVE", SM_OP_FS_MOVE},
+    {"SM_OP_FS_WRITE", SM_OP_FS_WRITE},
+    {"SM_OP_FS_READ", SM_OP_FS_READ},
+    {"SM_OP_FS_UNPACK", SM_OP_FS_UNPACK},
+    {"SM_OP_FS_HASH", SM_OP_FS_HASH},
+    {"SM_OP_FS_LIST", SM_OP_FS_LIST},
+    {"SM_OP_SHELL", SM_OP_SHELL},
+    {"SM_OP_EQ", SM_OP_EQ},
+    {"SM_OP_NOT", SM_OP_NOT},
+    {"SM_OP_AND", SM_OP_AND},
+    {"SM_OP_OR", SM_OP_OR},
+    {"SM_OP_INDEX_SELECT", SM_OP_INDEX_SELECT},
+    {"SM_OP_RANDOM_RANGE", SM_OP_RANDOM_RANGE},
+    {"SM_OP_PATH_JOIN", SM_OP_PATH_JOIN},
+    {"SM_OP_RANDOM_WALK", SM_OP_RANDOM_WALK},
+    {"SM_OP_DIR_CONTAINS", SM_OP_DIR_CONTAINS},
+    {"SM_OP_RAND_SEED", SM_OP_RAND_SEED},
+    {"SM_OP_REPORT", SM_OP_REPORT},
+    {"SM_OP_RETURN", SM_OP_RETURN},
+    {"SM_OP_KV_SET", SM_OP_KV_SET},
+    {"SM_OP_KV_GET", SM_OP_KV_GET},
+    {"SM_OP_KV_DEL", SM_OP_KV_DEL},
+    {"SM_OP_PROC_LIST", SM_OP_PROC_LIST},
+    {"SM_OP_NET_LISTEN", SM_OP_NET_LISTEN},
+    {"SM_OP_PROC_SPAWN", SM_OP_PROC_SPAWN},
+    {"SM_OP_PROC_STATUS", SM_OP_PROC_STATUS},
+    {"SM_OP_PROC_SIGNAL", SM_OP_PROC_SIGNAL},
+    {"SM_OP_PROC_READ", SM_OP_PROC_READ},
+    {"SM_OP_FS_GENTREE", SM_OP_FS_GENTREE},
+    {"SM_OP_FS_ALLOCATE", SM_OP_FS_ALLOCATE},
+    {"SM_OP_FS_EXHAUST", SM_OP_FS_EXHAUST},
+    {"SM_OP_FS_RELEASE", SM_OP_FS_RELEASE},
+    {"SM_OP_USERS_ADD", SM_OP_USERS_ADD},
+    {"SM_OP_FS_META", SM_OP_FS_META},
+    {"SM_OP_FS_STAT", SM_OP_FS_STAT},
+    {"SM_OP_FS_SEARCH", SM_OP_FS_SEARCH},
+};
+
+/* SM_OP_PROC_LIST column names, indexed by sm_proc_field */
+static const char *const proto_proc_fields[SM_PROC_FIELD_COUNT] = {
+    "pid", "ppid", "state", "uid", "rss_kb", "cpu_ms", "comm", "cmdline",
+};
+
+/* SM_OP_FS_STAT column names, indexed by fsmeta_field */
+static const char *const proto_stat_fields[FSMETA_FIELD_COUNT] = {
+    "path", "type", "mode", "uid",   "gid",   "size",
+    "nlink", "ino", "atime", "mtime", "ctime",
+};
+
+/* SM_OP_FS_SEARCH output modes, indexed by fsearch_mode */
+static const char *const proto_search_modes[] = {"matches", "files", "count"};
+
+/* SM_OP_FS_GENTREE name characters unless the recipe gives its own */
+#define PROTO_GENTREE_ALPHABET "abcdefghijklmnopqrstuvwxyz0123456789"
+
+/* Largest integer a JSON number holds exactly (2^53) */
+#define PROTO_MAX_EXACT 9007199254740992.0
+
+/* SM_OP_NET_LISTEN table names */
+static const struct {
+  const char *name;
+  unsigned int bit;
+} proto_net_tables[] = {
+    {"tcp", NET_TCP},   {"tcp6", NET_TCP6}, {"udp", NET_UDP},
+    {"udp6", NET_UDP6}, {"unix", NET_UNIX},
+};
+
 static inline bool opcode_from_string(const char *s, sm_opcode *out) {
   if (!s || !out)
     return false;
-  struct {
-    const char *name;
-    sm_opcode code;
-  } map[] = {
-      {"SM_OP_LOAD_CONST", SM_OP_LOAD_CONST},
-      {"SM_OP_FS_CREATE", SM_OP_FS_CREATE},
-      {"SM_OP_FS_DELETE", SM_OP_FS_DELETE},
-      {"SM_OP_FS_COPY", SM_OP_FS_COPY},
-      {"SM_OP_FS_MOVE", SM_OP_FS_MOVE},
-      {"SM_OP_FS_WRITE", SM_OP_FS_WRITE},
-      {"SM_OP_FS_READ", SM_OP_FS_READ},
-      {"SM_OP_FS_UNPACK", SM_OP_FS_UNPACK},
-      {"SM_OP_FS_HASH", SM_OP_FS_HASH},
-      {"SM_OP_FS_LIST", SM_OP_FS_LIST},
-      {"SM_OP_SHELL", SM_OP_SHELL},
-      {"SM_OP_EQ", SM_OP_EQ},
-      {"SM_OP_NOT", SM_OP_NOT},
-      {"SM_OP_AND", SM_OP_AND},
-      {"SM_OP_OR", SM_OP_OR},
-      {"SM_OP_INDEX_SELECT", SM_OP_INDEX_SELECT},
-      {"SM_OP_RANDOM_RANGE", SM_OP_RANDOM_RANGE},
-      {"SM_OP_PATH_JOIN", SM_OP_PATH_JOIN},
-      {"SM_OP_RANDOM_WALK", SM_OP_RANDOM_WALK},
-      {"SM_OP_DIR_CONTAINS", SM_OP_DIR_CONTAINS},
-      {"SM_OP_RAND_SEED", SM_OP_RAND_SEED},
-      {"SM_OP_REPORT", SM_OP_REPORT},
-      {"SM_OP_RETURN", SM_OP_RETURN},
-  };
-  for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); ++i) {
-    if (strcmp(s, map[i].name) == 0) {
-      *out = map[i].code;
+  for (size_t i = 0; i < sizeof(proto_opcode_map) / sizeof(proto_opcode_map[0]);
+       ++i) {
+    if (strcmp(s, proto_opcode_map[i].name) == 0) {
+      *out = proto_opcode_map[i].code;
       return true;
     }
   }
   return false;
 }
 
-/* Parse JSON recipe into instruction list */
-static inline sm_instr *proto_parse_recipe(const char *json) {
-  if (!json)
-    return NULL;
-  cJSON *root = cJSON_Parse(json);
-  if (!root || !cJSON_IsArray(root)) {
-    cJSON_Delete(root);
+static inline const char *opcode_to_string(sm_opcode code) {
+  for (size_t i = 0; i < sizeof(proto_opcode_map) / sizeof(proto_opcode_map[0]);
+       ++i) {
+    if (proto_opcode_map[i].code == code)
+      return proto_opcode_map[i].name;
+  }
+  return NULL;
+}
+
+static inline void alloc_stats_to_json(cJSON *obj, const sm_alloc_stats *st) {
+  cJSON_AddNumberToObject(obj, "allocs", (double)st->allocs);
+  cJSON_AddNumberToObject(obj, "frees", (double)st->frees);
+  cJSON_AddNumberToObject(obj, "bytes_alloc", (double)st->bytes_alloc);
+  cJSON_AddNumberToObject(obj, "bytes_freed", (double)st->bytes_freed);
+  cJSON_AddNumberToObject(obj, "live", (double)st->live);
+  cJSON_AddNumberToObject(obj, "peak", (double)st->peak);
+}
+
+/* Build the allocation section of a stats reply. Per-opcode entries are only
+ * emitted for opcodes that allocated at least once; "none" collects
+ * everything outside the executor (protocol, parser, response building). */
+static inline cJSON *report_alloc_stats(const sm_job_stats *job) {
+  cJSON *root = cJSON_CreateObject();
+  if (!root)
     return NULL;
+  sm_alloc_stats st;
+  sm_alloc_totals(&st);
+  alloc_stats_to_json(cJSON_AddObjectToObject(root, "total"), &st);
+  if (job) {
+    cJSON *j = cJSON_AddObjectToObject(root, "last_job");
+    cJSON_AddNumberToObject(j, "duration_us", (double)(job->duration_ns / 1000));
+    alloc_stats_to_json(j, &job->alloc);
   }
+  cJSON *ops = cJSON_AddObjectToObject(root, "ops");
+  for (int op = -1; op < SM_OP_COUNT; ++op) {
+    sm_alloc_op_stats(op, &st);
+    if (st.allocs == 0)
+      continue;
+    const char *name = op < 0 ? "none" : opcode_to_string((sm_opcode)op);
+    alloc_stats_to_json(cJSON_AddObjectToObject(ops, name ? name : "?"), &st);
+  }
+  return root;
+}
+
+/* Optional "limits" object of SM_OP_SHELL, SM_OP_PROC_SPAWN and the limits
+ * control command. Missing keys stay CG_UNSET. */
+static inline bool proto_limits_from_json(const cJSON *obj, cg_limits *out) {
+  cg_limits none = CG_LIMITS_NONE;
+  *out = none;
+  if (!obj)
+    return true;
+  if (!cJSON_IsObject(obj))
+    return false;
+  cJSON *w = cJSON_GetObjectItemCaseSensitive(obj, "cpu_weight");
+  cJSON *c = cJSON_GetObjectItemCaseSensitive(obj, "cpu_max_pct");
+  cJSON *m = cJSON_GetObjectItemCaseSensitive(obj, "memory_max");
+  cJSON *p = cJSON_GetObjectItemCaseSensitive(obj, "pids_max");
+  if ((w && (!cJSON_IsNumber(w) || w->valuedouble < 1 ||
+             w->valuedouble > 10000)) ||
+      (c && (!cJSON_IsNumber(c) || c->valuedouble < 1 ||
+             c->valuedouble > 100000)) ||
+      (m && (!cJSON_IsNumber(m) || m->valuedouble < 1)) ||
+      (p && (!cJSON_IsNumber(p) || p->valuedouble < 1)))
+    return false;
+  if (w)
+    out->cpu_weight = (long)w->valuedouble;
+  if (c)
+    out->cpu_max_pct = (long)c->valuedouble;
+  if (m)
+    out->memory_max = (long long)m->valuedouble;
+  if (p)
+    out->pids_max = (long)p->valuedouble;
+  return true;
+}
+
+/* Optional string member, copied; absent leaves NULL */
+static inline bool proto_opt_string(const cJSON *obj, const char *key,
+                                    char **out) {
+  cJSON *v = cJSON_GetObjectItemCaseSensitive(obj, key);
+  *out = NULL;
+  if (!v)
+    return true;
+  return cJSON_IsString(v) && (*out = sm_strdup(v->valuestring)) != NULL;
+}
+
+/* Optional user or group ID; absent leaves ACCT_ID_AUTO */
+static inline bool proto_opt_id(const cJSON *obj, const char *key,
+                                uint32_t *out) {
+  cJSON *v = cJSON_GetObjectItemCaseSensitive(obj, key);
+  *out = ACCT_ID_AUTO;
+  if (!v)
+    return true;
+  if (!cJSON_IsNumber(v) || v->valuedouble < 0 ||
+      v->valuedouble >= ACCT_ID_AUTO)
+    return false;
+  *out = (uint32_t)v->valuedouble;
+  return true;
+}
+
+/* SM_OP_USERS_ADD "groups" and "users". An entry is either a name or an
+ * object; everything is copied into the batch. */
+static inline bool proto_batch_from_json(const cJSON *data, acct_batch *b) {
+  memset(b, 0, sizeof(*b));
+  cJSON *groups = cJSON_GetObjectItemCaseSensitive(data, "groups");
+  cJSON *users = cJSON_GetObjectItemCaseSensitive(data, "users");
+  if ((groups && !cJSON_IsArray(groups)) || (users && !cJSON_IsArray(users)))
+    return false;
+  int ng = groups ? cJSON_GetArraySize(groups) : 0;
+  int nu = users ? cJSON_GetArraySize(users) : 0;
+  if (ng > ACCT_MAX_GROUPS || nu > ACCT_MAX_USERS)
+    return false;
+  b->groups = sm_calloc((size_t)ng + 1, sizeof(*b->groups));
+  b->users = sm_calloc((size_t)nu + 1, sizeof(*b->users));
+  bool ok = b->groups && b->users;
+  cJSON *it = NULL;
+  cJSON_ArrayForEach(it, groups) {
+    if (!ok)
+      break;
+    acct_group *g = &b->groups[b->ngroups++];
+    g->gid = ACCT_ID_AUTO;
+    if (cJSON_IsString(it))
+      ok = (g->name = sm_strdup(it->valuestring)) != NULL;
+    else
+      ok = cJSON_IsObject(it) && proto_opt_string(it, "name", &g->name) &&
+           g->name && proto_opt_id(it, "gid", &g->gid);
+  }
+  cJSON_ArrayForEach(it, users) {
+    if (!ok)
+      break;
+    acct_user *u = &b->users[b->nusers++];
+    u->uid = ACCT_ID_AUTO;
+    u->create_home = true;
+    if (cJSON_IsString(it)) {
+      ok = (u->name = sm_strdup(it->valuestring)) != NULL;
+      continue;
+    }
+    cJSON *supp = cJSON_GetObjectItemCaseSensitive(it, "groups");
+    cJSON *home = cJSON_GetObjectItemCaseSensitive(it, "create_home");
+    ok = cJSON_IsObject(it) && proto_opt_string(it, "name", &u->name) &&
+         u->name && proto_opt_id(it, "uid", &u->uid) &&
+         proto_opt_string(it, "group", &u->group) &&
+         proto_opt_string(it, "home", &u->home) &&
+         proto_opt_string(it, "shell", &u->shell) &&
+         proto_opt_string(it, "gecos", &u->gecos) &&
+         proto_opt_string(it, "password", &u->password) &&
+         (!home || cJSON_IsBool(home)) &&
+         (!supp || (cJSON_IsArray(supp) &&
+                    cJSON_GetArraySize(supp) <= ACCT_MAX_GROUPS));
+    if (ok && home)
+      u->create_home = cJSON_IsTrue(home);
+    if (ok && supp) {
+      int n = cJSON_GetArraySize(supp);
+      ok = (u->groups = sm_calloc((size_t)n + 1, sizeof(char *))) != NULL;
+      cJSON *g = NULL;
+      cJSON_ArrayForEach(g, supp) {
+        ok = ok && cJSON_IsString(g) &&
+             (u->groups[u->ngroups++] = sm_strdup(g->valuestring)) != NULL;
+      }
+    }
+  }
+  if (!ok || !acct_batch_valid(b)) {
+    acct_batch_free(b);
+    return false;
+  }
+  return true;
+}
+
+/* Octal permission bits, "0644" */
+static inline bool proto_mode_bits(const cJSON *v, mode_t *out) {
+  if (!cJSON_IsString(v) || !*v->valuestring)
+    return false;
+  char *end;
+  long m = strtol(v->valuestring, &end, 8);
+  if (*end || m < 0 || m > 07777)
+    return false;
+  *out = (mode_t)m;
+  return true;
+}
+
+/* SM_OP_FS_META "files"/"dirs": an exact mode, or {"set", "clear"} */
+static inline bool proto_mode_rule(const cJSON *v, fsmeta_mode *out) {
+  out->set = out->clear = 0;
+  if (!v)
+    return true;
+  if (cJSON_IsString(v)) {
+    out->clear = 07777;
+    return proto_mode_bits(v, &out->set);
+  }
+  cJSON *set = cJSON_GetObjectItemCaseSensitive(v, "set");
+  cJSON *clear = cJSON_GetObjectItemCaseSensitive(v, "clear");
+  return cJSON_IsObject(v) && (!set || proto_mode_bits(set, &out->set)) &&
+         (!clear || proto_mode_bits(clear, &out->clear));
+}
+
+/* Seconds since the epoch, or "now"; absent keeps the time */
+static inline bool proto_timestamp(const cJSON *v, struct timespec *out) {
+  out->tv_sec = 0;
+  out->tv_nsec = UTIME_OMIT;
+  if (!v)
+    return true;
+  if (cJSON_IsString(v) && strcmp(v->valuestring, "now") == 0) {
+    out->tv_nsec = UTIME_NOW;
+    return true;
+  }
+  if (!cJSON_IsNumber(v) || v->valuedouble < 0 ||
+      v->valuedouble > PROTO_MAX_EXACT)
+    return false;
+  out->tv_sec = (time_t)v->valuedouble;
+  out->tv_nsec = (long)((v->valuedouble - (double)out->tv_sec) * 1e9);
+  return true;
+}
+
+/* Build an instruction list from an already parsed recipe array */
+static inline sm_instr *proto_recipe_from_json(const cJSON *root) {
+  if (!cJSON_IsArray(root))
+    return NULL;
   sm_instr *head = NULL, *tail = NULL;
   cJSON *item = NULL;
   cJSON_ArrayForEach(item, root) {
@@ -220,25 +600,26 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
     sm_opcode code;
     if (!opcode_from_string(op->valuestring, &code))
       continue;
-    sm_instr *ins = calloc(1, sizeof(*ins));
+    sm_instr *ins = sm_calloc(1, sizeof(*ins));
     if (!ins)
       continue;
     ins->op = code;
     switch (code) {
     case SM_OP_LOAD_CONST: {
-      sm_load_const *d = malloc(sizeof(*d));
+      sm_load_const *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *val = cJSON_GetObjectItemCaseSensitive(data, "value");
       if (!cJSON_IsNumber(dest) ||
           (!cJSON_IsString(val) && !cJSON_IsNumber(val))) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
-      if (cJSON_IsString(val)) {
-        d->value = strdup(val->valuestring);
+      d->is_string = cJSON_IsString(val);
+      if (d->is_string) {
+        d->value = sm_strdup(val->valuestring);
       } else {
         d->value = (void *)(uintptr_t)val->valueint;
       }
@@ -246,7 +627,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_CREATE: {
-      sm_fs_create *d = malloc(sizeof(*d));
+      sm_fs_create *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -254,7 +635,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *type = cJSON_GetObjectItemCaseSensitive(data, "type");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path) ||
           !cJSON_IsNumber(type)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -264,13 +645,13 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_DELETE: {
-      sm_fs_delete *d = malloc(sizeof(*d));
+      sm_fs_delete *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *path = cJSON_GetObjectItemCaseSensitive(data, "path");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -279,7 +660,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_COPY: {
-      sm_fs_copy *d = malloc(sizeof(*d));
+      sm_fs_copy *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -287,7 +668,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *dst = cJSON_GetObjectItemCaseSensitive(data, "dst");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(src) ||
           !cJSON_IsNumber(dst)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -297,7 +678,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_MOVE: {
-      sm_fs_move *d = malloc(sizeof(*d));
+      sm_fs_move *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -305,7 +686,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *dst = cJSON_GetObjectItemCaseSensitive(data, "dst");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(src) ||
           !cJSON_IsNumber(dst)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -315,7 +696,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_WRITE: {
-      sm_fs_write *d = malloc(sizeof(*d));
+      sm_fs_write *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -324,7 +705,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *mode = cJSON_GetObjectItemCaseSensitive(data, "mode");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path) ||
           !cJSON_IsNumber(content) || !cJSON_IsNumber(mode)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -335,13 +716,13 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_READ: {
-      sm_fs_read *d = malloc(sizeof(*d));
+      sm_fs_read *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *path = cJSON_GetObjectItemCaseSensitive(data, "path");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -350,13 +731,13 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_UNPACK: {
-      sm_fs_unpack *d = malloc(sizeof(*d));
+      sm_fs_unpack *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *tar_path = cJSON_GetObjectItemCaseSensitive(data, "tar_path");
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       if (!cJSON_IsNumber(tar_path) || !cJSON_IsNumber(dest)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->tar_path = tar_path->valueint;
@@ -365,13 +746,13 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_HASH: {
-      sm_fs_hash *d = malloc(sizeof(*d));
+      sm_fs_hash *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *path = cJSON_GetObjectItemCaseSensitive(data, "path");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -380,13 +761,13 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_FS_LIST: {
-      sm_fs_list *d = malloc(sizeof(*d));
+      sm_fs_list *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *path = cJSON_GetObjectItemCaseSensitive(data, "path");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -395,22 +776,27 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_SHELL: {
-      sm_shell *d = malloc(sizeof(*d));
+      sm_shell *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *cmd = cJSON_GetObjectItemCaseSensitive(data, "cmd");
-      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(cmd)) {
-        free(d);
+      cJSON *usage = cJSON_GetObjectItemCaseSensitive(data, "usage");
+      cJSON *limits = cJSON_GetObjectItemCaseSensitive(data, "limits");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(cmd) ||
+          (usage && !cJSON_IsNumber(usage)) ||
+          !proto_limits_from_json(limits, &d->limits)) {
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
       d->cmd = cmd->valueint;
+      d->usage = usage ? usage->valueint : -1;
       ins->data = d;
       break;
     }
     case SM_OP_EQ: {
-      sm_eq *d = malloc(sizeof(*d));
+      sm_eq *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -418,7 +804,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *rhs = cJSON_GetObjectItemCaseSensitive(data, "rhs");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(lhs) ||
           !cJSON_IsNumber(rhs)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -428,13 +814,13 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_NOT: {
-      sm_not *d = malloc(sizeof(*d));
+      sm_not *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *src = cJSON_GetObjectItemCaseSensitive(data, "src");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(src)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -443,7 +829,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_AND: {
-      sm_and *d = malloc(sizeof(*d));
+      sm_and *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -451,7 +837,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *rhs = cJSON_GetObjectItemCaseSensitive(data, "rhs");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(lhs) ||
           !cJSON_IsNumber(rhs)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -461,7 +847,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_OR: {
-      sm_or *d = malloc(sizeof(*d));
+      sm_or *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -469,7 +855,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *rhs = cJSON_GetObjectItemCaseSensitive(data, "rhs");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(lhs) ||
           !cJSON_IsNumber(rhs)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -479,7 +865,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_INDEX_SELECT: {
-      sm_index_select *d = malloc(sizeof(*d));
+      sm_index_select *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -487,7 +873,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *index = cJSON_GetObjectItemCaseSensitive(data, "index");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(list) ||
           !cJSON_IsNumber(index)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -497,7 +883,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_RANDOM_RANGE: {
-      sm_random_range *d = malloc(sizeof(*d));
+      sm_random_range *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -505,7 +891,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *max = cJSON_GetObjectItemCaseSensitive(data, "max");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(min) ||
           !cJSON_IsNumber(max)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -515,7 +901,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_PATH_JOIN: {
-      sm_path_join *d = malloc(sizeof(*d));
+      sm_path_join *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -523,7 +909,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *name = cJSON_GetObjectItemCaseSensitive(data, "name");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(base) ||
           !cJSON_IsNumber(name)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -533,7 +919,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_RANDOM_WALK: {
-      sm_random_walk *d = malloc(sizeof(*d));
+      sm_random_walk *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
@@ -541,7 +927,7 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       cJSON *depth = cJSON_GetObjectItemCaseSensitive(data, "depth");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(root) ||
           !cJSON_IsNumber(depth)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -551,14 +937,14 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_DIR_CONTAINS: {
-      sm_dir_contains *d = malloc(sizeof(*d));
+      sm_dir_contains *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
       cJSON *a = cJSON_GetObjectItemCaseSensitive(data, "a");
       cJSON *b = cJSON_GetObjectItemCaseSensitive(data, "b");
       if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(a) || !cJSON_IsNumber(b)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->dest = dest->valueint;
@@ -568,12 +954,12 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_RAND_SEED: {
-      sm_rand_seed *d = malloc(sizeof(*d));
+      sm_rand_seed *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *seed = cJSON_GetObjectItemCaseSensitive(data, "seed");
       if (!cJSON_IsNumber(seed)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->seed = (unsigned int)seed->valueint;
@@ -581,17 +967,17 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       break;
     }
     case SM_OP_REPORT: {
-      sm_report *d = malloc(sizeof(*d));
+      sm_report *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *regs = cJSON_GetObjectItemCaseSensitive(data, "regs");
       if (!cJSON_IsArray(regs)) {
-        free(d);
+        sm_free(d);
         break;
       }
       int n = cJSON_GetArraySize(regs);
       if (n <= 0 || n > SM_REG_COUNT) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->count = n;
@@ -605,27 +991,503 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
         d->regs[i] = it->valueint;
       }
       if (!ok) {
-        free(d);
+        sm_free(d);
         break;
       }
       ins->data = d;
       break;
     }
     case SM_OP_RETURN: {
-      sm_return *d = malloc(sizeof(*d));
+      sm_return *d = sm_malloc(sizeof(*d));
       if (!d)
         break;
       cJSON *val = cJSON_GetObjectItemCaseSensitive(data, "value");
       if (!cJSON_IsNumber(val)) {
-        free(d);
+        sm_free(d);
         break;
       }
       d->value = val->valueint;
       ins->data = d;
       break;
     }
+    case SM_OP_KV_SET: {
+      sm_kv_set *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *key = cJSON_GetObjectItemCaseSensitive(data, "key");
+      cJSON *value = cJSON_GetObjectItemCaseSensitive(data, "value");
+      cJSON *ttl = cJSON_GetObjectItemCaseSensitive(data, "ttl_ms");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(key) ||
+          !cJSON_IsNumber(value) ||
+          (ttl && (!cJSON_IsNumber(ttl) || ttl->valuedouble < 0 ||
+                   ttl->valuedouble > UINT32_MAX))) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->key = key->valueint;
+      d->value = value->valueint;
+      d->ttl_ms = ttl ? (uint32_t)ttl->valuedouble : 0;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_KV_GET: {
+      sm_kv_get *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *key = cJSON_GetObjectItemCaseSensitive(data, "key");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(key)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->key = key->valueint;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_KV_DEL: {
+      sm_kv_del *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *key = cJSON_GetObjectItemCaseSensitive(data, "key");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(key)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->key = key->valueint;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_PROC_LIST: {
+      sm_proc_list *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *name = cJSON_GetObjectItemCaseSensitive(data, "name");
+      cJSON *uid = cJSON_GetObjectItemCaseSensitive(data, "uid");
+      cJSON *cmdline = cJSON_GetObjectItemCaseSensitive(data, "cmdline");
+      cJSON *fields = cJSON_GetObjectItemCaseSensitive(data, "fields");
+      bool ok = cJSON_IsNumber(dest) && (!name || cJSON_IsNumber(name)) &&
+                (!uid || cJSON_IsNumber(uid)) &&
+                (!cmdline || cJSON_IsNumber(cmdline)) &&
+                (!fields || cJSON_IsArray(fields));
+      d->nfields = 0;
+      if (ok && fields) {
+        cJSON *f = NULL;
+        cJSON_ArrayForEach(f, fields) {
+          int i = 0;
+          while (i < SM_PROC_FIELD_COUNT &&
+                 !(cJSON_IsString(f) &&
+                   strcmp(f->valuestring, proto_proc_fields[i]) == 0))
+            ++i;
+          if (i == SM_PROC_FIELD_COUNT || d->nfields == SM_PROC_FIELD_COUNT) {
+            ok = false;
+            break;
+          }
+          d->fields[d->nfields++] = (uint8_t)i;
+        }
+        ok = ok && d->nfields > 0;
+      } else if (ok) {
+        for (int i = 0; i < SM_PROC_FIELD_COUNT; ++i)
+          d->fields[d->nfields++] = (uint8_t)i;
+      }
+      if (!ok) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->name = name ? name->valueint : -1;
+      d->uid = uid ? uid->valueint : -1;
+      d->cmdline = cmdline ? cmdline->valueint : -1;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_NET_LISTEN: {
+      sm_net_listen *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *port = cJSON_GetObjectItemCaseSensitive(data, "port");
+      cJSON *count = cJSON_GetObjectItemCaseSensitive(data, "count");
+      cJSON *protos = cJSON_GetObjectItemCaseSensitive(data, "protos");
+      cJSON *pids = cJSON_GetObjectItemCaseSensitive(data, "pids");
+      bool ok = cJSON_IsNumber(dest) && (!port || cJSON_IsNumber(port)) &&
+                (!count || cJSON_IsNumber(count)) &&
+                (!protos || cJSON_IsArray(protos)) &&
+                (!pids || cJSON_IsBool(pids));
+      d->protos = protos ? 0 : NET_ALL;
+      cJSON *p = NULL;
+      if (ok && protos) {
+        cJSON_ArrayForEach(p, protos) {
+          size_t i = 0, n = sizeof(proto_net_tables) / sizeof(proto_net_tables[0]);
+          while (i < n && !(cJSON_IsString(p) &&
+                            strcmp(p->valuestring, proto_net_tables[i].name) == 0))
+            ++i;
+          if (i == n) {
+            ok = false;
+            break;
+          }
+          d->protos |= proto_net_tables[i].bit;
+        }
+        ok = ok && d->protos != 0;
+      }
+      if (!ok) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->port = port ? port->valueint : -1;
+      d->count = count ? count->valueint : -1;
+      d->pids = cJSON_IsTrue(pids);
+      ins->data = d;
+      break;
+    }
+    case SM_OP_PROC_SPAWN: {
+      sm_proc_spawn *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *cmd = cJSON_GetObjectItemCaseSensitive(data, "cmd");
+      cJSON *limits = cJSON_GetObjectItemCaseSensitive(data, "limits");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(cmd) ||
+          !proto_limits_from_json(limits, &d->limits)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->cmd = cmd->valueint;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_PROC_STATUS: {
+      sm_proc_status *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *handle = cJSON_GetObjectItemCaseSensitive(data, "handle");
+      cJSON *running = cJSON_GetObjectItemCaseSensitive(data, "running");
+      cJSON *usage = cJSON_GetObjectItemCaseSensitive(data, "usage");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(handle) ||
+          (running && !cJSON_IsNumber(running)) ||
+          (usage && !cJSON_IsNumber(usage))) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->handle = handle->valueint;
+      d->running = running ? running->valueint : -1;
+      d->usage = usage ? usage->valueint : -1;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_PROC_SIGNAL: {
+      sm_proc_signal *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *handle = cJSON_GetObjectItemCaseSensitive(data, "handle");
+      cJSON *sig = cJSON_GetObjectItemCaseSensitive(data, "signal");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(handle) ||
+          !cJSON_IsNumber(sig)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->handle = handle->valueint;
+      d->signal = sig->valueint;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_PROC_READ: {
+      sm_proc_read *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *handle = cJSON_GetObjectItemCaseSensitive(data, "handle");
+      cJSON *stream = cJSON_GetObjectItemCaseSensitive(data, "stream");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(handle) ||
+          (stream && !cJSON_IsString(stream)) ||
+          (stream && strcmp(stream->valuestring, "stdout") != 0 &&
+           strcmp(stream->valuestring, "stderr") != 0)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->handle = handle->valueint;
+      d->stream = stream && strcmp(stream->valuestring, "stderr") == 0
+                      ? SUP_STDERR
+                      : SUP_STDOUT;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_GENTREE: {
+      sm_fs_gentree *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *root = cJSON_GetObjectItemCaseSensitive(data, "root");
+      cJSON *dist = cJSON_GetObjectItemCaseSensitive(data, "size_dist");
+      cJSON *alphabet = cJSON_GetObjectItemCaseSensitive(data, "alphabet");
+      /* Numeric fields are optional literals: name, default */
+      static const struct {
+        const char *key;
+        double def;
+      } nums[] = {{"seed", 0},     {"depth", 0},    {"fanout", 0},
+                  {"files", 0},    {"size_min", 0}, {"size_max", 4096},
+                  {"name_len", 8}, {"threads", 0}};
+      double v[8];
+      bool ok = cJSON_IsNumber(dest) && cJSON_IsNumber(root) &&
+                (!dist || (cJSON_IsString(dist) &&
+                           (strcmp(dist->valuestring, "uniform") == 0 ||
+                            strcmp(dist->valuestring, "log2") == 0))) &&
+                (!alphabet || (cJSON_IsString(alphabet) &&
+                               strlen(alphabet->valuestring) <=
+                                   GENTREE_MAX_NAME));
+      for (int i = 0; ok && i < 8; ++i) {
+        cJSON *n = cJSON_GetObjectItemCaseSensitive(data, nums[i].key);
+        ok = !n || (cJSON_IsNumber(n) && n->valuedouble >= 0);
+        v[i] = n && ok ? n->valuedouble : nums[i].def;
+      }
+      if (!ok) {
+        sm_free(d);
+        break;
+      }
+      memset(&d->spec, 0, sizeof(d->spec));
+      d->dest = dest->valueint;
+      d->root = root->valueint;
+      d->spec.seed = (uint64_t)v[0];
+      d->spec.depth = v[1] > GENTREE_MAX_DEPTH ? -1 : (int)v[1];
+      d->spec.fanout = v[2] > GENTREE_MAX_DIRS ? -1 : (int)v[2];
+      d->spec.files = v[3] > GENTREE_MAX_FILES ? UINT32_MAX : (uint32_t)v[3];
+      d->spec.size_min = (uint64_t)v[4];
+      d->spec.size_max = v[5] > GENTREE_MAX_SIZE ? UINT64_MAX : (uint64_t)v[5];
+      d->spec.name_len = v[6] > GENTREE_MAX_NAME ? -1 : (int)v[6];
+      d->spec.threads = v[7] > GENTREE_MAX_THREADS ? -1 : (int)v[7];
+      d->spec.dist = dist && strcmp(dist->valuestring, "log2") == 0
+                         ? GENTREE_LOG2
+                         : GENTREE_UNIFORM;
+      strcpy(d->spec.alphabet,
+             alphabet ? alphabet->valuestring : PROTO_GENTREE_ALPHABET);
+      if (!gentree_spec_valid(&d->spec)) {
+        sm_free(d);
+        break;
+      }
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_ALLOCATE: {
+      sm_fs_allocate *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *path = cJSON_GetObjectItemCaseSensitive(data, "path");
+      cJSON *size = cJSON_GetObjectItemCaseSensitive(data, "size");
+      cJSON *mode = cJSON_GetObjectItemCaseSensitive(data, "mode");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path) ||
+          !cJSON_IsNumber(size) || size->valuedouble < 0 ||
+          size->valuedouble > PROTO_MAX_EXACT ||
+          (mode && (!cJSON_IsString(mode) ||
+                    (strcmp(mode->valuestring, "allocate") != 0 &&
+                     strcmp(mode->valuestring, "sparse") != 0)))) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->path = path->valueint;
+      d->size = (uint64_t)size->valuedouble;
+      d->allocate = !mode || strcmp(mode->valuestring, "sparse") != 0;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_EXHAUST: {
+      sm_fs_exhaust *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *path = cJSON_GetObjectItemCaseSensitive(data, "path");
+      cJSON *res = cJSON_GetObjectItemCaseSensitive(data, "resource");
+      cJSON *left = cJSON_GetObjectItemCaseSensitive(data, "free");
+      cJSON *threads = cJSON_GetObjectItemCaseSensitive(data, "threads");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(path) ||
+          !cJSON_IsString(res) ||
+          (strcmp(res->valuestring, "space") != 0 &&
+           strcmp(res->valuestring, "inodes") != 0) ||
+          (left && (!cJSON_IsNumber(left) || left->valuedouble < 0 ||
+                    left->valuedouble > PROTO_MAX_EXACT)) ||
+          (threads && (!cJSON_IsNumber(threads) || threads->valueint < 0 ||
+                       threads->valueint > FILL_MAX_THREADS))) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->path = path->valueint;
+      d->resource = strcmp(res->valuestring, "inodes") == 0 ? FILL_INODES
+                                                             : FILL_SPACE;
+      d->target = left ? (uint64_t)left->valuedouble : 0;
+      d->threads = threads ? threads->valueint : 0;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_RELEASE: {
+      sm_fs_release *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *handle = cJSON_GetObjectItemCaseSensitive(data, "handle");
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(handle)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->handle = handle->valueint;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_USERS_ADD: {
+      sm_users_add *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      if (!cJSON_IsNumber(dest) || !proto_batch_from_json(data, &d->batch)) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_META: {
+      sm_fs_meta *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      memset(d, 0, sizeof(*d));
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *root = cJSON_GetObjectItemCaseSensitive(data, "root");
+      cJSON *owner = cJSON_GetObjectItemCaseSensitive(data, "owner");
+      cJSON *seed = cJSON_GetObjectItemCaseSensitive(data, "scramble");
+      cJSON *mask = cJSON_GetObjectItemCaseSensitive(data, "scramble_mask");
+      cJSON *rec = cJSON_GetObjectItemCaseSensitive(data, "restore");
+      cJSON *threads = cJSON_GetObjectItemCaseSensitive(data, "threads");
+      fsmeta_spec *sp = &d->spec;
+      sp->uid = (uid_t)-1;
+      sp->gid = (gid_t)-1;
+      sp->scramble_mask = 0777;
+      bool ok =
+          cJSON_IsNumber(dest) && cJSON_IsNumber(root) &&
+          proto_mode_rule(cJSON_GetObjectItemCaseSensitive(data, "files"),
+                          &sp->file) &&
+          proto_mode_rule(cJSON_GetObjectItemCaseSensitive(data, "dirs"),
+                          &sp->dir) &&
+          proto_timestamp(cJSON_GetObjectItemCaseSensitive(data, "atime"),
+                          &sp->atime) &&
+          proto_timestamp(cJSON_GetObjectItemCaseSensitive(data, "mtime"),
+                          &sp->mtime) &&
+          (!owner || (cJSON_IsString(owner) && *owner->valuestring &&
+                      strlen(owner->valuestring) < sizeof(d->owner))) &&
+          (!seed || (cJSON_IsNumber(seed) && seed->valuedouble >= 0)) &&
+          (!mask || proto_mode_bits(mask, &sp->scramble_mask)) &&
+          (!rec || cJSON_IsBool(rec)) &&
+          (!threads || (cJSON_IsNumber(threads) && threads->valueint >= 0 &&
+                        threads->valueint <= FSMETA_MAX_THREADS));
+      if (!ok) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->root = root->valueint;
+      if (owner)
+        strcpy(d->owner, owner->valuestring);
+      sp->scramble = seed != NULL;
+      sp->seed = seed ? (uint64_t)seed->valuedouble : 0;
+      sp->record = cJSON_IsTrue(rec);
+      sp->threads = threads ? threads->valueint : 0;
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_STAT: {
+      sm_fs_stat *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *paths = cJSON_GetObjectItemCaseSensitive(data, "paths");
+      cJSON *base = cJSON_GetObjectItemCaseSensitive(data, "base");
+      cJSON *follow = cJSON_GetObjectItemCaseSensitive(data, "follow");
+      cJSON *fields = cJSON_GetObjectItemCaseSensitive(data, "fields");
+      bool ok = cJSON_IsNumber(dest) && cJSON_IsNumber(paths) &&
+                (!base || cJSON_IsNumber(base)) &&
+                (!follow || cJSON_IsBool(follow)) &&
+                (!fields || cJSON_IsArray(fields));
+      d->nfields = 0;
+      if (ok && fields) {
+        cJSON *f = NULL;
+        cJSON_ArrayForEach(f, fields) {
+          int i = 0;
+          while (i < FSMETA_FIELD_COUNT &&
+                 !(cJSON_IsString(f) &&
+                   strcmp(f->valuestring, proto_stat_fields[i]) == 0))
+            ++i;
+          if (i == FSMETA_FIELD_COUNT || d->nfields == FSMETA_FIELD_COUNT) {
+            ok = false;
+            break;
+          }
+          d->fields[d->nfields++] = (uint8_t)i;
+        }
+        ok = ok && d->nfields > 0;
+      } else if (ok) {
+        for (int i = 0; i < FSMETA_FIELD_COUNT; ++i)
+          d->fields[d->nfields++] = (uint8_t)i;
+      }
+      if (!ok) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->paths = paths->valueint;
+      d->base = base ? base->valueint : -1;
+      d->follow = cJSON_IsTrue(follow);
+      ins->data = d;
+      break;
+    }
+    case SM_OP_FS_SEARCH: {
+      sm_fs_search *d = sm_malloc(sizeof(*d));
+      if (!d)
+        break;
+      cJSON *dest = cJSON_GetObjectItemCaseSensitive(data, "dest");
+      cJSON *root = cJSON_GetObjectItemCaseSensitive(data, "root");
+      cJSON *pattern = cJSON_GetObjectItemCaseSensitive(data, "pattern");
+      cJSON *mode = cJSON_GetObjectItemCaseSensitive(data, "mode");
+      cJSON *max_size = cJSON_GetObjectItemCaseSensitive(data, "max_size");
+      cJSON *limit = cJSON_GetObjectItemCaseSensitive(data, "limit");
+      int m = 0;
+      while (mode && m < 3 &&
+             !(cJSON_IsString(mode) &&
+               strcmp(mode->valuestring, proto_search_modes[m]) == 0))
+        ++m;
+      if (!cJSON_IsNumber(dest) || !cJSON_IsNumber(root) ||
+          !cJSON_IsNumber(pattern) || m == 3 ||
+          (max_size && (!cJSON_IsNumber(max_size) ||
+                        max_size->valuedouble < 0 ||
+                        max_size->valuedouble > PROTO_MAX_EXACT)) ||
+          (limit && (!cJSON_IsNumber(limit) || limit->valuedouble < 0 ||
+                     limit->valuedouble > PROTO_MAX_EXACT))) {
+        sm_free(d);
+        break;
+      }
+      d->dest = dest->valueint;
+      d->root = root->valueint;
+      d->pattern = pattern->valueint;
+      d->opts.mode = (fsearch_mode)m;
+      d->opts.max_size = max_size ? (uint64_t)max_size->valuedouble : 0;
+      d->opts.limit = limit ? (uint64_t)limit->valuedouble : 0;
+      ins->data = d;
+      break;
+    }
     default:
-      free(ins);
+      sm_free(ins);
       ins = NULL;
       break;
     }
@@ -637,10 +1499,37 @@ static inline sm_instr *proto_parse_recipe(const char *json) {
       tail->next = ins;
     tail = ins;
   }
+  return head;
+}
+
+/* Parse JSON recipe into instruction list */
+static inline sm_instr *proto_parse_recipe(const char *json) {
+  if (!json)
+    return NULL;
+  cJSON *root = cJSON_Parse(json);
+  sm_instr *head = proto_recipe_from_json(root);
   cJSON_Delete(root);
   return head;
 }
 
+/* Free a chain returned by proto_parse_recipe(). Registers hold copies of
+ * its string constants, so this is safe once its job has finished. */
+static inline void proto_free_recipe(sm_instr *head) {
+  while (head) {
+    sm_instr *next = head->next;
+    if (head->op == SM_OP_LOAD_CONST && head->data) {
+      sm_load_const *d = head->data;
+      if (d->is_string)
+        sm_free((void *)d->value);
+    }
+    if (head->op == SM_OP_USERS_ADD && head->data)
+      acct_batch_free(&((sm_users_add *)head->data)->batch);
+    sm_free(head->data);
+    sm_free(head);
+    head = next;
+  }
+}
+
 #ifdef __cplusplus
 }
 #endif
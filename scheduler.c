@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+#include "scheduler.h"
+// clang-format off
+#include <sys/socket.h>
+#include "protocol.h"
+// clang-format on
+#include "taskd_log.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_MASK                                                             \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |            \
+   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+  uint64_t seq;
+  uint64_t wall_ns;
+  uint64_t duration_ns;
+  int ret;
+  int err;
+  const char *trigger; /* "interval" or "watch" */
+  char *reports;       /* JSON array text, as a host job would get it */
+} sched_result;
+
+typedef struct {
+  uint32_t id;
+  char name[32];
+  sm_instr *chain; /* parsed once; registers copy constants, so reusable */
+  uint64_t interval_ns; /* 0 for watch-only schedules */
+  uint64_t next_due;    /* CLOCK_MONOTONIC */
+  uint64_t last_run;
+  char *watch;
+  int wd;
+  bool changed; /* the watch fired since the last run */
+  bool busy;    /* running on the scheduler thread right now */
+  bool removed; /* freed by the scheduler thread once the run ends */
+  uint64_t runs;
+  uint64_t dropped; /* results overwritten since the last drain */
+  uint32_t capacity;
+  uint32_t head; /* oldest buffered result */
+  uint32_t count;
+  sched_result *results;
+} sched_entry;
+
+static sched_entry *table[SCHED_MAX];
+static uint32_t next_id = 1;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sched_thread;
+static bool thread_running = false;
+static bool stopping = false;
+static int wake_fd = -1; /* eventfd, written when the table changes */
+static int inotify_fd = -1;
+static sm_ctx *sched_ctx = NULL;
+/* Seed from sched_reseed(), applied by the scheduler thread before its next
+ * run and again to the executor of every thread started later */
+static bool reseed_pending = false;
+static unsigned int pending_seed;
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void wake(void) {
+  uint64_t one = 1;
+  if (wake_fd != -1 && write(wake_fd, &one, sizeof(one)) < 0)
+    TLOG(TLOG_WARN, "scheduler wakeup failed: errno %lld", errno);
+}
+
+static void entry_free(sched_entry *e) {
+  for (uint32_t i = 0; i < e->count; ++i)
+    sm_free(e->results[(e->head + i) % e->capacity].reports);
+  sm_free(e->results);
+  sm_free(e->watch);
+  proto_free_recipe(e->chain);
+  sm_free(e);
+}
+
+/* Drop the inotify watch unless another schedule shares it (the kernel
+ * hands out one wd per inode). Caller holds sched_lock. */
+static void entry_unwatch(sched_entry *e) {
+  if (e->wd < 0)
+    return;
+  for (int i = 0; i < SCHED_MAX; ++i)
+    if (table[i] && table[i] != e && table[i]->wd == e->wd)
+      return;
+  inotify_rm_watch(inotify_fd, e->wd);
+}
+
+/* Earliest time anything can become due, or UINT64_MAX. A watch that fired
+ * runs at most once per SCHED_MIN_INTERVAL_MS so a busy log file cannot
+ * monopolise the executor. Caller holds sched_lock. */
+static uint64_t due_time(const sched_entry *e) {
+  uint64_t due = UINT64_MAX;
+  if (e->interval_ns)
+    due = e->next_due;
+  if (e->changed) {
+    uint64_t w = e->last_run + SCHED_MIN_INTERVAL_MS * 1000000ull;
+    if (w < due)
+      due = w;
+  }
+  return due;
+}
+
+static void store_result(sched_entry *e, sched_result *r) {
+  if (e->count == e->capacity) {
+    sm_free(e->results[e->head].reports);
+    e->head = (e->head + 1) % e->capacity;
+    e->count--;
+    e->dropped++;
+  }
+  r->seq = e->runs++;
+  e->results[(e->head + e->count) % e->capacity] = *r;
+  e->count++;
+}
+
+static void run_entry(sched_entry *e, sched_result *r) {
+  sm_buf buf = {0};
+  sm_buf_append(&buf, "[", 1);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r->wall_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  r->ret = -1;
+  r->err = -1;
+  sm_set_report_cb(sched_ctx, proto_buf_collect_cb, &buf);
+  if (sm_submit(sched_ctx, e->chain)) {
+    sm_job_stats st;
+    sm_wait(sched_ctx, &r->ret);
+    if (sm_get_job_stats(sched_ctx, &st)) {
+      r->duration_ns = st.duration_ns;
+      r->err = st.err;
+    }
+  }
+  sm_set_report_cb(sched_ctx, NULL, NULL);
+  sm_buf_append(&buf, "]", 1);
+  if (buf.failed) {
+    sm_free(buf.data);
+    buf.data = NULL;
+  }
+  r->reports = buf.data;
+}
+
+/* Run everything that is due, earliest first and one schedule at a time,
+ * without holding the lock while a recipe executes. Each schedule runs at
+ * most once per pass, so one slower than its interval cannot starve the
+ * others or keep the thread from reading inotify and wakeup events. */
+static void run_due(void) {
+  uint64_t start = mono_ns();
+  for (;;) {
+    pthread_mutex_lock(&sched_lock);
+    uint64_t now = mono_ns();
+    sched_entry *e = NULL;
+    uint64_t first = UINT64_MAX;
+    for (int i = 0; i < SCHED_MAX; ++i) {
+      sched_entry *c = table[i];
+      if (!c || c->removed || c->last_run >= start)
+        continue;
+      uint64_t due = due_time(c);
+      if (due <= now && due < first) {
+        e = c;
+        first = due;
+      }
+    }
+    if (!e) {
+      pthread_mutex_unlock(&sched_lock);
+      return;
+    }
+    sched_result r = {0};
+    if (e->changed && e->last_run + SCHED_MIN_INTERVAL_MS * 1000000ull <= now) {
+      r.trigger = "watch";
+      e->changed = false;
+    } else {
+      r.trigger = "interval";
+    }
+    if (e->interval_ns) {
+      /* Fixed rate; intervals missed while busy are skipped, not queued */
+      while (e->next_due <= now)
+        e->next_due += e->interval_ns;
+    }
+    e->last_run = now;
+    e->busy = true;
+    bool reseed = reseed_pending;
+    unsigned int seed = pending_seed;
+    reseed_pending = false;
+    pthread_mutex_unlock(&sched_lock);
+
+    if (reseed)
+      sm_reseed(sched_ctx, seed);
+    run_entry(e, &r);
+
+    pthread_mutex_lock(&sched_lock);
+    e->busy = false;
+    if (e->removed) {
+      sm_free(r.reports);
+      entry_free(e);
+    } else {
+      store_result(e, &r);
+    }
+    pthread_mutex_unlock(&sched_lock);
+  }
+}
+
+static void read_inotify(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    pthread_mutex_lock(&sched_lock);
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      for (int i = 0; i < SCHED_MAX; ++i) {
+        sched_entry *e = table[i];
+        if (!e || e->wd != ev->wd)
+          continue;
+        if (ev->mask & IN_IGNORED) {
+          TLOG_S(TLOG_WARN, "schedule %s: watched path went away", e->name);
+          e->wd = -1;
+        } else {
+          e->changed = true;
+        }
+      }
+      p += sizeof(*ev) + ev->len;
+    }
+    pthread_mutex_unlock(&sched_lock);
+  }
+}
+
+static void *sched_main(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&sched_lock);
+    if (stopping) {
+      pthread_mutex_unlock(&sched_lock);
+      break;
+    }
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < SCHED_MAX; ++i)
+      if (table[i] && !table[i]->removed && due_time(table[i]) < next)
+        next = due_time(table[i]);
+    pthread_mutex_unlock(&sched_lock);
+
+    int timeout = -1;
+    if (next != UINT64_MAX) {
+      uint64_t now = mono_ns();
+      /* Round up so a wakeup never lands just before the deadline */
+      timeout = next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+    }
+    struct pollfd pfd[2] = {{.fd = wake_fd, .events = POLLIN},
+                            {.fd = inotify_fd, .events = POLLIN}};
+    if (poll(pfd, 2, timeout) > 0) {
+      uint64_t v;
+      if ((pfd[0].revents & POLLIN) && read(wake_fd, &v, sizeof(v)) < 0)
+        TLOG(TLOG_WARN, "scheduler wakeup read failed: errno %lld", errno);
+      if (pfd[1].revents & POLLIN)
+        read_inotify();
+    }
+    run_due();
+  }
+  return NULL;
+}
+
+/* Caller holds sched_lock. */
+static bool start_thread(void) {
+  if (thread_running)
+    return true;
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  sched_ctx = sm_thread_start();
+  if (wake_fd == -1 || inotify_fd == -1 || !sched_ctx ||
+      pthread_create(&sched_thread, NULL, sched_main, NULL) != 0) {
+    TLOG(TLOG_ERROR, "scheduler start failed: errno %lld", errno);
+    if (wake_fd != -1)
+      close(wake_fd);
+    if (inotify_fd != -1)
+      close(inotify_fd);
+    sm_thread_stop(sched_ctx);
+    wake_fd = inotify_fd = -1;
+    sched_ctx = NULL;
+    return false;
+  }
+  stopping = false;
+  thread_running = true;
+  reseed_pending = true; /* a new executor starts at seed 0 */
+  return true;
+}
+
+uint32_t sched_add(const char *name, const cJSON *spec) {
+  if (!cJSON_IsObject(spec))
+    return 0;
+  const cJSON *interval = cJSON_GetObjectItemCaseSensitive(spec, "interval_ms");
+  const cJSON *watch = cJSON_GetObjectItemCaseSensitive(spec, "watch");
+  const cJSON *cap = cJSON_GetObjectItemCaseSensitive(spec, "capacity");
+  const cJSON *recipe = cJSON_GetObjectItemCaseSensitive(spec, "recipe");
+  if ((interval && (!cJSON_IsNumber(interval) ||
+                    interval->valuedouble < SCHED_MIN_INTERVAL_MS)) ||
+      (watch && !cJSON_IsString(watch)) || (!interval && !watch) ||
+      (cap && (!cJSON_IsNumber(cap) || cap->valueint < 1 ||
+               cap->valueint > SCHED_MAX_CAPACITY)))
+    return 0;
+
+  sched_entry *e = sm_calloc(1, sizeof(*e));
+  if (!e)
+    return 0;
+  snprintf(e->name, sizeof(e->name), "%s", name ? name : "");
+  e->wd = -1;
+  e->capacity = cap ? (uint32_t)cap->valueint : SCHED_DEFAULT_CAPACITY;
+  e->results = sm_calloc(e->capacity, sizeof(*e->results));
+  e->chain = cJSON_IsArray(recipe) ? proto_recipe_from_json(recipe) : NULL;
+  e->watch = watch ? sm_strdup(watch->valuestring) : NULL;
+  if (!e->results || !e->chain || (watch && !e->watch)) {
+    entry_free(e);
+    return 0;
+  }
+  if (interval) {
+    e->interval_ns = (uint64_t)interval->valuedouble * 1000000ull;
+    e->next_due = mono_ns() + e->interval_ns;
+  }
+
+  pthread_mutex_lock(&sched_lock);
+  int slot = -1;
+  for (int i = 0; i < SCHED_MAX && slot < 0; ++i)
+    if (!table[i])
+      slot = i;
+  if (slot < 0 || !start_thread()) {
+    pthread_mutex_unlock(&sched_lock);
+    entry_free(e);
+    return 0;
+  }
+  if (e->watch) {
+    e->wd = inotify_add_watch(inotify_fd, e->watch, WATCH_MASK);
+    if (e->wd < 0) {
+      TLOG_S(TLOG_WARN, "cannot watch %s: errno %lld", e->watch, errno);
+      pthread_mutex_unlock(&sched_lock);
+      entry_free(e);
+      return 0;
+    }
+  }
+  e->id = next_id++;
+  table[slot] = e;
+  pthread_mutex_unlock(&sched_lock);
+  wake();
+  TLOG_S(TLOG_INFO, "schedule %s added as %llu", e->name, e->id);
+  return e->id;
+}
+
+bool sched_remove(uint32_t id) {
+  pthread_mutex_lock(&sched_lock);
+  bool found = false;
+  for (int i = 0; i < SCHED_MAX && !found; ++i) {
+    sched_entry *e = table[i];
+    if (!e || e->id != id)
+      continue;
+    found = true;
+    entry_unwatch(e);
+    table[i] = NULL;
+    if (e->busy)
+      e->removed = true;
+    else
+      entry_free(e);
+  }
+  pthread_mutex_unlock(&sched_lock);
+  if (found)
+    wake();
+  return found;
+}
+
+static cJSON *result_to_json(const sched_result *r) {
+  cJSON *obj = cJSON_CreateObject();
+  if (!obj)
+    return NULL;
+  cJSON_AddNumberToObject(obj, "seq", (double)r->seq);
+  cJSON_AddNumberToObject(obj, "time_ms", (double)(r->wall_ns / 1000000));
+  cJSON_AddNumberToObject(obj, "duration_us", (double)(r->duration_ns / 1000));
+  cJSON_AddStringToObject(obj, "trigger", r->trigger);
+  cJSON_AddNumberToObject(obj, "result", r->ret);
+  cJSON_AddNumberToObject(obj, "err", r->err);
+  if (r->reports)
+    cJSON_AddRawToObject(obj, "reports", r->reports);
+  return obj;
+}
+
+/* Caller holds sched_lock. */
+static cJSON *entry_drain(sched_entry *e) {
+  cJSON *obj = cJSON_CreateObject();
+  if (!obj)
+    return NULL;
+  cJSON_AddNumberToObject(obj, "id", e->id);
+  cJSON_AddStringToObject(obj, "name", e->name);
+  if (e->interval_ns)
+    cJSON_AddNumberToObject(obj, "interval_ms",
+                            (double)(e->interval_ns / 1000000));
+  if (e->watch)
+    cJSON_AddStringToObject(obj, "watch", e->watch);
+  cJSON_AddNumberToObject(obj, "runs", (double)e->runs);
+  cJSON_AddNumberToObject(obj, "dropped", (double)e->dropped);
+  cJSON *arr = cJSON_AddArrayToObject(obj, "results");
+  for (uint32_t i = 0; i < e->count; ++i) {
+    sched_result *r = &e->results[(e->head + i) % e->capacity];
+    cJSON_AddItemToArray(arr, result_to_json(r));
+    sm_free(r->reports);
+    r->reports = NULL;
+  }
+  e->head = 0;
+  e->count = 0;
+  e->dropped = 0;
+  return obj;
+}
+
+cJSON *sched_drain_json(uint32_t id) {
+  cJSON *arr = cJSON_CreateArray();
+  if (!arr)
+    return NULL;
+  bool found = id == 0;
+  pthread_mutex_lock(&sched_lock);
+  for (int i = 0; i < SCHED_MAX; ++i) {
+    sched_entry *e = table[i];
+    if (!e || (id && e->id != id))
+      continue;
+    found = true;
+    cJSON_AddItemToArray(arr, entry_drain(e));
+  }
+  pthread_mutex_unlock(&sched_lock);
+  if (!found) {
+    cJSON_Delete(arr);
+    return NULL;
+  }
+  return arr;
+}
+
+void sched_reseed(unsigned int seed) {
+  pthread_mutex_lock(&sched_lock);
+  pending_seed = seed;
+  reseed_pending = true;
+  pthread_mutex_unlock(&sched_lock);
+}
+
+void sched_stop(void) {
+  pthread_mutex_lock(&sched_lock);
+  if (!thread_running) {
+    pthread_mutex_unlock(&sched_lock);
+    return;
+  }
+  stopping = true;
+  pthread_mutex_unlock(&sched_lock);
+  wake();
+  pthread_join(sched_thread, NULL);
+  for (int i = 0; i < SCHED_MAX; ++i) {
+    if (table[i])
+      entry_free(table[i]);
+    table[i] = NULL;
+  }
+  sm_thread_stop(sched_ctx);
+  sched_ctx = NULL;
+  close(wake_fd);
+  close(inotify_fd);
+  wake_fd = inotify_fd = -1;
+  thread_running = false;
+}
@@ -0,0 +1,52 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cJSON.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Background recipes run inside the guest without a host round trip.
+ *
+ * A schedule runs its recipe every interval_ms, whenever a watched path is
+ * modified, or both. Runs happen on a scheduler thread with its own
+ * executor, so they never queue behind host jobs (nor host jobs behind
+ * them). Each schedule keeps its last `capacity` results, dropping the
+ * oldest, until the host drains them.
+ *
+ * The thread starts with the first schedule.
+ */
+#define SCHED_MAX 32
+#define SCHED_DEFAULT_CAPACITY 16
+#define SCHED_MAX_CAPACITY 256
+#define SCHED_MIN_INTERVAL_MS 10
+
+/* Register a schedule from its spec:
+ *   {"interval_ms": N, "watch": "/path", "capacity": N, "recipe": [...]}
+ * At least one of interval_ms and watch is required. Returns the schedule
+ * id, or 0 if the spec is invalid or SCHED_MAX schedules exist. */
+uint32_t sched_add(const char *name, const cJSON *spec);
+
+/* Remove a schedule; results not yet drained are discarded. */
+bool sched_remove(uint32_t id);
+
+/* Move buffered results out, for one schedule or all of them (id 0):
+ * [{"id", "name", "runs", "dropped", "results": [...]}]. Returns NULL for
+ * an unknown id. */
+cJSON *sched_drain_json(uint32_t id);
+
+/* Replace the scheduler executor's RNG seed (snapshot restore). */
+void sched_reseed(unsigned int seed);
+
+/* Stop the thread and free every schedule. */
+void sched_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SCHEDULER_H */
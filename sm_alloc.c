@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "sm_alloc.h"
+#include "state_machine.h"
+#include <cJSON.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  _Atomic uint64_t allocs;
+  _Atomic uint64_t frees;
+  _Atomic uint64_t bytes_alloc;
+  _Atomic uint64_t bytes_freed;
+} alloc_counters;
+
+/* One slot per opcode plus a trailing slot for unattributed allocations */
+static alloc_counters op_counters[SM_OP_COUNT + 1];
+static alloc_counters totals;
+static _Atomic int64_t total_live;
+static _Atomic uint64_t total_peak;
+
+static __thread sm_alloc_stats *cur_job = NULL;
+static __thread int cur_op = SM_OP_COUNT;
+
+static inline void note_alloc(size_t n) {
+  alloc_counters *c = &op_counters[cur_op];
+  atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->bytes_alloc, n, memory_order_relaxed);
+  atomic_fetch_add_explicit(&totals.allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&totals.bytes_alloc, n, memory_order_relaxed);
+  int64_t live = atomic_fetch_add_explicit(&total_live, (int64_t)n,
+                                           memory_order_relaxed) +
+                 (int64_t)n;
+  uint64_t peak = atomic_load_explicit(&total_peak, memory_order_relaxed);
+  while (live > 0 && (uint64_t)live > peak &&
+         !atomic_compare_exchange_weak_explicit(&total_peak, &peak,
+                                                (uint64_t)live,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+  sm_alloc_stats *j = cur_job;
+  if (j) {
+    j->allocs++;
+    j->bytes_alloc += n;
+    j->live += (int64_t)n;
+    if (j->live > 0 && (uint64_t)j->live > j->peak)
+      j->peak = (uint64_t)j->live;
+  }
+}
+
+static inline void note_free(size_t n) {
+  alloc_counters *c = &op_counters[cur_op];
+  atomic_fetch_add_explicit(&c->frees, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->bytes_freed, n, memory_order_relaxed);
+  atomic_fetch_add_explicit(&totals.frees, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&totals.bytes_freed, n, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&total_live, (int64_t)n, memory_order_relaxed);
+  sm_alloc_stats *j = cur_job;
+  if (j) {
+    j->frees++;
+    j->bytes_freed += n;
+    j->live -= (int64_t)n;
+  }
+}
+
+void *sm_malloc(size_t size) {
+  void *p = malloc(size);
+  if (p)
+    note_alloc(malloc_usable_size(p));
+  return p;
+}
+
+void *sm_calloc(size_t n, size_t size) {
+  void *p = calloc(n, size);
+  if (p)
+    note_alloc(malloc_usable_size(p));
+  return p;
+}
+
+void *sm_realloc(void *ptr, size_t size) {
+  size_t old = ptr ? malloc_usable_size(ptr) : 0;
+  void *p = realloc(ptr, size);
+  if (!p)
+    return NULL;
+  if (ptr)
+    note_free(old);
+  note_alloc(malloc_usable_size(p));
+  return p;
+}
+
+char *sm_strdup(const char *s) {
+  if (!s)
+    return NULL;
+  size_t len = strlen(s) + 1;
+  char *out = sm_malloc(len);
+  if (out)
+    memcpy(out, s, len);
+  return out;
+}
+
+void sm_free(void *ptr) {
+  if (!ptr)
+    return;
+  note_free(malloc_usable_size(ptr));
+  free(ptr);
+}
+
+void sm_alloc_init(void) {
+  cJSON_Hooks hooks = {sm_malloc, sm_free};
+  cJSON_InitHooks(&hooks);
+}
+
+void sm_alloc_set_job(sm_alloc_stats *job) { cur_job = job; }
+
+void sm_alloc_set_op(int op) {
+  cur_op = (op >= 0 && op < SM_OP_COUNT) ? op : SM_OP_COUNT;
+}
+
+static void load_counters(alloc_counters *c, sm_alloc_stats *out) {
+  out->allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+  out->frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+  out->bytes_alloc =
+      atomic_load_explicit(&c->bytes_alloc, memory_order_relaxed);
+  out->bytes_freed =
+      atomic_load_explicit(&c->bytes_freed, memory_order_relaxed);
+  out->live = (int64_t)(out->bytes_alloc - out->bytes_freed);
+  out->peak = 0;
+}
+
+void sm_alloc_totals(sm_alloc_stats *out) {
+  if (!out)
+    return;
+  load_counters(&totals, out);
+  out->live = atomic_load_explicit(&total_live, memory_order_relaxed);
+  out->peak = atomic_load_explicit(&total_peak, memory_order_relaxed);
+}
+
+void sm_alloc_op_stats(int op, sm_alloc_stats *out) {
+  if (!out)
+    return;
+  int idx = (op >= 0 && op < SM_OP_COUNT) ? op : SM_OP_COUNT;
+  load_counters(&op_counters[idx], out);
+}
@@ -0,0 +1,83 @@
+#ifndef SM_ALLOC_H
+#define SM_ALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Allocation accounting.
+ *
+ * Every allocation made by the executor, the fs helpers, the protocol layer
+ * and cJSON (through its hooks) goes through these wrappers. Sizes are taken
+ * from malloc_usable_size() so no header is prepended and a pointer from
+ * sm_malloc() may still be released with plain free() (it is then simply
+ * missing from the freed counters).
+ *
+ * Counts are attributed to the opcode currently executing on the calling
+ * thread and, if one is set, to the thread's current job.
+ */
+typedef struct {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes_alloc;
+  uint64_t bytes_freed;
+  int64_t live; /* bytes_alloc - bytes_freed, may go negative per job */
+  uint64_t peak;
+} sm_alloc_stats;
+
+/* Install the cJSON hooks; call once before any cJSON use. */
+void sm_alloc_init(void);
+
+void *sm_malloc(size_t size);
+void *sm_calloc(size_t n, size_t size);
+void *sm_realloc(void *ptr, size_t size);
+char *sm_strdup(const char *s);
+void sm_free(void *ptr);
+
+/* Thread-local attribution. op == -1 means "outside the executor". */
+void sm_alloc_set_job(sm_alloc_stats *job);
+void sm_alloc_set_op(int op);
+
+/* Process-wide totals and per-opcode counters (op == -1 for unattributed). */
+void sm_alloc_totals(sm_alloc_stats *out);
+void sm_alloc_op_stats(int op, sm_alloc_stats *out);
+
+/* Growable text buffer, always NUL-terminated, for replies and listings */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  bool failed; /* an allocation failed; data is incomplete */
+} sm_buf;
+
+static inline void sm_buf_append(sm_buf *b, const char *s, size_t n) {
+  if (b->failed)
+    return;
+  if (b->len + n + 1 > b->cap) {
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + n + 1)
+      cap *= 2;
+    char *p = (char *)sm_realloc(b->data, cap);
+    if (!p) {
+      b->failed = true;
+      return;
+    }
+    b->data = p;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = '\0';
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SM_ALLOC_H */
@@ -0,0 +1,481 @@
+/*
+ * sm_bench.c
+ *
+ * Microbenchmarks for the executor, the recipe parser and the fs_utils
+ * primitives. Results are printed to stdout as one JSON document:
+ *
+ *   {"warmup": W, "reps": R, "results": [
+ *     {"name": "fs_hash", "param": "size=65536", "unit": "ns",
+ *      "min": ..., "p50": ..., "p90": ..., "p99": ..., "max": ..., "mean": ...,
+ *      "mb_per_s": ...}, ...]}
+ *
+ * Every case runs W untimed warmup iterations followed by R timed ones.
+ * Cases with a per-iteration byte or item count also report throughput
+ * (mb_per_s) or cost per item (ns_per_item), both derived from p50.
+ *
+ * Usage: sm_bench [--warmup N] [--reps N] [--filter SUBSTR] [--dir TMPDIR]
+ */
+#define _GNU_SOURCE
+// clang-format off
+#include <sys/socket.h>
+#include "bench_util.h"
+#include "fs_utils.h"
+#include "protocol.h"
+#include "state_machine.h"
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// clang-format on
+
+typedef struct {
+  int warmup;
+  int reps;
+  const char *filter;
+  cJSON *results;
+} bench_cfg;
+
+typedef struct {
+  const char *name;
+  char param[64];
+  void (*prepare)(void *ud); /* untimed, before every iteration */
+  void (*run)(void *ud);     /* timed */
+  void *ud;
+  uint64_t bytes; /* processed per iteration, 0 if not meaningful */
+  uint64_t items; /* instructions/entries per iteration, 0 if not meaningful */
+} bench_case;
+
+static void bench_run(bench_cfg *cfg, const bench_case *c) {
+  if (cfg->filter && !strstr(c->name, cfg->filter))
+    return;
+  for (int i = 0; i < cfg->warmup; ++i) {
+    if (c->prepare)
+      c->prepare(c->ud);
+    c->run(c->ud);
+  }
+  uint64_t *samples = sm_calloc((size_t)cfg->reps, sizeof(*samples));
+  if (!samples)
+    return;
+  for (int i = 0; i < cfg->reps; ++i) {
+    if (c->prepare)
+      c->prepare(c->ud);
+    uint64_t t0 = bench_now_ns();
+    c->run(c->ud);
+    samples[i] = bench_now_ns() - t0;
+  }
+  cJSON *obj = cJSON_CreateObject();
+  cJSON_AddStringToObject(obj, "name", c->name);
+  cJSON_AddStringToObject(obj, "param", c->param);
+  cJSON_AddStringToObject(obj, "unit", "ns");
+  bench_summary_to_json(obj, samples, (size_t)cfg->reps);
+  uint64_t p50 = bench_percentile(samples, (size_t)cfg->reps, 50);
+  if (c->bytes && p50)
+    cJSON_AddNumberToObject(obj, "mb_per_s",
+                            (double)c->bytes / 1e6 / ((double)p50 / 1e9));
+  if (c->items)
+    cJSON_AddNumberToObject(obj, "ns_per_item",
+                            (double)p50 / (double)c->items);
+  cJSON_AddItemToArray(cfg->results, obj);
+  sm_free(samples);
+  fprintf(stderr, "%-22s %-16s p50 %llu ns\n", c->name, c->param,
+          (unsigned long long)p50);
+}
+
+/* ----- Recipe generation ----- */
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+} strbuf;
+
+static void sb_appendf(strbuf *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void sb_appendf(strbuf *sb, const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if (sb->len + (size_t)n < sb->cap) {
+      sb->len += (size_t)n;
+      return;
+    }
+    size_t cap = (sb->cap + (size_t)n + 1) * 2;
+    char *tmp = sm_realloc(sb->buf, cap);
+    if (!tmp)
+      return;
+    sb->buf = tmp;
+    sb->cap = cap;
+  }
+}
+
+#define INSTR(sb, op, fmt, ...)                                                \
+  sb_appendf(sb, "%s{\"op\":\"" op "\",\"data\":{" fmt "}}",                   \
+             (sb)->len > 1 ? "," : "", __VA_ARGS__)
+
+/* Emit instruction i of an opcode class. */
+static void gen_instr(strbuf *sb, const char *cls, int i) {
+  if (strcmp(cls, "load") == 0) {
+    INSTR(sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":%d", i % 4, i % 1000);
+  } else if (strcmp(cls, "logic") == 0) {
+    switch (i % 4) {
+    case 0:
+      INSTR(sb, "SM_OP_EQ", "\"dest\":%d,\"lhs\":%d,\"rhs\":%d", 2, 0, 1);
+      break;
+    case 1:
+      INSTR(sb, "SM_OP_NOT", "\"dest\":%d,\"src\":%d", 3, 2);
+      break;
+    case 2:
+      INSTR(sb, "SM_OP_AND", "\"dest\":%d,\"lhs\":%d,\"rhs\":%d", 4, 2, 3);
+      break;
+    default:
+      INSTR(sb, "SM_OP_OR", "\"dest\":%d,\"lhs\":%d,\"rhs\":%d", 5, 4, 0);
+      break;
+    }
+  } else if (strcmp(cls, "random") == 0) {
+    INSTR(sb, "SM_OP_RANDOM_RANGE", "\"dest\":%d,\"min\":%d,\"max\":%d", 2, 0,
+          1);
+  } else if (strcmp(cls, "string") == 0) {
+    if (i % 2)
+      INSTR(sb, "SM_OP_PATH_JOIN", "\"dest\":%d,\"base\":%d,\"name\":%d", 2, 6,
+            7);
+    else
+      INSTR(sb, "SM_OP_INDEX_SELECT", "\"dest\":%d,\"list\":%d,\"index\":%d",
+            5, 3, 4);
+  } else { /* mixed */
+    static const char *mix[] = {"load", "logic", "random", "string"};
+    gen_instr(sb, mix[i % 4], i / 4);
+  }
+}
+
+/* Build a recipe of n instructions of one class. The preamble loads the
+ * constants the class reads: 0/1 numbers, 3 a list, 4 an index, 6/7 paths. */
+static char *gen_recipe(const char *cls, int n) {
+  strbuf sb = {0};
+  sb_appendf(&sb, "[");
+  INSTR(&sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":%d", 0, 3);
+  INSTR(&sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":%d", 1, 900);
+  INSTR(&sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":\"%s\"", 3,
+        "alpha\\nbeta\\ngamma");
+  INSTR(&sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":%d", 4, 1);
+  INSTR(&sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":\"%s\"", 6, "/tmp");
+  INSTR(&sb, "SM_OP_LOAD_CONST", "\"dest\":%d,\"value\":\"%s\"", 7, "name");
+  INSTR(&sb, "SM_OP_RAND_SEED", "\"seed\":%d", 7);
+  for (int i = 0; i < n; ++i)
+    gen_instr(&sb, cls, i);
+  sb_appendf(&sb, "]");
+  return sb.buf;
+}
+
+/* ----- Executor dispatch ----- */
+
+typedef struct {
+  sm_instr *chain;
+  sm_vm *vm;
+} dispatch_ud;
+
+static void run_dispatch(void *ud) {
+  dispatch_ud *d = ud;
+  sm_execute(d->chain, d->vm);
+}
+
+static void bench_dispatch(bench_cfg *cfg) {
+  static const char *classes[] = {"load", "logic", "random", "string"};
+  const int n = 1000;
+  for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+    char *json = gen_recipe(classes[i], n);
+    dispatch_ud d = {proto_parse_recipe(json), sm_vm_create()};
+    sm_free(json);
+    if (!d.chain || !d.vm) {
+      proto_free_recipe(d.chain);
+      sm_vm_destroy(d.vm);
+      continue;
+    }
+    bench_case c = {.name = "dispatch", .run = run_dispatch, .ud = &d,
+                    .items = (uint64_t)n};
+    snprintf(c.param, sizeof(c.param), "class=%s", classes[i]);
+    bench_run(cfg, &c);
+    sm_vm_destroy(d.vm);
+    proto_free_recipe(d.chain);
+  }
+}
+
+/* ----- Recipe parsing ----- */
+
+static void run_parse(void *ud) { proto_free_recipe(proto_parse_recipe(ud)); }
+
+static void bench_parse(bench_cfg *cfg) {
+  static const int sizes[] = {10, 100, 1000, 10000};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    char *json = gen_recipe("mixed", sizes[i]);
+    if (!json)
+      continue;
+    bench_case c = {.name = "proto_parse_recipe", .run = run_parse,
+                    .ud = json, .bytes = strlen(json),
+                    .items = (uint64_t)sizes[i]};
+    snprintf(c.param, sizeof(c.param), "instrs=%d", sizes[i]);
+    bench_run(cfg, &c);
+    sm_free(json);
+  }
+}
+
+/* ----- Filesystem fixtures ----- */
+
+static char g_root[PATH_MAX];
+
+static bool make_file(const char *path, size_t size) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  char buf[65536];
+  for (size_t i = 0; i < sizeof(buf); ++i)
+    buf[i] = (char)('a' + i % 26);
+  bool ok = true;
+  while (size > 0 && ok) {
+    size_t n = size < sizeof(buf) ? size : sizeof(buf);
+    ok = write(fd, buf, n) == (ssize_t)n;
+    size -= n;
+  }
+  close(fd);
+  return ok;
+}
+
+/* fanout files of file_size bytes and fanout subdirectories per level */
+static bool make_tree(const char *dir, int fanout, int depth,
+                      size_t file_size) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    return false;
+  char path[PATH_MAX];
+  for (int i = 0; i < fanout; ++i) {
+    snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    if (!make_file(path, file_size))
+      return false;
+    if (depth > 1) {
+      snprintf(path, sizeof(path), "%s/d%d", dir, i);
+      if (!make_tree(path, fanout, depth - 1, file_size))
+        return false;
+    }
+  }
+  return true;
+}
+
+static uint64_t tree_bytes(int fanout, int depth, size_t file_size) {
+  uint64_t files = 0, level = 1;
+  for (int d = 0; d < depth; ++d) {
+    files += level * (uint64_t)fanout;
+    level *= (uint64_t)fanout;
+  }
+  return files * file_size;
+}
+
+typedef struct {
+  char src[PATH_MAX];
+  char dst[PATH_MAX];
+  int depth;
+} fs_ud;
+
+static void prep_remove_dst(void *ud) {
+  fs_ud *f = ud;
+  fs_delete(f->dst);
+}
+
+static void prep_copy_victim(void *ud) {
+  fs_ud *f = ud;
+  fs_delete(f->dst);
+  copy_dir(f->src, f->dst);
+}
+
+static void run_copy_file(void *ud) {
+  fs_ud *f = ud;
+  copy_file(f->src, f->dst, 0644);
+}
+
+static void run_copy_dir(void *ud) {
+  fs_ud *f = ud;
+  copy_dir(f->src, f->dst);
+}
+
+static void run_delete(void *ud) {
+  fs_ud *f = ud;
+  fs_delete(f->dst);
+}
+
+static void run_hash(void *ud) {
+  fs_ud *f = ud;
+  sm_free(fs_hash(f->src));
+}
+
+static void run_list(void *ud) {
+  fs_ud *f = ud;
+  sm_free(fs_list_dir(f->src));
+}
+
+static void run_walk(void *ud) {
+  fs_ud *f = ud;
+  fs_rng rng;
+  fs_rng_seed(&rng, 1);
+  sm_free(fs_random_walk(f->src, f->depth, &rng));
+}
+
+static void run_exec(void *ud) { sm_free(fs_exec(ud)); }
+
+static void bench_files(bench_cfg *cfg) {
+  static const size_t sizes[] = {4096, 65536, 1 << 20, 16 << 20};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    fs_ud f = {0};
+    snprintf(f.src, sizeof(f.src), "%s/file_%zu", g_root, sizes[i]);
+    snprintf(f.dst, sizeof(f.dst), "%s/file_%zu.copy", g_root, sizes[i]);
+    if (!make_file(f.src, sizes[i]))
+      continue;
+    bench_case c = {.name = "copy_file", .run = run_copy_file, .ud = &f,
+                    .bytes = sizes[i]};
+    snprintf(c.param, sizeof(c.param), "size=%zu", sizes[i]);
+    bench_run(cfg, &c);
+    c.name = "fs_hash";
+    c.run = run_hash;
+    bench_run(cfg, &c);
+    unlink(f.src);
+    unlink(f.dst);
+  }
+}
+
+static void bench_trees(bench_cfg *cfg) {
+  static const int fanouts[] = {4, 8, 16};
+  const int depth = 3;
+  const size_t file_size = 1024;
+  for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); ++i) {
+    fs_ud f = {0};
+    snprintf(f.src, sizeof(f.src), "%s/tree_%d", g_root, fanouts[i]);
+    snprintf(f.dst, sizeof(f.dst), "%s/tree_%d.copy", g_root, fanouts[i]);
+    if (!make_tree(f.src, fanouts[i], depth, file_size))
+      continue;
+    bench_case c = {.name = "copy_dir", .prepare = prep_remove_dst,
+                    .run = run_copy_dir, .ud = &f,
+                    .bytes = tree_bytes(fanouts[i], depth, file_size)};
+    snprintf(c.param, sizeof(c.param), "fanout=%d,depth=%d", fanouts[i],
+             depth);
+    bench_run(cfg, &c);
+    c.name = "fs_delete";
+    c.prepare = prep_copy_victim;
+    c.run = run_delete;
+    bench_run(cfg, &c);
+    fs_delete(f.dst);
+    fs_delete(f.src);
+  }
+}
+
+static void bench_dirs(bench_cfg *cfg) {
+  static const int fanouts[] = {10, 100, 1000, 10000};
+  for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); ++i) {
+    fs_ud f = {.depth = 2};
+    snprintf(f.src, sizeof(f.src), "%s/dir_%d", g_root, fanouts[i]);
+    if (mkdir(f.src, 0755) != 0)
+      continue;
+    /* Each entry is a directory with two children so a depth-2 walk has
+     * somewhere to go at both levels. */
+    char path[PATH_MAX];
+    for (int j = 0; j < fanouts[i]; ++j) {
+      snprintf(path, sizeof(path), "%s/e%d", f.src, j);
+      mkdir(path, 0755);
+      for (int k = 0; k < 2; ++k) {
+        snprintf(path, sizeof(path), "%s/e%d/s%d", f.src, j, k);
+        mkdir(path, 0755);
+      }
+    }
+    bench_case c = {.name = "fs_list_dir", .run = run_list, .ud = &f,
+                    .items = (uint64_t)fanouts[i]};
+    snprintf(c.param, sizeof(c.param), "fanout=%d", fanouts[i]);
+    bench_run(cfg, &c);
+    c.name = "fs_random_walk";
+    c.run = run_walk;
+    c.items = 0;
+    snprintf(c.param, sizeof(c.param), "fanout=%d,depth=2", fanouts[i]);
+    bench_run(cfg, &c);
+    fs_delete(f.src);
+  }
+}
+
+static void bench_exec(bench_cfg *cfg) {
+  static const char *cmds[] = {"true", "echo hello", "ls /"};
+  for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i) {
+    bench_case c = {.name = "fs_exec", .run = run_exec, .ud = (void *)cmds[i]};
+    snprintf(c.param, sizeof(c.param), "cmd=%s", cmds[i]);
+    bench_run(cfg, &c);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--warmup N] [--reps N] [--filter SUBSTR] [--dir DIR]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  sm_alloc_init();
+  bench_cfg cfg = {.warmup = 3, .reps = 30};
+  const char *base = "/tmp";
+  static const struct option opts[] = {
+      {"warmup", required_argument, NULL, 'w'},
+      {"reps", required_argument, NULL, 'r'},
+      {"filter", required_argument, NULL, 'f'},
+      {"dir", required_argument, NULL, 'd'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "w:r:f:d:h", opts, NULL)) != -1) {
+    switch (c) {
+    case 'w':
+      cfg.warmup = atoi(optarg);
+      break;
+    case 'r':
+      cfg.reps = atoi(optarg);
+      break;
+    case 'f':
+      cfg.filter = optarg;
+      break;
+    case 'd':
+      base = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (cfg.warmup < 0 || cfg.reps <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  snprintf(g_root, sizeof(g_root), "%s/sm_bench.XXXXXX", base);
+  if (!mkdtemp(g_root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  cfg.results = cJSON_CreateArray();
+  bench_dispatch(&cfg);
+  bench_parse(&cfg);
+  bench_files(&cfg);
+  bench_trees(&cfg);
+  bench_dirs(&cfg);
+  bench_exec(&cfg);
+  fs_delete(g_root);
+
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "warmup", cfg.warmup);
+  cJSON_AddNumberToObject(root, "reps", cfg.reps);
+  cJSON_AddItemToObject(root, "results", cfg.results);
+  char *out = cJSON_Print(root);
+  if (out) {
+    printf("%s\n", out);
+    sm_free(out);
+  }
+  cJSON_Delete(root);
+  return 0;
+}
@@ -1,11 +1,42 @@
+/*
+ * sm_test.c
+ *
+ * Recipe replay runner. Without arguments it runs sample_recipe.json once
+ * and prints its reports, as it always has. Given recipe files or
+ * directories of *.json recipes it replays each one --repeat times across
+ * --concurrency executor workers and prints per-recipe p50/p99 executor
+ * time:
+ *
+ *   sm_test --repeat 50 --concurrency 4 --vm shared corpus/
+ *   sm_test --repeat 50 --write-baseline base.json corpus/
+ *   sm_test --repeat 50 --baseline base.json corpus/
+ *
+ * --vm fresh (the default) clears the registers before every run; --vm
+ * shared keeps each worker's registers across runs, as taskd does between
+ * connections. With --baseline a recipe fails when its return value changed
+ * or its p50 grew by more than --threshold percent and --slack-us
+ * microseconds over the stored figure; the exit status is then 1.
+ *
+ * Every worker has its own VM and random state, so seeded recipes return
+ * the same values at any concurrency. The filesystem is shared, though:
+ * recipes that touch files (corpus/tree_ops.json, write_read_hash.json)
+ * race each other on their fixed paths and can show up as unstable or fail
+ * a baseline. Give them paths unique to each worker or replay them with
+ * --concurrency 1.
+ */
 #define _GNU_SOURCE
 // clang-format off
 #include <sys/socket.h>
+#include "bench_util.h"
 #include "fs_utils.h"
 #include "protocol.h"
 #include "state_machine.h"
+#include <dirent.h>
+#include <getopt.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 // clang-format on
 
 static void report_cb(const char *json, void *ud) {
@@ -14,7 +45,7 @@ static void report_cb(const char *json, void *ud) {
     printf("%s\n", json);
 }
 
-int main(void) {
+static int run_sample(void) {
   char *json = fs_read("sample_recipe.json");
   if (!json) {
     perror("read recipe");
@@ -22,7 +53,7 @@ int main(void) {
   }
 
   sm_instr *recipe = proto_parse_recipe(json);
-  free(json);
+  sm_free(json);
   if (!recipe) {
     fprintf(stderr, "failed to parse recipe\n");
     return 1;
@@ -42,8 +73,342 @@ int main(void) {
   }
   int ret = 0;
   sm_wait(ctx, &ret);
+  sm_job_stats st;
+  sm_get_job_stats(ctx, &st);
   sm_thread_stop(ctx);
 
   printf("return %d\n", ret);
+  printf("job %llu us, %llu allocs (%llu bytes), %llu frees, peak %llu live "
+         "%lld bytes\n",
+         (unsigned long long)(st.duration_ns / 1000),
+         (unsigned long long)st.alloc.allocs,
+         (unsigned long long)st.alloc.bytes_alloc,
+         (unsigned long long)st.alloc.frees,
+         (unsigned long long)st.alloc.peak, (long long)st.alloc.live);
   return 0;
 }
+
+/* ----- Replay mode ----- */
+
+typedef struct {
+  char *name;
+  sm_instr *chain; /* parsed once, replayed read-only by every worker */
+  uint64_t *samples; /* executor time per run, indexed by repetition */
+  int *results;      /* return value per run */
+  _Atomic int errors; /* runs whose executor reported an sm_error */
+} replay_recipe;
+
+typedef struct {
+  replay_recipe *recipes;
+  size_t count;
+  int repeat;
+  bool fresh;
+  bool verbose;
+  _Atomic size_t next_task;
+} replay_cfg;
+
+static bool has_json_suffix(const char *name) {
+  size_t n = strlen(name);
+  return n > 5 && strcmp(name + n - 5, ".json") == 0;
+}
+
+static bool add_recipe(replay_cfg *cfg, const char *path) {
+  char *json = fs_read(path);
+  if (!json) {
+    perror(path);
+    return false;
+  }
+  sm_instr *chain = proto_parse_recipe(json);
+  sm_free(json);
+  if (!chain) {
+    fprintf(stderr, "%s: failed to parse recipe\n", path);
+    return false;
+  }
+  replay_recipe *r =
+      sm_realloc(cfg->recipes, (cfg->count + 1) * sizeof(*cfg->recipes));
+  if (!r) {
+    proto_free_recipe(chain);
+    return false;
+  }
+  cfg->recipes = r;
+  r = &cfg->recipes[cfg->count++];
+  memset(r, 0, sizeof(*r));
+  const char *slash = strrchr(path, '/');
+  r->name = sm_strdup(slash ? slash + 1 : path);
+  r->chain = chain;
+  return r->name != NULL;
+}
+
+static int json_filter(const struct dirent *d) {
+  return d->d_name[0] != '.' && has_json_suffix(d->d_name);
+}
+
+/* Load a single recipe file or every *.json file of a directory, sorted by
+ * name so that output order is stable between runs. */
+static bool add_path(replay_cfg *cfg, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode))
+    return add_recipe(cfg, path);
+  struct dirent **list;
+  int n = scandir(path, &list, json_filter, alphasort);
+  if (n < 0) {
+    perror(path);
+    return false;
+  }
+  bool ok = true;
+  for (int i = 0; i < n; ++i) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s/%s", path, list[i]->d_name);
+    if (ok && !add_recipe(cfg, full))
+      ok = false;
+    free(list[i]);
+  }
+  free(list);
+  return ok;
+}
+
+/* Tasks are handed out round-robin over recipes so concurrent workers mix
+ * recipes the way production traffic would. */
+static void *replay_worker(void *arg) {
+  replay_cfg *cfg = arg;
+  sm_ctx *ctx = sm_thread_start();
+  if (!ctx) {
+    fprintf(stderr, "failed to start state machine thread\n");
+    return NULL;
+  }
+  if (cfg->verbose)
+    sm_set_report_cb(ctx, report_cb, NULL);
+  size_t total = cfg->count * (size_t)cfg->repeat;
+  for (;;) {
+    size_t t = atomic_fetch_add(&cfg->next_task, 1);
+    if (t >= total)
+      break;
+    replay_recipe *r = &cfg->recipes[t % cfg->count];
+    if (cfg->fresh)
+      sm_reset(ctx);
+    int ret = 0;
+    sm_job_stats st = {0};
+    if (!sm_submit(ctx, r->chain)) {
+      atomic_fetch_add(&r->errors, 1);
+      continue;
+    }
+    sm_wait(ctx, &ret);
+    sm_get_job_stats(ctx, &st);
+    r->samples[t / cfg->count] = st.duration_ns;
+    r->results[t / cfg->count] = ret;
+    if (st.err != SM_ERR_NONE)
+      atomic_fetch_add(&r->errors, 1);
+  }
+  sm_thread_stop(ctx);
+  return NULL;
+}
+
+static cJSON *find_baseline(const cJSON *base, const char *name) {
+  const cJSON *recipes = cJSON_GetObjectItemCaseSensitive(base, "recipes");
+  const cJSON *r;
+  cJSON_ArrayForEach(r, recipes) {
+    const cJSON *n = cJSON_GetObjectItemCaseSensitive(r, "name");
+    if (cJSON_IsString(n) && strcmp(n->valuestring, name) == 0)
+      return (cJSON *)r;
+  }
+  return NULL;
+}
+
+static double json_number(const cJSON *obj, const char *key) {
+  const cJSON *v = cJSON_GetObjectItemCaseSensitive(obj, key);
+  return cJSON_IsNumber(v) ? v->valuedouble : 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--repeat N] [--concurrency N] [--vm fresh|shared]\n"
+          "          [--baseline FILE] [--write-baseline FILE]\n"
+          "          [--threshold PCT] [--slack-us N] [--verbose]\n"
+          "          RECIPE|DIR...\n"
+          "       %s            run sample_recipe.json once\n",
+          prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+  sm_alloc_init();
+  if (argc == 1)
+    return run_sample();
+
+  replay_cfg cfg = {.repeat = 10, .fresh = true};
+  int concurrency = 1;
+  double threshold = 10.0, slack_us = 20.0;
+  const char *baseline_path = NULL, *write_path = NULL;
+  static const struct option opts[] = {
+      {"repeat", required_argument, NULL, 'n'},
+      {"concurrency", required_argument, NULL, 'j'},
+      {"vm", required_argument, NULL, 'm'},
+      {"baseline", required_argument, NULL, 'b'},
+      {"write-baseline", required_argument, NULL, 'w'},
+      {"threshold", required_argument, NULL, 't'},
+      {"slack-us", required_argument, NULL, 's'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "n:j:m:b:w:t:s:vh", opts, NULL)) != -1) {
+    switch (c) {
+    case 'n':
+      cfg.repeat = atoi(optarg);
+      break;
+    case 'j':
+      concurrency = atoi(optarg);
+      break;
+    case 'm':
+      if (strcmp(optarg, "fresh") != 0 && strcmp(optarg, "shared") != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      cfg.fresh = strcmp(optarg, "fresh") == 0;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 'w':
+      write_path = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    case 's':
+      slack_us = atof(optarg);
+      break;
+    case 'v':
+      cfg.verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (cfg.repeat <= 0 || concurrency <= 0 || optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (int i = optind; i < argc; ++i)
+    if (!add_path(&cfg, argv[i]))
+      return 1;
+  if (cfg.count == 0) {
+    fprintf(stderr, "no recipes found\n");
+    return 1;
+  }
+  for (size_t i = 0; i < cfg.count; ++i) {
+    cfg.recipes[i].samples = sm_calloc(cfg.repeat, sizeof(uint64_t));
+    cfg.recipes[i].results = sm_calloc(cfg.repeat, sizeof(int));
+    if (!cfg.recipes[i].samples || !cfg.recipes[i].results) {
+      perror("calloc");
+      return 1;
+    }
+  }
+
+  cJSON *baseline = NULL;
+  if (baseline_path) {
+    char *json = fs_read(baseline_path);
+    baseline = json ? cJSON_Parse(json) : NULL;
+    sm_free(json);
+    if (!baseline) {
+      fprintf(stderr, "%s: cannot load baseline\n", baseline_path);
+      return 1;
+    }
+  }
+
+  pthread_t *threads = sm_calloc(concurrency, sizeof(*threads));
+  if (!threads)
+    return 1;
+  int started = 0;
+  for (; started < concurrency; ++started)
+    if (pthread_create(&threads[started], NULL, replay_worker, &cfg) != 0)
+      break;
+  if (started == 0) {
+    fprintf(stderr, "failed to start replay workers\n");
+    return 1;
+  }
+  for (int i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+  sm_free(threads);
+
+  cJSON *out = cJSON_CreateObject();
+  cJSON_AddNumberToObject(out, "repeat", cfg.repeat);
+  cJSON_AddNumberToObject(out, "concurrency", started);
+  cJSON_AddStringToObject(out, "vm", cfg.fresh ? "fresh" : "shared");
+  cJSON *arr = cJSON_AddArrayToObject(out, "recipes");
+
+  int failed = 0;
+  printf("%-32s %6s %10s %10s %7s %7s  %s\n", "recipe", "runs", "p50_us",
+         "p99_us", "result", "errors", baseline ? "baseline" : "");
+  for (size_t i = 0; i < cfg.count; ++i) {
+    replay_recipe *r = &cfg.recipes[i];
+    qsort(r->samples, cfg.repeat, sizeof(uint64_t), bench_cmp_u64);
+    double p50 = bench_percentile(r->samples, cfg.repeat, 50) / 1000.0;
+    double p99 = bench_percentile(r->samples, cfg.repeat, 99) / 1000.0;
+    double sum = 0;
+    int result = r->results[0], unstable = 0, errors = r->errors;
+    for (int k = 0; k < cfg.repeat; ++k) {
+      sum += (double)r->samples[k];
+      unstable += r->results[k] != result;
+    }
+
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", r->name);
+    cJSON_AddNumberToObject(item, "runs", cfg.repeat);
+    cJSON_AddNumberToObject(item, "p50_us", p50);
+    cJSON_AddNumberToObject(item, "p99_us", p99);
+    cJSON_AddNumberToObject(item, "mean_us", sum / cfg.repeat / 1000.0);
+    cJSON_AddNumberToObject(item, "result", result);
+    cJSON_AddNumberToObject(item, "errors", errors);
+    cJSON_AddNumberToObject(item, "unstable", unstable);
+    cJSON_AddItemToArray(arr, item);
+
+    char verdict[64] = "";
+    if (baseline) {
+      const cJSON *b = find_baseline(baseline, r->name);
+      if (!b) {
+        snprintf(verdict, sizeof(verdict), "new");
+      } else {
+        double bp50 = json_number(b, "p50_us");
+        int bres = (int)json_number(b, "result");
+        double pct = bp50 > 0 ? (p50 - bp50) * 100.0 / bp50 : 0;
+        if (bres != result) {
+          snprintf(verdict, sizeof(verdict), "FAIL result was %d", bres);
+          failed++;
+        } else if (pct > threshold && p50 - bp50 > slack_us) {
+          snprintf(verdict, sizeof(verdict), "FAIL %+.1f%%", pct);
+          failed++;
+        } else {
+          snprintf(verdict, sizeof(verdict), "%+.1f%%", pct);
+        }
+      }
+    }
+    printf("%-32s %6d %10.1f %10.1f %7d %7d  %s%s\n", r->name, cfg.repeat, p50,
+           p99, result, errors, verdict, unstable ? " (unstable result)" : "");
+  }
+
+  if (write_path) {
+    char *s = cJSON_Print(out);
+    if (!s || !fs_write(write_path, s, "w")) {
+      fprintf(stderr, "%s: cannot write baseline\n", write_path);
+      failed++;
+    }
+    sm_free(s);
+  }
+  cJSON_Delete(out);
+  cJSON_Delete(baseline);
+  for (size_t i = 0; i < cfg.count; ++i) {
+    proto_free_recipe(cfg.recipes[i].chain);
+    sm_free(cfg.recipes[i].samples);
+    sm_free(cfg.recipes[i].results);
+    sm_free(cfg.recipes[i].name);
+  }
+  sm_free(cfg.recipes);
+  return failed ? 1 : 0;
+}
@@ -1,16 +1,25 @@
 #define _GNU_SOURCE
 #include "state_machine.h"
 #include "fs_utils.h"
+#include "kv_store.h"
+#include "net_inspect.h"
+#include "proc_utils.h"
+#include "supervisor.h"
 #include <cJSON.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /* Generic VM context with a fixed-width register array */
 typedef struct sm_vm {
   sm_reg regs[SM_REG_COUNT];
+  bool owned[SM_REG_COUNT]; /* regs[i] is a heap string freed on overwrite */
   unsigned int seed;
 } sm_vm;
 
@@ -30,20 +39,64 @@ typedef struct sm_ctx {
   pthread_cond_t cond;
   pthread_cond_t done_cond;
   bool job_done;
+  bool job_returned;
   int job_value;
   sm_report_cb report_cb;
   void *report_ud;
   pthread_t thread;
   bool running;
+  sm_job_stats last_stats;
+  unsigned int seed; /* from sm_reseed(), restored by sm_reset() */
 } sm_ctx;
 
 /* Helper to validate register indices */
 static inline bool reg_valid(int idx) { return idx >= 0 && idx < SM_REG_COUNT; }
 
+/* Store into a register, releasing the string it held. Every heap value in
+ * a register is a fresh allocation, so no two registers share one. */
+static inline void reg_store(sm_vm *vm, int idx, sm_reg v, bool owned) {
+  if (vm->owned[idx])
+    sm_free(vm->regs[idx]);
+  vm->regs[idx] = v;
+  vm->owned[idx] = owned;
+}
+
+/* The string a register holds, or NULL if it holds an integer */
+static inline const char *reg_str(const sm_vm *vm, int idx) {
+  return vm->owned[idx] ? (const char *)vm->regs[idx] : NULL;
+}
+
+static void vm_clear(sm_vm *vm) {
+  for (int i = 0; i < SM_REG_COUNT; ++i)
+    if (vm->owned[i])
+      sm_free(vm->regs[i]);
+  memset(vm, 0, sizeof(*vm));
+}
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 static inline unsigned int next_seed(unsigned int s) {
   return s * 1664525u + 1013904223u;
 }
 
+/* "cpu_usec\tmemory_peak" for a usage register, "-" for what the kernel
+ * does not report; NULL when the command had no cgroup. */
+static char *usage_string(const cg_usage *u) {
+  if (u->cpu_usec < 0)
+    return NULL;
+  char buf[48];
+  if (u->memory_peak >= 0)
+    snprintf(buf, sizeof(buf), "%lld\t%lld", (long long)u->cpu_usec,
+             (long long)u->memory_peak);
+  else
+    snprintf(buf, sizeof(buf), "%lld\t-", (long long)u->cpu_usec);
+  return sm_strdup(buf);
+}
+
 #define CHECK_REG(c)                                                           \
   do {                                                                         \
     if (!(c)) {                                                                \
@@ -59,75 +112,80 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
   int err = SM_ERR_NONE;
   sm_instr *cur = head;
   while (cur) {
+    sm_alloc_set_op(cur->op);
     switch (cur->op) {
     case SM_OP_LOAD_CONST: {
       sm_load_const *a = (sm_load_const *)cur->data;
       CHECK_REG(a && reg_valid(a->dest));
-      vm->regs[a->dest] = (void *)a->value;
+      /* Strings are copied so the recipe can be freed after the job */
+      if (a->is_string)
+        reg_store(vm, a->dest, sm_strdup(a->value), true);
+      else
+        reg_store(vm, a->dest, (void *)a->value, false);
       break;
     }
     case SM_OP_FS_CREATE: {
       sm_fs_create *a = (sm_fs_create *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path) &&
                 reg_valid(a->type));
-      const char *p = (const char *)vm->regs[a->path];
-      const char *t = (const char *)vm->regs[a->type];
+      const char *p = reg_str(vm, a->path);
+      const char *t = reg_str(vm, a->type);
       bool ok = (p && t) ? fs_create(p, t) : false;
-      vm->regs[a->dest] = (void *)(uintptr_t)ok;
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
       break;
     }
     case SM_OP_FS_DELETE: {
       sm_fs_delete *a = (sm_fs_delete *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path));
-      const char *p = (const char *)vm->regs[a->path];
+      const char *p = reg_str(vm, a->path);
       bool ok = p ? fs_delete(p) : false;
-      vm->regs[a->dest] = (void *)(uintptr_t)ok;
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
       break;
     }
     case SM_OP_FS_COPY: {
       sm_fs_copy *a = (sm_fs_copy *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->src) &&
                 reg_valid(a->dst));
-      const char *s = (const char *)vm->regs[a->src];
-      const char *d = (const char *)vm->regs[a->dst];
+      const char *s = reg_str(vm, a->src);
+      const char *d = reg_str(vm, a->dst);
       bool ok = (s && d) ? fs_copy(s, d) : false;
-      vm->regs[a->dest] = (void *)(uintptr_t)ok;
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
       break;
     }
     case SM_OP_FS_MOVE: {
       sm_fs_move *a = (sm_fs_move *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->src) &&
                 reg_valid(a->dst));
-      const char *s = (const char *)vm->regs[a->src];
-      const char *d = (const char *)vm->regs[a->dst];
+      const char *s = reg_str(vm, a->src);
+      const char *d = reg_str(vm, a->dst);
       bool ok = (s && d) ? fs_move(s, d) : false;
-      vm->regs[a->dest] = (void *)(uintptr_t)ok;
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
       break;
     }
     case SM_OP_FS_WRITE: {
       sm_fs_write *a = (sm_fs_write *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path) &&
                 reg_valid(a->content) && reg_valid(a->mode));
-      const char *p = (const char *)vm->regs[a->path];
-      const char *c = (const char *)vm->regs[a->content];
-      const char *m = (const char *)vm->regs[a->mode];
+      const char *p = reg_str(vm, a->path);
+      const char *c = reg_str(vm, a->content);
+      const char *m = reg_str(vm, a->mode);
       bool ok = (p && c && m) ? fs_write(p, c, m) : false;
-      vm->regs[a->dest] = (void *)(uintptr_t)ok;
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
       break;
     }
     case SM_OP_FS_READ: {
       sm_fs_read *a = (sm_fs_read *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path));
-      const char *p = (const char *)vm->regs[a->path];
+      const char *p = reg_str(vm, a->path);
       char *buf = p ? fs_read(p) : NULL;
-      vm->regs[a->dest] = buf;
+      reg_store(vm, a->dest, buf, true);
       break;
     }
     case SM_OP_FS_UNPACK: {
       sm_fs_unpack *a = (sm_fs_unpack *)cur->data;
       CHECK_REG(a && reg_valid(a->tar_path) && reg_valid(a->dest));
-      const char *t = (const char *)vm->regs[a->tar_path];
-      const char *d = (const char *)vm->regs[a->dest];
+      const char *t = reg_str(vm, a->tar_path);
+      const char *d = reg_str(vm, a->dest);
       if (t && d)
         fs_unpack(t, d);
       break;
@@ -135,25 +193,31 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
     case SM_OP_FS_HASH: {
       sm_fs_hash *a = (sm_fs_hash *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path));
-      const char *p = (const char *)vm->regs[a->path];
+      const char *p = reg_str(vm, a->path);
       char *h = p ? fs_hash(p) : NULL;
-      vm->regs[a->dest] = h;
+      reg_store(vm, a->dest, h, true);
       break;
     }
     case SM_OP_FS_LIST: {
       sm_fs_list *a = (sm_fs_list *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path));
-      const char *p = (const char *)vm->regs[a->path];
+      const char *p = reg_str(vm, a->path);
       char *list = p ? fs_list_dir(p) : NULL;
-      vm->regs[a->dest] = list;
+      reg_store(vm, a->dest, list, true);
       break;
     }
     case SM_OP_SHELL: {
       sm_shell *a = (sm_shell *)cur->data;
-      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->cmd));
-      const char *c = (const char *)vm->regs[a->cmd];
-      char *out = c ? fs_exec(c) : NULL;
-      vm->regs[a->dest] = out;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->cmd) &&
+                (a->usage < 0 || reg_valid(a->usage)));
+      const char *c = reg_str(vm, a->cmd);
+      cg_usage usage = {-1, -1};
+      char *out = NULL;
+      if (c)
+        out = cg_enabled() ? sup_run(c, &a->limits, &usage) : fs_exec(c);
+      reg_store(vm, a->dest, out, true);
+      if (a->usage >= 0)
+        reg_store(vm, a->usage, usage_string(&usage), true);
       break;
     }
     case SM_OP_EQ: {
@@ -163,14 +227,14 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
       uintptr_t l = (uintptr_t)vm->regs[a->lhs];
       uintptr_t r = (uintptr_t)vm->regs[a->rhs];
       bool eq = l == r;
-      vm->regs[a->dest] = (void *)(uintptr_t)eq;
+      reg_store(vm, a->dest, (void *)(uintptr_t)eq, false);
       break;
     }
     case SM_OP_NOT: {
       sm_not *a = (sm_not *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->src));
       bool v = (uintptr_t)vm->regs[a->src] != 0;
-      vm->regs[a->dest] = (void *)(uintptr_t)(!v);
+      reg_store(vm, a->dest, (void *)(uintptr_t)(!v), false);
       break;
     }
     case SM_OP_AND: {
@@ -179,7 +243,7 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
                 reg_valid(a->rhs));
       bool l = (uintptr_t)vm->regs[a->lhs] != 0;
       bool r = (uintptr_t)vm->regs[a->rhs] != 0;
-      vm->regs[a->dest] = (void *)(uintptr_t)(l && r);
+      reg_store(vm, a->dest, (void *)(uintptr_t)(l && r), false);
       break;
     }
     case SM_OP_OR: {
@@ -188,20 +252,20 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
                 reg_valid(a->rhs));
       bool l = (uintptr_t)vm->regs[a->lhs] != 0;
       bool r = (uintptr_t)vm->regs[a->rhs] != 0;
-      vm->regs[a->dest] = (void *)(uintptr_t)(l || r);
+      reg_store(vm, a->dest, (void *)(uintptr_t)(l || r), false);
       break;
     }
     case SM_OP_INDEX_SELECT: {
       sm_index_select *a = (sm_index_select *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->list) &&
                 reg_valid(a->index));
-      const char *list = (const char *)vm->regs[a->list];
+      const char *list = reg_str(vm, a->list);
       size_t idx = (size_t)(uintptr_t)vm->regs[a->index];
       char *out = NULL;
       if (list) {
         out = list_index(list, idx);
       }
-      vm->regs[a->dest] = out;
+      reg_store(vm, a->dest, out, true);
       break;
     }
     case SM_OP_RANDOM_RANGE: {
@@ -210,9 +274,10 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
                 reg_valid(a->max));
       long min = (long)(uintptr_t)vm->regs[a->min];
       long max = (long)(uintptr_t)vm->regs[a->max];
-      seed_apply(vm->seed);
-      long val = rand_range(min, max);
-      vm->regs[a->dest] = (void *)(uintptr_t)val;
+      fs_rng rng;
+      fs_rng_seed(&rng, vm->seed);
+      long val = rand_range(&rng, min, max);
+      reg_store(vm, a->dest, (void *)(uintptr_t)val, false);
       vm->seed = next_seed(vm->seed);
       break;
     }
@@ -220,21 +285,22 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
       sm_path_join *a = (sm_path_join *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->base) &&
                 reg_valid(a->name));
-      const char *base = (const char *)vm->regs[a->base];
-      const char *name = (const char *)vm->regs[a->name];
+      const char *base = reg_str(vm, a->base);
+      const char *name = reg_str(vm, a->name);
       char *out = (base && name) ? path_join(base, name) : NULL;
-      vm->regs[a->dest] = out;
+      reg_store(vm, a->dest, out, true);
       break;
     }
     case SM_OP_RANDOM_WALK: {
       sm_random_walk *a = (sm_random_walk *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->root) &&
                 reg_valid(a->depth));
-      const char *root = (const char *)vm->regs[a->root];
+      const char *root = reg_str(vm, a->root);
       int depth = (int)(uintptr_t)vm->regs[a->depth];
-      seed_apply(vm->seed);
-      char *out = root ? fs_random_walk(root, depth) : NULL;
-      vm->regs[a->dest] = out;
+      fs_rng rng;
+      fs_rng_seed(&rng, vm->seed);
+      char *out = root ? fs_random_walk(root, depth, &rng) : NULL;
+      reg_store(vm, a->dest, out, true);
       vm->seed = next_seed(vm->seed);
       break;
     }
@@ -242,17 +308,16 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
       sm_dir_contains *a = (sm_dir_contains *)cur->data;
       CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->dir_a) &&
                 reg_valid(a->dir_b));
-      const char *ap = (const char *)vm->regs[a->dir_a];
-      const char *bp = (const char *)vm->regs[a->dir_b];
+      const char *ap = reg_str(vm, a->dir_a);
+      const char *bp = reg_str(vm, a->dir_b);
       bool ok = (ap && bp) ? fs_dir_contains(ap, bp) : false;
-      vm->regs[a->dest] = (void *)(uintptr_t)ok;
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
       break;
     }
     case SM_OP_RAND_SEED: {
       sm_rand_seed *a = (sm_rand_seed *)cur->data;
       CHECK_REG(a);
       vm->seed = a->seed;
-      seed_apply(vm->seed);
       break;
     }
     case SM_OP_REPORT: {
@@ -264,19 +329,19 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
         for (int i = 0; i < a->count; ++i) {
           if (!reg_valid(a->regs[i]))
             continue;
-          uintptr_t v = (uintptr_t)vm->regs[a->regs[i]];
-          cJSON *item = NULL;
-          if (v < 4096)
-            item = cJSON_CreateNumber((double)v);
-          else
-            item = cJSON_CreateString(v ? (const char *)v : "");
+          /* Owned registers hold strings, everything else an integer;
+           * a failed string result (NULL) reports as 0 */
+          const char *str = reg_str(vm, a->regs[i]);
+          intptr_t v = (intptr_t)vm->regs[a->regs[i]];
+          cJSON *item = str ? cJSON_CreateString(str)
+                            : cJSON_CreateNumber((double)v);
           cJSON_AddItemToArray(arr, item);
         }
         cJSON_AddItemToObject(root, "values", arr);
         char *out = cJSON_PrintUnformatted(root);
         if (out) {
           current_ctx->report_cb(out, current_ctx->report_ud);
-          free(out);
+          cJSON_free(out);
         }
         cJSON_Delete(root);
       }
@@ -288,13 +353,211 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
       if (current_ctx) {
         pthread_mutex_lock(&current_ctx->lock);
         current_ctx->job_value = val;
-        current_ctx->job_done = true;
-        pthread_cond_signal(&current_ctx->done_cond);
+        current_ctx->job_returned = true;
         pthread_mutex_unlock(&current_ctx->lock);
       }
       cur = NULL;
       continue;
     }
+    case SM_OP_KV_SET: {
+      sm_kv_set *a = (sm_kv_set *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->key) &&
+                reg_valid(a->value));
+      const char *key = reg_str(vm, a->key);
+      sm_reg v = vm->regs[a->value];
+      /* Only owned registers hold strings; anything else is an integer */
+      kv_type type = vm->owned[a->value] && v ? KV_STRING : KV_INT;
+      bool ok = key && kv_set(key, type, v, a->ttl_ms);
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
+      break;
+    }
+    case SM_OP_KV_GET: {
+      sm_kv_get *a = (sm_kv_get *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->key));
+      const char *key = reg_str(vm, a->key);
+      void *v = NULL;
+      kv_type type = key ? kv_get(key, &v) : KV_NONE;
+      reg_store(vm, a->dest, v, type == KV_STRING);
+      break;
+    }
+    case SM_OP_KV_DEL: {
+      sm_kv_del *a = (sm_kv_del *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->key));
+      const char *key = reg_str(vm, a->key);
+      bool ok = key && kv_delete(key);
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
+      break;
+    }
+    case SM_OP_PROC_LIST: {
+      sm_proc_list *a = (sm_proc_list *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) &&
+                (a->name < 0 || reg_valid(a->name)) &&
+                (a->uid < 0 || reg_valid(a->uid)) &&
+                (a->cmdline < 0 || reg_valid(a->cmdline)));
+      proc_filter flt = {0};
+      if (a->name >= 0)
+        flt.name = reg_str(vm, a->name);
+      if (a->cmdline >= 0)
+        flt.cmdline = reg_str(vm, a->cmdline);
+      flt.by_uid = a->uid >= 0;
+      if (flt.by_uid)
+        flt.uid = (uid_t)(uintptr_t)vm->regs[a->uid];
+      /* A filter register without a string matches nothing */
+      bool bad = (a->name >= 0 && !flt.name) ||
+                 (a->cmdline >= 0 && !flt.cmdline);
+      char *list = bad ? sm_strdup("") : proc_list(&flt, a->fields, a->nfields);
+      reg_store(vm, a->dest, list, true);
+      break;
+    }
+    case SM_OP_NET_LISTEN: {
+      sm_net_listen *a = (sm_net_listen *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && (a->port < 0 || reg_valid(a->port)) &&
+                (a->count < 0 || reg_valid(a->count)));
+      net_filter flt = {.protos = a->protos, .port = -1, .pids = a->pids};
+      if (a->port >= 0)
+        flt.port = (long)(uintptr_t)vm->regs[a->port];
+      size_t n = 0;
+      char *list = net_list_listeners(&flt, &n);
+      reg_store(vm, a->dest, list, true);
+      if (a->count >= 0)
+        reg_store(vm, a->count, (void *)(uintptr_t)n, false);
+      break;
+    }
+    case SM_OP_PROC_SPAWN: {
+      sm_proc_spawn *a = (sm_proc_spawn *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->cmd));
+      const char *c = reg_str(vm, a->cmd);
+      uint32_t id = c ? sup_spawn(c, &a->limits) : 0;
+      reg_store(vm, a->dest, (void *)(uintptr_t)id, false);
+      break;
+    }
+    case SM_OP_PROC_STATUS: {
+      sm_proc_status *a = (sm_proc_status *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->handle) &&
+                (a->running < 0 || reg_valid(a->running)) &&
+                (a->usage < 0 || reg_valid(a->usage)));
+      /* Handles are integers; a string register names no child */
+      uint32_t id =
+          vm->owned[a->handle] ? 0 : (uint32_t)(uintptr_t)vm->regs[a->handle];
+      sup_status st;
+      char *out = NULL;
+      bool running = false;
+      st.usage.cpu_usec = st.usage.memory_peak = -1;
+      if (sup_get_status(id, &st)) {
+        char buf[96];
+        const char *state =
+            st.running ? "running" : st.signaled ? "signaled" : "exited";
+        snprintf(buf, sizeof(buf), "%s\t%d\t%d\t%llu", state, (int)st.pid,
+                 st.running ? 0 : st.code, (unsigned long long)st.runtime_ms);
+        out = sm_strdup(buf);
+        running = st.running;
+      }
+      reg_store(vm, a->dest, out, true);
+      if (a->running >= 0)
+        reg_store(vm, a->running, (void *)(uintptr_t)running, false);
+      if (a->usage >= 0)
+        reg_store(vm, a->usage, usage_string(&st.usage), true);
+      break;
+    }
+    case SM_OP_PROC_SIGNAL: {
+      sm_proc_signal *a = (sm_proc_signal *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->handle));
+      uint32_t id =
+          vm->owned[a->handle] ? 0 : (uint32_t)(uintptr_t)vm->regs[a->handle];
+      bool ok = sup_signal(id, a->signal);
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
+      break;
+    }
+    case SM_OP_PROC_READ: {
+      sm_proc_read *a = (sm_proc_read *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->handle));
+      uint32_t id =
+          vm->owned[a->handle] ? 0 : (uint32_t)(uintptr_t)vm->regs[a->handle];
+      char *out = sup_read(id, (sup_stream)a->stream);
+      reg_store(vm, a->dest, out, true);
+      break;
+    }
+    case SM_OP_FS_GENTREE: {
+      sm_fs_gentree *a = (sm_fs_gentree *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->root));
+      const char *root = reg_str(vm, a->root);
+      char *out = root ? gentree_build(root, &a->spec) : NULL;
+      reg_store(vm, a->dest, out, true);
+      break;
+    }
+    case SM_OP_FS_ALLOCATE: {
+      sm_fs_allocate *a = (sm_fs_allocate *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path));
+      const char *p = reg_str(vm, a->path);
+      uint32_t id = p ? fill_allocate(p, a->size, a->allocate) : 0;
+      reg_store(vm, a->dest, (void *)(uintptr_t)id, false);
+      break;
+    }
+    case SM_OP_FS_EXHAUST: {
+      sm_fs_exhaust *a = (sm_fs_exhaust *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->path));
+      const char *p = reg_str(vm, a->path);
+      uint32_t id = p ? fill_exhaust(p, a->resource, a->target, a->threads) : 0;
+      reg_store(vm, a->dest, (void *)(uintptr_t)id, false);
+      break;
+    }
+    case SM_OP_FS_RELEASE: {
+      sm_fs_release *a = (sm_fs_release *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->handle));
+      uint32_t id =
+          vm->owned[a->handle] ? 0 : (uint32_t)(uintptr_t)vm->regs[a->handle];
+      bool ok = fill_release(id);
+      reg_store(vm, a->dest, (void *)(uintptr_t)ok, false);
+      break;
+    }
+    case SM_OP_USERS_ADD: {
+      sm_users_add *a = (sm_users_add *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest));
+      reg_store(vm, a->dest, acct_provision(&a->batch), true);
+      break;
+    }
+    case SM_OP_FS_META: {
+      sm_fs_meta *a = (sm_fs_meta *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->root));
+      const char *root = reg_str(vm, a->root);
+      /* Names are resolved per run: the recipe may have just added them */
+      fsmeta_spec spec = a->spec;
+      char user[sizeof(a->owner)];
+      strcpy(user, a->owner);
+      char *group = strchr(user, ':');
+      if (group)
+        *group++ = '\0';
+      bool ok = root && (!*user || acct_uid(user, &spec.uid)) &&
+                (!group || acct_gid(group, &spec.gid));
+      reg_store(vm, a->dest, ok ? fsmeta_apply(root, &spec) : NULL, true);
+      break;
+    }
+    case SM_OP_FS_STAT: {
+      sm_fs_stat *a = (sm_fs_stat *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->paths) &&
+                (a->base < 0 || reg_valid(a->base)));
+      const char *paths = reg_str(vm, a->paths);
+      const char *base = NULL;
+      if (a->base >= 0)
+        base = reg_str(vm, a->base);
+      bool ok = paths && (a->base < 0 || base);
+      char *out = ok ? fsmeta_stat(base, paths, a->fields, a->nfields,
+                                   a->follow)
+                     : NULL;
+      reg_store(vm, a->dest, out, true);
+      break;
+    }
+    case SM_OP_FS_SEARCH: {
+      sm_fs_search *a = (sm_fs_search *)cur->data;
+      CHECK_REG(a && reg_valid(a->dest) && reg_valid(a->root) &&
+                reg_valid(a->pattern));
+      const char *root = reg_str(vm, a->root);
+      const char *pat = reg_str(vm, a->pattern);
+      char *out = root && pat ? fsearch_run(root, pat, strlen(pat), &a->opts)
+                              : NULL;
+      reg_store(vm, a->dest, out, true);
+      break;
+    }
     default:
       err = SM_ERR_BAD_OP;
       goto done;
@@ -302,9 +565,19 @@ int sm_execute(sm_instr *head, sm_vm *vm) {
     cur = cur->next;
   }
 done:
+  sm_alloc_set_op(-1);
   return err;
 }
 
+sm_vm *sm_vm_create(void) { return sm_calloc(1, sizeof(sm_vm)); }
+
+void sm_vm_destroy(sm_vm *vm) {
+  if (!vm)
+    return;
+  vm_clear(vm);
+  sm_free(vm);
+}
+
 /* ----- Persistent executor thread ----- */
 
 static void *sm_worker(void *arg) {
@@ -322,26 +595,40 @@ static void *sm_worker(void *arg) {
     if (!ctx->head)
       ctx->tail = NULL;
     ctx->job_done = false;
+    ctx->job_returned = false;
     pthread_mutex_unlock(&ctx->lock);
 
+    sm_job_stats stats = {0};
+    for (sm_instr *i = j->instr; i; i = i->next) {
+      stats.instr_count++;
+      if ((unsigned)i->op < SM_OP_COUNT && stats.op_hist[i->op] < UINT16_MAX)
+        stats.op_hist[i->op]++;
+    }
+    sm_alloc_set_job(&stats.alloc);
+    uint64_t start = now_ns();
     current_ctx = ctx;
     int exec_ret = sm_execute(j->instr, &ctx->vm);
     current_ctx = NULL;
+    stats.duration_ns = now_ns() - start;
+    stats.err = exec_ret;
+    sm_alloc_set_job(NULL);
 
     pthread_mutex_lock(&ctx->lock);
-    if (!ctx->job_done) {
+    /* Completion is signalled here, after the stats are in place, so a
+     * waiter woken by SM_OP_RETURN never sees the previous job's figures. */
+    ctx->last_stats = stats;
+    if (!ctx->job_returned)
       ctx->job_value = exec_ret;
-      ctx->job_done = true;
-      pthread_cond_signal(&ctx->done_cond);
-    }
+    ctx->job_done = true;
+    pthread_cond_signal(&ctx->done_cond);
     pthread_mutex_unlock(&ctx->lock);
-    free(j);
+    sm_free(j);
   }
   return NULL;
 }
 
 sm_ctx *sm_thread_start(void) {
-  sm_ctx *ctx = calloc(1, sizeof(*ctx));
+  sm_ctx *ctx = sm_calloc(1, sizeof(*ctx));
   if (!ctx)
     return NULL;
   pthread_mutex_init(&ctx->lock, NULL);
@@ -355,7 +642,7 @@ sm_ctx *sm_thread_start(void) {
     pthread_cond_destroy(&ctx->cond);
     pthread_cond_destroy(&ctx->done_cond);
     pthread_mutex_destroy(&ctx->lock);
-    free(ctx);
+    sm_free(ctx);
     return NULL;
   }
   return ctx;
@@ -369,16 +656,17 @@ void sm_thread_stop(sm_ctx *ctx) {
   pthread_cond_signal(&ctx->cond);
   pthread_mutex_unlock(&ctx->lock);
   pthread_join(ctx->thread, NULL);
+  vm_clear(&ctx->vm);
   pthread_cond_destroy(&ctx->cond);
   pthread_cond_destroy(&ctx->done_cond);
   pthread_mutex_destroy(&ctx->lock);
-  free(ctx);
+  sm_free(ctx);
 }
 
 bool sm_submit(sm_ctx *ctx, sm_instr *chain) {
   if (!ctx)
     return false;
-  sm_job *j = malloc(sizeof(*j));
+  sm_job *j = sm_malloc(sizeof(*j));
   if (!j)
     return false;
   j->instr = chain;
@@ -413,6 +701,34 @@ void sm_set_report_cb(sm_ctx *ctx, sm_report_cb cb, void *user) {
   pthread_mutex_unlock(&ctx->lock);
 }
 
+void sm_reset(sm_ctx *ctx) {
+  if (!ctx)
+    return;
+  pthread_mutex_lock(&ctx->lock);
+  vm_clear(&ctx->vm);
+  ctx->vm.seed = ctx->seed;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+void sm_reseed(sm_ctx *ctx, unsigned int seed) {
+  if (!ctx)
+    return;
+  pthread_mutex_lock(&ctx->lock);
+  ctx->seed = seed;
+  ctx->vm.seed = seed;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static _Atomic uint32_t cache_epoch = 0;
+
+uint32_t sm_cache_epoch(void) {
+  return atomic_load_explicit(&cache_epoch, memory_order_acquire);
+}
+
+void sm_cache_invalidate(void) {
+  atomic_fetch_add_explicit(&cache_epoch, 1, memory_order_acq_rel);
+}
+
 void sm_wait(sm_ctx *ctx, int *value) {
   if (!ctx)
     return;
@@ -423,3 +739,12 @@ void sm_wait(sm_ctx *ctx, int *value) {
     *value = ctx->job_value;
   pthread_mutex_unlock(&ctx->lock);
 }
+
+bool sm_get_job_stats(sm_ctx *ctx, sm_job_stats *out) {
+  if (!ctx || !out)
+    return false;
+  pthread_mutex_lock(&ctx->lock);
+  *out = ctx->last_stats;
+  pthread_mutex_unlock(&ctx->lock);
+  return true;
+}
@@ -1,8 +1,16 @@
 #ifndef STATE_MACHINE_H
 #define STATE_MACHINE_H
 
+#include "accounts.h"
+#include "cgroup.h"
+#include "fill.h"
+#include "fsearch.h"
+#include "fsmeta.h"
+#include "gentree.h"
+#include "sm_alloc.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define SM_REG_COUNT 8
 
@@ -43,6 +51,24 @@ typedef enum {
   SM_OP_RAND_SEED,
   SM_OP_REPORT,
   SM_OP_RETURN,
+  SM_OP_KV_SET,
+  SM_OP_KV_GET,
+  SM_OP_KV_DEL,
+  SM_OP_PROC_LIST,
+  SM_OP_NET_LISTEN,
+  SM_OP_PROC_SPAWN,
+  SM_OP_PROC_STATUS,
+  SM_OP_PROC_SIGNAL,
+  SM_OP_PROC_READ,
+  SM_OP_FS_GENTREE,
+  SM_OP_FS_ALLOCATE,
+  SM_OP_FS_EXHAUST,
+  SM_OP_FS_RELEASE,
+  SM_OP_USERS_ADD,
+  SM_OP_FS_META,
+  SM_OP_FS_STAT,
+  SM_OP_FS_SEARCH,
+  SM_OP_COUNT, /* number of opcodes, not a valid instruction */
 } sm_opcode;
 
 typedef struct sm_instr {
@@ -55,6 +81,7 @@ typedef struct sm_instr {
 typedef struct {
   int dest;
   const void *value;
+  bool is_string; /* value points to an owned string rather than an int */
 } sm_load_const;
 
 typedef struct {
@@ -110,6 +137,8 @@ typedef struct {
 typedef struct {
   int dest;
   int cmd;
+  int usage;        /* register receiving resource usage, or -1 */
+  cg_limits limits; /* applied when cgroups are enabled */
 } sm_shell;
 
 typedef struct {
@@ -178,6 +207,132 @@ typedef struct {
   int value;
 } sm_return;
 
+typedef struct {
+  int dest;
+  int key;
+  int value;
+  uint32_t ttl_ms; /* 0: no expiry */
+} sm_kv_set;
+
+typedef struct {
+  int dest;
+  int key;
+} sm_kv_get;
+
+typedef struct {
+  int dest;
+  int key;
+} sm_kv_del;
+
+/* Columns of an SM_OP_PROC_LIST record */
+typedef enum {
+  SM_PROC_PID,
+  SM_PROC_PPID,
+  SM_PROC_STATE,
+  SM_PROC_UID,
+  SM_PROC_RSS,
+  SM_PROC_CPU,
+  SM_PROC_COMM,
+  SM_PROC_CMDLINE,
+  SM_PROC_FIELD_COUNT,
+} sm_proc_field;
+
+typedef struct {
+  int dest;
+  int name;    /* register with an exact comm to match, or -1 */
+  int uid;     /* register with a uid to match, or -1 */
+  int cmdline; /* register with a glob for the command line, or -1 */
+  int nfields;
+  uint8_t fields[SM_PROC_FIELD_COUNT];
+} sm_proc_list;
+
+typedef struct {
+  int dest;
+  int port;            /* register with a port to match, or -1 */
+  int count;           /* register receiving the number of sockets, or -1 */
+  unsigned int protos; /* NET_* bits from net_inspect.h */
+  bool pids;
+} sm_net_listen;
+
+typedef struct {
+  int dest;
+  int cmd;
+  cg_limits limits;
+} sm_proc_spawn;
+
+typedef struct {
+  int dest;
+  int handle;
+  int running; /* register receiving a running flag, or -1 */
+  int usage;   /* register receiving resource usage, or -1 */
+} sm_proc_status;
+
+typedef struct {
+  int dest;
+  int handle;
+  int signal;
+} sm_proc_signal;
+
+typedef struct {
+  int dest;
+  int handle;
+  int stream; /* sup_stream */
+} sm_proc_read;
+
+typedef struct {
+  int dest;
+  int root;
+  gentree_spec spec;
+} sm_fs_gentree;
+
+typedef struct {
+  int dest;
+  int path;
+  uint64_t size;
+  bool allocate; /* reserve blocks, else sparse */
+} sm_fs_allocate;
+
+typedef struct {
+  int dest;
+  int path; /* directory on the filesystem to fill */
+  fill_resource resource;
+  uint64_t target; /* free bytes or inodes to leave */
+  int threads;
+} sm_fs_exhaust;
+
+typedef struct {
+  int dest;
+  int handle;
+} sm_fs_release;
+
+typedef struct {
+  int dest;
+  acct_batch batch;
+} sm_users_add;
+
+typedef struct {
+  int dest;
+  int root;
+  char owner[2 * ACCT_MAX_NAME + 2]; /* "user", "user:group", ":group" */
+  fsmeta_spec spec;                  /* uid/gid filled in from owner */
+} sm_fs_meta;
+
+typedef struct {
+  int dest;
+  int paths; /* register with newline-separated paths */
+  int base;  /* register with the directory relative paths start in, or -1 */
+  bool follow;
+  int nfields;
+  uint8_t fields[FSMETA_FIELD_COUNT];
+} sm_fs_stat;
+
+typedef struct {
+  int dest;
+  int root;    /* register with a file or directory */
+  int pattern; /* register with the string to find */
+  fsearch_opts opts;
+} sm_fs_search;
+
 typedef struct sm_ctx sm_ctx;
 
 sm_ctx *sm_thread_start(void);
@@ -187,10 +342,34 @@ sm_reg sm_get_reg(sm_ctx *ctx, int idx);
 void sm_wait(sm_ctx *ctx, int *value);
 typedef void (*sm_report_cb)(const char *json, void *user);
 void sm_set_report_cb(sm_ctx *ctx, sm_report_cb cb, void *user);
+/* Clear the worker's registers and rewind its RNG to the seed last given to
+ * sm_reseed() (0 if none); call only while no job is queued */
+void sm_reset(sm_ctx *ctx);
+/* Replace the worker's RNG seed, also for later resets; call only while no
+ * job is queued */
+void sm_reseed(sm_ctx *ctx, unsigned int seed);
+
+/* Generation of cached state that a snapshot restore makes stale (entries
+ * with time-based expiry, facts about the host). Caches record the epoch
+ * they were filled in and treat entries from an older one as missing. */
+uint32_t sm_cache_epoch(void);
+void sm_cache_invalidate(void);
+
+/* Timing, allocation and shape figures for the most recently finished job */
+typedef struct {
+  uint64_t duration_ns;
+  sm_alloc_stats alloc;
+  int err;                         /* sm_execute() result, an sm_error */
+  uint32_t instr_count;
+  uint16_t op_hist[SM_OP_COUNT];   /* instructions per opcode in the recipe */
+} sm_job_stats;
+bool sm_get_job_stats(sm_ctx *ctx, sm_job_stats *out);
 
 /* Existing executor for direct use */
 typedef struct sm_vm sm_vm;
 int sm_execute(sm_instr *head, sm_vm *vm);
+sm_vm *sm_vm_create(void);
+void sm_vm_destroy(sm_vm *vm);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include "supervisor.h"
+#include "cgroup.h"
+#include "sm_alloc.h"
+#include "taskd_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define MAX_ID INT32_MAX
+
+/* epoll data: handle id, table slot and which descriptor fired */
+#define EV_STDOUT 0u
+#define EV_STDERR 1u
+#define EV_PIDFD 2u
+#define EV_WAKE UINT64_MAX
+#define EV_PACK(id, slot, kind)                                                \
+  ((uint64_t)(id) << 16 | (uint64_t)(slot) << 2 | (kind))
+
+typedef struct {
+  char *data; /* SUP_OUTPUT_CAP bytes, allocated on first output */
+  uint32_t head;
+  uint32_t len;
+  uint64_t dropped;
+} sup_ring;
+
+typedef struct {
+  uint32_t id;
+  pid_t pid;
+  int pidfd;  /* -1 once reaped, or when pidfd_open is unavailable */
+  int fds[2]; /* stdout, stderr read ends; -1 after EOF */
+  uint32_t cg; /* cgroup id, 0 if none */
+  bool running;
+  bool signaled;
+  int code;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  sup_ring out[2];
+} sup_entry;
+
+static sup_entry *table[SUP_MAX];
+static uint32_t next_id = 1;
+static pthread_mutex_t sup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sup_thread;
+static bool thread_running = false;
+static bool stopping = false;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void ring_put(sup_ring *r, const char *s, size_t n) {
+  if (!r->data && !(r->data = sm_malloc(SUP_OUTPUT_CAP))) {
+    r->dropped += n;
+    return;
+  }
+  /* Keep the newest bytes: drop from the front of s, then of the ring */
+  if (n > SUP_OUTPUT_CAP) {
+    r->dropped += n - SUP_OUTPUT_CAP;
+    s += n - SUP_OUTPUT_CAP;
+    n = SUP_OUTPUT_CAP;
+  }
+  if (r->len + n > SUP_OUTPUT_CAP) {
+    uint32_t over = (uint32_t)(r->len + n - SUP_OUTPUT_CAP);
+    r->head = (r->head + over) % SUP_OUTPUT_CAP;
+    r->len -= over;
+    r->dropped += over;
+  }
+  uint32_t tail = (r->head + r->len) % SUP_OUTPUT_CAP;
+  size_t first = SUP_OUTPUT_CAP - tail < n ? SUP_OUTPUT_CAP - tail : n;
+  memcpy(r->data + tail, s, first);
+  memcpy(r->data, s + first, n - first);
+  r->len += (uint32_t)n;
+}
+
+static void close_fd(int *fd) {
+  if (*fd == -1)
+    return;
+  close(*fd); /* also removes it from the epoll set */
+  *fd = -1;
+}
+
+static void entry_free(sup_entry *e) {
+  cg_release(e->cg, true);
+  close_fd(&e->pidfd);
+  close_fd(&e->fds[0]);
+  close_fd(&e->fds[1]);
+  sm_free(e->out[0].data);
+  sm_free(e->out[1].data);
+  sm_free(e);
+}
+
+/* Collect the exit status if the child has exited. Caller holds sup_lock. */
+static void reap(sup_entry *e, bool block) {
+  if (!e->running)
+    return;
+  siginfo_t si;
+  memset(&si, 0, sizeof(si));
+  int flags = WEXITED | (block ? 0 : WNOHANG);
+  if (waitid(P_PID, (id_t)e->pid, &si, flags) != 0) {
+    if (errno != ECHILD)
+      return;
+    /* Reaped behind our back; the status is lost */
+    si.si_pid = e->pid;
+    si.si_code = CLD_EXITED;
+    si.si_status = -1;
+  }
+  if (si.si_pid != e->pid)
+    return;
+  e->running = false;
+  e->signaled = si.si_code != CLD_EXITED;
+  e->code = si.si_status;
+  e->end_ns = mono_ns();
+  close_fd(&e->pidfd);
+}
+
+/* Drain a pipe into its ring. Caller holds sup_lock. */
+static void drain(sup_entry *e, int stream) {
+  char buf[4096];
+  for (;;) {
+    ssize_t n = read(e->fds[stream], buf, sizeof(buf));
+    if (n > 0) {
+      ring_put(&e->out[stream], buf, (size_t)n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || errno != EAGAIN)
+      close_fd(&e->fds[stream]);
+    return;
+  }
+}
+
+static sup_entry *lookup(uint32_t id) {
+  for (int i = 0; i < SUP_MAX; ++i)
+    if (table[i] && table[i]->id == id)
+      return table[i];
+  return NULL;
+}
+
+static void *sup_main(void *arg) {
+  (void)arg;
+  struct epoll_event evs[16];
+  for (;;) {
+    int n = epoll_wait(epoll_fd, evs, 16, -1);
+    pthread_mutex_lock(&sup_lock);
+    if (stopping) {
+      pthread_mutex_unlock(&sup_lock);
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      uint64_t d = evs[i].data.u64;
+      if (d == EV_WAKE) {
+        uint64_t v;
+        if (read(wake_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+          TLOG(TLOG_WARN, "supervisor wakeup read failed: errno %lld", errno);
+        continue;
+      }
+      /* The entry may have been dropped after epoll_wait returned */
+      sup_entry *e = table[(d >> 2) & (SUP_MAX - 1)];
+      if (!e || e->id != (uint32_t)(d >> 16))
+        continue;
+      unsigned kind = (unsigned)(d & 3);
+      if (kind == EV_PIDFD)
+        reap(e, false);
+      else if (e->fds[kind] != -1)
+        drain(e, (int)kind);
+    }
+    pthread_mutex_unlock(&sup_lock);
+  }
+  return NULL;
+}
+
+/* Caller holds sup_lock. */
+static bool start_thread(void) {
+  if (thread_running)
+    return true;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EV_WAKE};
+  if (epoll_fd == -1 || wake_fd == -1 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) != 0 ||
+      pthread_create(&sup_thread, NULL, sup_main, NULL) != 0) {
+    TLOG(TLOG_ERROR, "supervisor start failed: errno %lld", errno);
+    close_fd(&epoll_fd);
+    close_fd(&wake_fd);
+    return false;
+  }
+  stopping = false;
+  thread_running = true;
+  return true;
+}
+
+/* A free slot, dropping the oldest exited child if there is none. Caller
+ * holds sup_lock. */
+static int free_slot(void) {
+  int oldest = -1;
+  for (int i = 0; i < SUP_MAX; ++i) {
+    if (!table[i])
+      return i;
+    if (!table[i]->running &&
+        (oldest < 0 || table[i]->end_ns < table[oldest]->end_ns))
+      oldest = i;
+  }
+  if (oldest >= 0) {
+    entry_free(table[oldest]);
+    table[oldest] = NULL;
+  }
+  return oldest;
+}
+
+static uint32_t alloc_id(void) {
+  for (;;) {
+    uint32_t id = next_id;
+    next_id = next_id == MAX_ID ? 1 : next_id + 1;
+    if (!lookup(id))
+      return id;
+  }
+}
+
+/* Run cmd with stdout on out and, unless err is -1, stderr on err. With a
+ * cgroup the shell first writes itself into its cgroup.procs, then runs cmd
+ * in place, so nothing the command starts can escape the group. Placement
+ * is best effort: if the write fails the command still runs, where taskd
+ * runs, and the failure is logged. */
+static pid_t spawn_shell(const char *cmd, int out, int err, uint32_t cg) {
+  char procs[PATH_MAX];
+  bool placed = cg_procs_path(cg, procs, sizeof(procs));
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawnattr_init(&attr);
+  posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&fa, out, 1);
+  if (err != -1)
+    posix_spawn_file_actions_adddup2(&fa, err, 2);
+  /* Own session so a signal reaches everything the command started; no
+   * blocked signals or handlers inherited from the daemon */
+  sigset_t none, all;
+  sigemptyset(&none);
+  sigfillset(&all);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &all);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK |
+                                      POSIX_SPAWN_SETSIGDEF);
+  char *argv[] = {"/bin/sh", "-c", (char *)cmd, NULL, NULL, NULL, NULL};
+  if (placed) {
+    /* $0 and the positional parameters end up as with sh -c cmd */
+    argv[2] = "{ echo 0 >\"$2\"; } 2>/dev/null; eval \"set --; $1\"";
+    argv[3] = "/bin/sh";
+    argv[4] = (char *)cmd;
+    argv[5] = procs;
+  }
+  pid_t pid = -1;
+  if (posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ) != 0)
+    pid = -1;
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  /* The shell cannot report a failed write; repeating it here can */
+  if (placed && pid >= 0 && !cg_attach(cg, pid))
+    TLOG(TLOG_WARN, "command not placed in cgroup %lld: errno %lld", cg,
+         errno);
+  return pid;
+}
+
+uint32_t sup_spawn(const char *cmd, const cg_limits *lim) {
+  if (!cmd)
+    return 0;
+  int out[2] = {-1, -1}, err[2] = {-1, -1};
+  if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+    close_fd(&out[0]);
+    close_fd(&out[1]);
+    return 0;
+  }
+  sup_entry *e = sm_calloc(1, sizeof(*e));
+  pthread_mutex_lock(&sup_lock);
+  int slot = e && start_thread() ? free_slot() : -1;
+  uint32_t cg = slot >= 0 ? cg_create(lim) : 0;
+  pid_t pid = slot >= 0 ? spawn_shell(cmd, out[1], err[1], cg) : -1;
+  close_fd(&out[1]);
+  close_fd(&err[1]);
+  if (pid < 0) {
+    pthread_mutex_unlock(&sup_lock);
+    TLOG(TLOG_WARN, "spawn failed: slot %lld, errno %lld", slot, errno);
+    cg_release(cg, true);
+    close_fd(&out[0]);
+    close_fd(&err[0]);
+    sm_free(e);
+    return 0;
+  }
+  e->cg = cg;
+  e->id = alloc_id();
+  e->pid = pid;
+  e->running = true;
+  e->start_ns = mono_ns();
+  e->fds[0] = out[0];
+  e->fds[1] = err[0];
+#ifdef SYS_pidfd_open
+  e->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  e->pidfd = -1;
+#endif
+  table[slot] = e;
+  for (int kind = 0; kind < 3; ++kind) {
+    int fd = kind == EV_PIDFD ? e->pidfd : e->fds[kind];
+    if (fd == -1)
+      continue;
+    if (kind != EV_PIDFD)
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u64 = EV_PACK(e->id, slot, kind)};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  uint32_t id = e->id;
+  pthread_mutex_unlock(&sup_lock);
+  TLOG(TLOG_DEBUG, "spawned child %lld as pid %lld", id, pid);
+  return id;
+}
+
+bool sup_get_status(uint32_t id, sup_status *out) {
+  pthread_mutex_lock(&sup_lock);
+  sup_entry *e = lookup(id);
+  if (e) {
+    /* Without a pidfd (kernels before 5.3) this is where exits are seen */
+    reap(e, false);
+    out->pid = e->pid;
+    out->running = e->running;
+    out->signaled = e->signaled;
+    out->code = e->code;
+    out->runtime_ms = ((e->running ? mono_ns() : e->end_ns) - e->start_ns) /
+                      1000000;
+    out->dropped[0] = e->out[0].dropped;
+    out->dropped[1] = e->out[1].dropped;
+    cg_read_usage(e->cg, &out->usage);
+  }
+  pthread_mutex_unlock(&sup_lock);
+  return e != NULL;
+}
+
+bool sup_signal(uint32_t id, int sig) {
+  pthread_mutex_lock(&sup_lock);
+  sup_entry *e = lookup(id);
+  /* After the leader is reaped its pid may be reused: only signal the
+   * group while the leader is still ours */
+  bool ok = e && e->running && kill(-e->pid, sig) == 0;
+  pthread_mutex_unlock(&sup_lock);
+  return ok;
+}
+
+char *sup_read(uint32_t id, sup_stream stream) {
+  if (stream != SUP_STDOUT && stream != SUP_STDERR)
+    return NULL;
+  pthread_mutex_lock(&sup_lock);
+  sup_entry *e = lookup(id);
+  char *s = NULL;
+  if (e) {
+    /* Pick up what arrived since the last wakeup */
+    if (e->fds[stream] != -1)
+      drain(e, stream);
+    sup_ring *r = &e->out[stream];
+    s = sm_malloc(r->len + 1);
+    if (s) {
+      size_t room = SUP_OUTPUT_CAP - r->head;
+      size_t first = room < r->len ? room : r->len;
+      if (r->len) {
+        memcpy(s, r->data + r->head, first);
+        memcpy(s + first, r->data, r->len - first);
+      }
+      s[r->len] = '\0';
+      r->head = r->len = 0;
+    }
+  }
+  pthread_mutex_unlock(&sup_lock);
+  return s;
+}
+
+char *sup_run(const char *cmd, const cg_limits *lim, cg_usage *usage) {
+  usage->cpu_usec = usage->memory_peak = -1;
+  int out[2];
+  if (!cmd || pipe2(out, O_CLOEXEC) != 0)
+    return NULL;
+  uint32_t cg = cg_create(lim);
+  pid_t pid = spawn_shell(cmd, out[1], -1, cg);
+  close_fd(&out[1]);
+  size_t cap = 256, len = 0;
+  char *buf = pid >= 0 ? sm_malloc(cap) : NULL;
+  while (buf) {
+    if (len + 1 == cap) {
+      char *tmp = sm_realloc(buf, cap * 2);
+      if (!tmp) {
+        sm_free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = tmp;
+      cap *= 2;
+    }
+    ssize_t n = read(out[0], buf + len, cap - 1 - len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len += (size_t)n;
+  }
+  if (buf)
+    buf[len] = '\0';
+  close_fd(&out[0]);
+  if (pid >= 0)
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+  cg_read_usage(cg, usage);
+  /* Without limits, leave what the command started in the background
+   * running, as without cgroups */
+  cg_release(cg, cg_limits_set(lim));
+  return buf;
+}
+
+void sup_kill_all(void) {
+  pthread_mutex_lock(&sup_lock);
+  for (int i = 0; i < SUP_MAX; ++i) {
+    sup_entry *e = table[i];
+    if (!e)
+      continue;
+    if (e->running) {
+      kill(-e->pid, SIGKILL);
+      reap(e, true);
+    }
+    entry_free(e);
+    table[i] = NULL;
+  }
+  pthread_mutex_unlock(&sup_lock);
+}
+
+void sup_stop(void) {
+  sup_kill_all();
+  pthread_mutex_lock(&sup_lock);
+  if (!thread_running) {
+    pthread_mutex_unlock(&sup_lock);
+    return;
+  }
+  stopping = true;
+  pthread_mutex_unlock(&sup_lock);
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+    TLOG(TLOG_WARN, "supervisor wakeup failed: errno %lld", errno);
+  pthread_join(sup_thread, NULL);
+  close_fd(&epoll_fd);
+  close_fd(&wake_fd);
+  thread_running = false;
+}
@@ -0,0 +1,77 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include "cgroup.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Background processes started by recipes (services a task needs running).
+ *
+ * Each child runs `/bin/sh -c cmd` in its own session with stdin on
+ * /dev/null. Its stdout and stderr go to pipes that a supervisor thread
+ * drains into bounded rings, keeping the newest SUP_OUTPUT_CAP bytes of
+ * each; its exit is picked up through a pidfd in the same epoll loop, so
+ * children are reaped as soon as they exit and never linger as zombies.
+ * With cgroups (cgroup.h) each child gets its own group, which also
+ * accounts for and finally kills whatever it leaves running; without them,
+ * processes a child leaves behind after it exits are not tracked.
+ *
+ * Handles are positive integers and are not reused until the counter
+ * wraps. The table keeps exited children until it fills up; the oldest
+ * exited one is then dropped. The thread starts with the first child.
+ */
+#define SUP_MAX 64
+#define SUP_OUTPUT_CAP (64 * 1024)
+
+typedef enum {
+  SUP_STDOUT,
+  SUP_STDERR,
+} sup_stream;
+
+typedef struct {
+  pid_t pid;
+  bool running;
+  bool signaled;  /* killed by a signal rather than exiting */
+  int code;       /* exit status or signal number, once not running */
+  uint64_t runtime_ms;
+  uint64_t dropped[2]; /* output bytes lost to full rings, per stream */
+  cg_usage usage;      /* -1 fields without a cgroup */
+} sup_status;
+
+/* Start cmd, in a cgroup with lim applied when cgroups are enabled (lim may
+ * be NULL). Returns its handle, or 0 if the table is full of running
+ * children or the spawn failed. */
+uint32_t sup_spawn(const char *cmd, const cg_limits *lim);
+
+bool sup_get_status(uint32_t id, sup_status *out);
+
+/* Send sig to the child's process group. */
+bool sup_signal(uint32_t id, int sig);
+
+/* Buffered output of one stream, removed from the ring (caller frees with
+ * sm_free). "" when there is none, NULL for an unknown handle. */
+char *sup_read(uint32_t id, sup_stream stream);
+
+/* Run cmd to completion like popen(), but in its own cgroup. Returns its
+ * stdout (caller frees with sm_free), or NULL; *usage receives what the
+ * command consumed. */
+char *sup_run(const char *cmd, const cg_limits *lim, cg_usage *usage);
+
+/* SIGKILL the process group of every running child, reap them and empty
+ * the table. */
+void sup_kill_all(void);
+
+/* sup_kill_all() and stop the thread. */
+void sup_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SUPERVISOR_H */
@@ -3,12 +3,18 @@
  *
  * A very small Firecracker-friendly daemon that:
  *   • is started by root at boot     (e.g. from /etc/rc.local or a unit file)
- *   • double-forks to detach from tty and run in the background
- *   • listens on an AF_VSOCK stream socket
+ *   • double-forks to detach from tty and run in the background, or with
+ *     --foreground stays in the foreground for PID 1 / init stubs
+ *   • listens on an AF_VSOCK stream socket (or AF_UNIX / loopback TCP for
+ *     testing off-VM, see transport.h)
  *   • accepts one connection at a time and prints a greeting, then closes
+ *   • re-seeds and revalidates itself when the VM is restored from a
+ *     snapshot (SIGUSR2, VM generation ID change or "restore" command)
  *
  * Build:   gcc -O2 -Wall -Wextra -pedantic -std=c11 taskd.c -o taskd
- * Run:     taskd <PORT>
+ * Run:     taskd [--foreground] [--low-footprint] [--notify ADDR]
+ *                [--ready-console PATH] <PORT>
+ *          (or unix:/run/taskd.sock / tcp:<PORT> in place of <PORT>)
  *
  * Tested on: Linux 5.10+ inside a Firecracker microVM
  *
@@ -18,19 +24,34 @@
 // clang-format off
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/netlink.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
-#include <linux/vm_sockets.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 // clang-format on
 
 // Submodule libraries
+#include "cgroup.h"
+#include "fill.h"
+#include "flight_recorder.h"
+#include "fsmeta.h"
+#include "kv_store.h"
 #include "protocol.h"
+#include "scheduler.h"
 #include "state_machine.h"
+#include "supervisor.h"
+#include "taskd_log.h"
+#include "transport.h"
 #include "xxhash.h"
 #include <cJSON.h>
 
@@ -83,75 +104,678 @@ static void daemonize(void) {
 }
 
 static sm_ctx *g_sm_ctx = NULL;
+/* Seed from the last restore; also given to an executor started later */
+static unsigned int g_seed = 0;
 
-/* Collect JSON messages into an array instead of writing immediately. */
-static void report_collect_cb(const char *json, void *ud) {
-  cJSON *arr = ud;
-  if (!json || !arr)
+/* Listening socket, replaced if it stops accepting (e.g. after a restore) */
+static transport_addr g_listen_addr;
+static int g_srv_fd = -1;
+
+/* Fast-start mode: no double fork, worker thread started on first use */
+static bool g_foreground = false;
+
+/* Low-footprint mode for dense hosts: small thread stacks, a single malloc
+ * arena, and free heap returned to the kernel after every job */
+static bool g_low_footprint = false;
+#define TASKD_LOW_STACK_SIZE (512 * 1024) /* deep fs_dir_contains() trees */
+
+/* Commands run in cgroups with taskd in a protected one (cgroup.h) */
+static bool g_cgroups = true;
+
+/* Resident set in KiB from /proc/self/status; idle is sampled once the
+ * listener is up and, in low-footprint mode, after every connection */
+static struct {
+  long idle_kb;
+} g_mem = {-1};
+
+/* Startup milestones in CLOCK_MONOTONIC ns, reported in the ready frame and
+ * the stats command. worker stays equal to logging when the worker thread
+ * is started lazily. */
+static struct {
+  uint64_t exec; /* first user code, taken by a constructor before main() */
+  uint64_t main;
+  uint64_t daemonized;
+  uint64_t logging;
+  uint64_t worker;
+  uint64_t listening;
+} g_startup;
+
+static uint64_t clock_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+__attribute__((constructor)) static void mark_exec(void) {
+  g_startup.exec = clock_ns(CLOCK_MONOTONIC);
+}
+
+static void startup_to_json(cJSON *obj) {
+#define US(a, b) ((double)((g_startup.a - g_startup.b) / 1000))
+  cJSON_AddStringToObject(obj, "mode", g_foreground ? "foreground" : "daemon");
+  cJSON_AddNumberToObject(obj, "exec_to_main", US(main, exec));
+  cJSON_AddNumberToObject(obj, "daemonize", US(daemonized, main));
+  cJSON_AddNumberToObject(obj, "log", US(logging, daemonized));
+  cJSON_AddNumberToObject(obj, "worker", US(worker, logging));
+  cJSON_AddNumberToObject(obj, "listen", US(listening, worker));
+  cJSON_AddNumberToObject(obj, "total", US(listening, main));
+  cJSON_AddNumberToObject(obj, "exec_to_listen", US(listening, exec));
+#undef US
+}
+
+/* Set by SIGUSR1; the service loop dumps the flight recorder when it sees it */
+static volatile sig_atomic_t g_dump_flight = 0;
+
+static void on_sigusr1(int sig) {
+  (void)sig;
+  g_dump_flight = 1;
+}
+
+/* Set by SIGUSR2, which the host sends after restoring a snapshot */
+static volatile sig_atomic_t g_restore_signal = 0;
+
+static void on_sigusr2(int sig) {
+  (void)sig;
+  g_restore_signal = 1;
+}
+
+/* Set by SIGTERM; the service loop returns from main() so that exit handlers
+ * (log flush, profile counters of instrumented builds) run */
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_sigterm(int sig) {
+  (void)sig;
+  g_stop = 1;
+}
+
+/* Log a fatal error, flush the log and exit. */
+static void die(const char *what) {
+  TLOG_S(TLOG_ERROR, "%s failed: errno %lld", what, errno);
+  tlog_stop();
+  exit(EXIT_FAILURE);
+}
+
+/* Start the executor on first use in fast-start mode. */
+static void ensure_worker(void) {
+  if (g_sm_ctx)
     return;
-  cJSON *obj = cJSON_Parse(json);
-  if (obj)
-    cJSON_AddItemToArray(arr, obj);
+  g_sm_ctx = sm_thread_start();
+  if (!g_sm_ctx)
+    die("sm_thread_start");
+  sm_reseed(g_sm_ctx, g_seed);
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <vsock-port>\n", argv[0]);
-    return EXIT_FAILURE;
+static long proc_status_kb(const char *key) {
+  FILE *f = fopen("/proc/self/status", "re");
+  if (!f)
+    return -1;
+  char line[128];
+  size_t klen = strlen(key);
+  long kb = -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, key, klen) == 0 && line[klen] == ':') {
+      kb = strtol(line + klen + 1, NULL, 10);
+      break;
+    }
   }
+  fclose(f);
+  return kb;
+}
 
-  unsigned int port = (unsigned int)strtoul(argv[1], NULL, 10);
-  if (port == 0) {
-    fprintf(stderr, "Invalid port\n");
-    return EXIT_FAILURE;
+/* Give freed heap back once the replies went out and the daemon is about
+ * to block, so it is off the latency path of pipelined requests. */
+static void after_job(void) {
+  if (g_low_footprint)
+    malloc_trim(0);
+}
+
+static void connection_closed(void) {
+  if (!g_low_footprint)
+    return;
+  malloc_trim(0);
+  g_mem.idle_kb = proc_status_kb("VmRSS");
+}
+
+/* Applied before the first allocation and the first thread */
+static void enter_low_footprint(void) {
+  mallopt(M_ARENA_MAX, 1);
+  pthread_attr_t attr;
+  if (pthread_attr_init(&attr) != 0)
+    return;
+  pthread_attr_setstacksize(&attr, TASKD_LOW_STACK_SIZE);
+  pthread_setattr_default_np(&attr);
+  pthread_attr_destroy(&attr);
+}
+
+static void memory_to_json(cJSON *obj) {
+  if (!obj)
+    return;
+  cJSON_AddNumberToObject(obj, "rss_kb", proc_status_kb("VmRSS"));
+  cJSON_AddNumberToObject(obj, "peak_rss_kb", proc_status_kb("VmHWM"));
+  cJSON_AddNumberToObject(obj, "idle_rss_kb", g_mem.idle_kb);
+  cJSON_AddBoolToObject(obj, "low_footprint", g_low_footprint);
+}
+
+/* Snapshot restore. Every clone of a snapshot resumes with the same RNG
+ * seed and the same cached state, and with sockets that predate the resume.
+ * The last restore is reported by the stats and restore commands. */
+static struct {
+  uint32_t count;
+  const char *trigger; /* "signal", "vmgenid" or "command" */
+  uint64_t hook_ns;
+  bool listener_recreated;
+} g_restore;
+
+/* uevent socket for vmgenid notifications, -1 if unavailable */
+static int g_uevent_fd = -1;
+
+static bool listener_ok(int fd) {
+  int on = 0, err = 0;
+  socklen_t len = sizeof(on);
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == -1 || !on)
+    return false;
+  len = sizeof(err);
+  return getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+/* Replace the listening socket if it no longer accepts connections. Returns
+ * true if it was replaced. */
+static bool revalidate_listener(void) {
+  if (listener_ok(g_srv_fd))
+    return false;
+  close(g_srv_fd);
+  g_srv_fd = transport_listen(&g_listen_addr, 32);
+  if (g_srv_fd == -1)
+    die("listen");
+  TLOG(TLOG_WARN, "listener recreated");
+  return true;
+}
+
+static void restore(const char *trigger) {
+  uint64_t start = clock_ns(CLOCK_MONOTONIC);
+  /* After a vmgenid change the kernel has reseeded its RNG; without one,
+   * getrandom() may repeat across clones, so mix in the wall clock too */
+  unsigned int seed = 0;
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+    seed = (unsigned int)getpid();
+  seed ^= (unsigned int)clock_ns(CLOCK_REALTIME);
+  g_seed = seed;
+  sm_reseed(g_sm_ctx, seed); /* no-op until the executor starts */
+  sched_reseed(seed * 2654435761u);
+  sm_cache_invalidate();
+  g_restore.listener_recreated = revalidate_listener();
+  g_restore.count++;
+  g_restore.trigger = trigger;
+  g_restore.hook_ns = clock_ns(CLOCK_MONOTONIC) - start;
+  TLOG_S(TLOG_INFO, "restore (%s) handled in %llu us", trigger,
+         g_restore.hook_ns / 1000);
+}
+
+static void restore_to_json(cJSON *obj) {
+  if (!obj)
+    return;
+  cJSON_AddNumberToObject(obj, "count", g_restore.count);
+  if (g_restore.trigger)
+    cJSON_AddStringToObject(obj, "trigger", g_restore.trigger);
+  cJSON_AddNumberToObject(obj, "hook_us", (double)(g_restore.hook_ns / 1000));
+  cJSON_AddBoolToObject(obj, "listener_recreated",
+                        g_restore.listener_recreated);
+  cJSON_AddNumberToObject(obj, "cache_epoch", sm_cache_epoch());
+}
+
+/* The vmgenid driver announces a new VM generation (restore or clone) with a
+ * NEW_VMGENID=1 uevent. Best effort: without the driver, or without access
+ * to the uevent multicast group, only the other triggers work. */
+static int open_uevent(void) {
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_KOBJECT_UEVENT);
+  if (fd == -1)
+    return -1;
+  struct sockaddr_nl nl = {.nl_family = AF_NETLINK, .nl_groups = 1};
+  if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) == -1) {
+    close(fd);
+    return -1;
   }
+  return fd;
+}
 
-  /* Fork off and turn into a daemon immediately */
-  daemonize();
+/* Drain pending uevents; true if one of them reported a new generation. */
+static bool vmgenid_changed(int fd) {
+  char buf[4096];
+  bool changed = false;
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+    buf[n] = '\0';
+    for (char *p = buf; p < buf + n; p += strlen(p) + 1)
+      if (strcmp(p, "NEW_VMGENID=1") == 0)
+        changed = true;
+  }
+  return changed;
+}
 
-  /* Start the persistent state machine thread */
-  g_sm_ctx = sm_thread_start();
+static void check_restore(void) {
+  if (!g_restore_signal)
+    return;
+  g_restore_signal = 0;
+  restore("signal");
+}
 
-  /* Set up AF_VSOCK listener */
-  int srv_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-  if (srv_fd == -1) {
-    /* Cannot log; write to syslog in a fuller implementation */
-    exit(EXIT_FAILURE);
+/* Wait until the listener is readable, handling vmgenid uevents meanwhile.
+ * Returns false if interrupted. */
+static bool wait_listener(void) {
+  struct pollfd pfd[2] = {{.fd = g_srv_fd, .events = POLLIN},
+                          {.fd = g_uevent_fd, .events = POLLIN}};
+  if (poll(pfd, 2, -1) == -1)
+    return false;
+  if ((pfd[1].revents & POLLIN) && vmgenid_changed(g_uevent_fd))
+    restore("vmgenid");
+  return pfd[0].revents != 0;
+}
+
+static uint32_t parse_id(const char *s) {
+  char *end = NULL;
+  unsigned long v = strtoul(s, &end, 10);
+  return (end == s || *end != '\0' || v > UINT32_MAX) ? 0 : (uint32_t)v;
+}
+
+/* Handle a control message sent in place of a recipe. req is the whole
+ * message, for commands that carry more than a string value. Returns the
+ * reply object, always carrying a "status" field. */
+static cJSON *handle_control(const proto_msg *m, const cJSON *req) {
+  cJSON *reply = cJSON_CreateObject();
+  if (!reply)
+    return NULL;
+  int status = 0;
+  if (strcmp(m->command, "stats") == 0) {
+    sm_job_stats job;
+    cJSON *stats = cJSON_AddObjectToObject(reply, "stats");
+    bool have_job = sm_get_job_stats(g_sm_ctx, &job);
+    cJSON *alloc = report_alloc_stats(have_job ? &job : NULL);
+    if (alloc)
+      cJSON_AddItemToObject(stats, "alloc", alloc);
+    startup_to_json(cJSON_AddObjectToObject(stats, "startup_us"));
+    restore_to_json(cJSON_AddObjectToObject(stats, "restore"));
+    memory_to_json(cJSON_AddObjectToObject(stats, "memory"));
+    cJSON *kv = cJSON_AddObjectToObject(stats, "kv");
+    cJSON_AddNumberToObject(kv, "entries", (double)kv_count());
+    cJSON *cg = cJSON_AddObjectToObject(stats, "cgroups");
+    cJSON_AddBoolToObject(cg, "enabled", cg_enabled());
+    cJSON_AddStringToObject(cg, "controllers", cg_controllers());
+  } else if (strcmp(m->command, "reset") == 0) {
+    /* A new episode: nothing from the previous one stays visible to
+     * recipes. Control commands run between jobs, so the worker is idle. */
+    if (g_sm_ctx)
+      sm_reset(g_sm_ctx);
+    kv_clear();
+    sup_kill_all();
+    fill_release_all();
+    fsmeta_restore_all();
+    cg_set_session(NULL);
+  } else if (strcmp(m->command, "limits") == 0) {
+    /* Session limits for every command until changed or reset */
+    cg_limits lim;
+    const cJSON *obj = cJSON_GetObjectItemCaseSensitive(req, "limits");
+    if (!proto_limits_from_json(obj, &lim) || !cg_set_session(&lim))
+      status = -1;
+  } else if (strcmp(m->command, "sched_add") == 0) {
+    const cJSON *spec = cJSON_GetObjectItemCaseSensitive(req, "schedule");
+    uint32_t id = sched_add(m->value, spec);
+    if (id)
+      cJSON_AddNumberToObject(reply, "id", id);
+    else
+      status = -1;
+  } else if (strcmp(m->command, "sched_remove") == 0) {
+    if (!sched_remove(parse_id(m->value)))
+      status = -1;
+  } else if (strcmp(m->command, "sched_drain") == 0) {
+    /* An empty value drains every schedule */
+    cJSON *all = sched_drain_json(m->value[0] ? parse_id(m->value) : 0);
+    if (all)
+      cJSON_AddItemToObject(reply, "schedules", all);
+    else
+      status = -1;
+  } else if (strcmp(m->command, "restore") == 0) {
+    restore("command");
+    restore_to_json(cJSON_AddObjectToObject(reply, "restore"));
+  } else if (strcmp(m->command, "log_level") == 0) {
+    /* An empty value only queries the current level */
+    tlog_level level;
+    if (m->value[0] != '\0') {
+      if (tlog_level_from_string(m->value, &level))
+        tlog_set_level(level);
+      else
+        status = -1;
+    }
+    cJSON_AddStringToObject(reply, "level", tlog_level_name(tlog_get_level()));
+  } else if (strcmp(m->command, "flight") == 0) {
+    cJSON *dump = fr_dump_json();
+    cJSON *arr = dump ? cJSON_DetachItemFromObjectCaseSensitive(dump, "flight")
+                      : NULL;
+    if (arr)
+      cJSON_AddItemToObject(reply, "flight", arr);
+    cJSON_Delete(dump);
+  } else {
+    status = -1;
   }
+  cJSON_AddNumberToObject(reply, "status", status);
+  return reply;
+}
 
-  struct sockaddr_vm sa = {0};
-  sa.svm_family = AF_VSOCK;
-  sa.svm_port = port;
-  sa.svm_cid = VMADDR_CID_ANY; /* Listen on our own CID */
+static void check_flight_dump(void) {
+  if (!g_dump_flight)
+    return;
+  g_dump_flight = 0;
+  if (fr_dump_file(FR_DUMP_PATH))
+    TLOG_S(TLOG_INFO, "flight recorder dumped to %s", FR_DUMP_PATH);
+  else
+    TLOG_S(TLOG_WARN, "flight recorder dump to %s failed", FR_DUMP_PATH);
+}
 
-  if (bind(srv_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
-    close(srv_fd);
-    exit(EXIT_FAILURE);
+/* Run a recipe to completion and free it. Returns the JSON text of the
+ * reports followed by a final {"status":0}, or NULL if the job could not be
+ * submitted. */
+static char *run_recipe(sm_instr *recipe, sm_job_stats *st, int *ret) {
+  sm_buf resp = {0};
+  sm_buf_append(&resp, "[", 1);
+  sm_set_report_cb(g_sm_ctx, proto_buf_collect_cb, &resp);
+  if (!sm_submit(g_sm_ctx, recipe)) {
+    TLOG(TLOG_ERROR, "sm_submit failed");
+    sm_set_report_cb(g_sm_ctx, NULL, NULL);
+    proto_free_recipe(recipe);
+    sm_free(resp.data);
+    return NULL;
+  }
+  sm_wait(g_sm_ctx, ret);
+  /* Registers hold copies, nothing refers to the recipe any more */
+  proto_free_recipe(recipe);
+  sm_set_report_cb(g_sm_ctx, NULL, NULL);
+  sm_get_job_stats(g_sm_ctx, st);
+  TLOG(TLOG_DEBUG, "job done: ret %lld, %llu us, %llu allocs, peak %llu",
+       *ret, st->duration_ns / 1000, st->alloc.allocs, st->alloc.peak);
+  char *done = report_status(0);
+  if (done) {
+    proto_buf_collect_cb(done, &resp);
+    sm_free(done);
+  }
+  sm_buf_append(&resp, "]", 1);
+  if (resp.failed) {
+    sm_free(resp.data);
+    return NULL;
   }
+  return resp.data;
+}
 
-  if (listen(srv_fd, 32) == -1) {
-    close(srv_fd);
-    exit(EXIT_FAILURE);
+/* Serve one request of a session: a recipe array or a control object,
+ * either bare or wrapped as {"id": N, "recipe": [...]} /
+ * {"id": N, "command": ..., "value": ...}. The reply is the bare result, or
+ * {"id": N, "result": ...} when the request carried an id. Every frame gets
+ * exactly one reply so pipelined requests stay in step. */
+static void serve_frame(int fd, const char *frame) {
+  size_t len = strlen(frame);
+  uint64_t hash = XXH64(frame, len, 0);
+  cJSON *req = cJSON_Parse(frame);
+  cJSON *id = NULL;
+  const cJSON *body = req;
+  if (cJSON_IsObject(req)) {
+    id = cJSON_GetObjectItemCaseSensitive(req, "id");
+    cJSON *r = cJSON_GetObjectItemCaseSensitive(req, "recipe");
+    if (r)
+      body = r;
   }
 
-  /* Simple service loop */
+  /* A recipe result is reply text; a control result is a cJSON object */
+  char *text = NULL;
+  cJSON *result = NULL;
+  sm_job_stats st;
+  int ret = -1;
+  bool is_control = false;
+  proto_msg ctl;
+  if (cJSON_IsArray(body)) {
+    sm_instr *recipe = proto_recipe_from_json(body);
+    if (recipe)
+      text = run_recipe(recipe, &st, &ret);
+  } else if (proto_msg_from_json(body, &ctl)) {
+    TLOG_S(TLOG_INFO, "control command %s", ctl.command);
+    result = handle_control(&ctl, body);
+    is_control = true;
+  }
+  bool ran = text != NULL;
+  if (!text && !result) {
+    TLOG(TLOG_WARN, "unusable request in session");
+    result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "status", -1);
+  }
+
+  char *out;
+  if (cJSON_IsNumber(id)) {
+    cJSON *reply = cJSON_CreateObject();
+    cJSON_AddNumberToObject(reply, "id", id->valuedouble);
+    if (text)
+      cJSON_AddRawToObject(reply, "result", text);
+    else
+      cJSON_AddItemToObject(reply, "result", result);
+    out = cJSON_PrintUnformatted(reply);
+    cJSON_Delete(reply);
+    sm_free(text);
+  } else if (text) {
+    out = text;
+  } else {
+    out = cJSON_PrintUnformatted(result);
+    cJSON_Delete(result);
+  }
+  size_t out_len = out ? strlen(out) + 1 : 0;
+  proto_send_frame(fd, out);
+  sm_free(out);
+  cJSON_Delete(req);
+  if (!is_control)
+    fr_record(hash, (uint32_t)len, ran ? &st : NULL, ret, (uint32_t)out_len);
+}
+
+/* Protocol v2: keep the connection open and answer NUL-terminated requests
+ * in order until the host closes it. Requests may be pipelined; they are
+ * queued by the socket while the previous one executes. */
+static void serve_session(int fd) {
+  proto_reader rd = {0};
   for (;;) {
-    int client_fd = accept(srv_fd, NULL, NULL);
+    char *frame;
+    while ((frame = proto_reader_next(&rd)) != NULL)
+      serve_frame(fd, frame);
+    after_job();
+    ssize_t n = proto_reader_fill(&rd, fd);
+    if (n < 0 && errno == EINTR && !g_stop) {
+      check_flight_dump();
+      check_restore();
+      continue;
+    }
+    if (n <= 0)
+      break;
+  }
+  proto_reader_free(&rd);
+}
+
+/* Ready frame: the listen address and the startup breakdown. boot_us is
+ * CLOCK_BOOTTIME, i.e. time since the guest kernel started. */
+static char *ready_frame(const char *listen_desc) {
+  cJSON *root = cJSON_CreateObject();
+  if (!root)
+    return NULL;
+  cJSON_AddStringToObject(root, "ready", listen_desc);
+  cJSON_AddNumberToObject(root, "pid", getpid());
+  startup_to_json(cJSON_AddObjectToObject(root, "startup_us"));
+  cJSON_AddNumberToObject(root, "boot_us",
+                          (double)(clock_ns(CLOCK_BOOTTIME) / 1000));
+  char *out = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  return out;
+}
+
+/* Tell the host we are accepting connections, so it need not poll connect().
+ * Either target is best effort: a failure is logged and startup continues. */
+static void notify_ready(const transport_addr *notify, const char *console,
+                         const char *listen_desc) {
+  char *frame = ready_frame(listen_desc);
+  if (!frame)
+    return;
+  if (notify) {
+    int fd = transport_connect(notify);
+    if (fd == -1 || !proto_send_frame(fd, frame))
+      TLOG(TLOG_WARN, "ready notification failed: errno %lld", errno);
+    if (fd != -1)
+      close(fd);
+  }
+  if (console) {
+    int fd = open(console, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1 || dprintf(fd, "TASKD_READY %s\n", frame) < 0)
+      TLOG_S(TLOG_WARN, "ready marker to %s failed", console);
+    if (fd != -1)
+      close(fd);
+  }
+  sm_free(frame);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--foreground] [--low-footprint] [--no-cgroups]\n"
+          "          [--notify ADDR] [--ready-console PATH] LISTEN\n"
+          "LISTEN and ADDR are <vsock-port>, vsock:[CID:]PORT, unix:<path> "
+          "or tcp:<port>\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  g_startup.main = clock_ns(CLOCK_MONOTONIC);
+  transport_addr notify_addr;
+  bool notify = false;
+  const char *ready_console = NULL;
+  static const struct option opts[] = {
+      {"notify", required_argument, NULL, 'n'},
+      {"ready-console", required_argument, NULL, 'c'},
+      {"foreground", no_argument, NULL, 'f'},
+      {"low-footprint", no_argument, NULL, 'l'},
+      {"no-cgroups", no_argument, NULL, 'g'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:c:flgh", opts, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      if (!transport_parse(optarg, &notify_addr)) {
+        fprintf(stderr, "Invalid notify address\n");
+        return EXIT_FAILURE;
+      }
+      notify = true;
+      break;
+    case 'c':
+      ready_console = optarg;
+      break;
+    case 'f':
+      g_foreground = true;
+      break;
+    case 'l':
+      g_low_footprint = true;
+      break;
+    case 'g':
+      g_cgroups = false;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!transport_parse(argv[optind], &g_listen_addr)) {
+    fprintf(stderr, "Invalid listen address\n");
+    return EXIT_FAILURE;
+  }
+  if (g_low_footprint)
+    enter_low_footprint();
+
+  /* Fork off and turn into a daemon immediately. In foreground mode (PID 1
+   * or under an init stub that supervises us) skip the forks and keep the
+   * inherited stdio. */
+  if (g_foreground) {
+    umask(0);
+    if (chdir("/") == -1)
+      perror("chdir");
+  } else {
+    daemonize();
+  }
+  g_startup.daemonized = clock_ns(CLOCK_MONOTONIC);
+  sm_alloc_init();
+  /* Logging is best effort; without a log file records are not collected */
+  tlog_start(TASKD_LOG_PATH);
+  g_startup.logging = clock_ns(CLOCK_MONOTONIC);
+
+  /* Start the persistent state machine thread; fast-start mode defers it
+   * until the first connection so nothing but listen() precedes readiness */
+  if (!g_foreground)
+    ensure_worker();
+  g_startup.worker = clock_ns(CLOCK_MONOTONIC);
+
+  /* Set up the listener; for vsock this binds our own CID */
+  g_srv_fd = transport_listen(&g_listen_addr, 32);
+  if (g_srv_fd == -1)
+    die("listen");
+  g_startup.listening = clock_ns(CLOCK_MONOTONIC);
+  char addr_desc[128];
+  transport_describe(&g_listen_addr, addr_desc, sizeof(addr_desc));
+  TLOG_S(TLOG_INFO, "listening on %s", addr_desc);
+  TLOG(TLOG_INFO, "exec to listen %llu us",
+       (g_startup.listening - g_startup.exec) / 1000);
+  if (notify || ready_console)
+    notify_ready(notify ? &notify_addr : NULL, ready_console, addr_desc);
+  g_mem.idle_kb = proc_status_kb("VmRSS");
+  /* Off the readiness path; the first connection waits for this thread
+   * anyway, so no command runs before the groups exist */
+  if (g_cgroups)
+    cg_init();
+
+  /* No SA_RESTART so a blocked accept() returns and the dump happens at once */
+  struct sigaction sa_usr1 = {0};
+  sa_usr1.sa_handler = on_sigusr1;
+  sigemptyset(&sa_usr1.sa_mask);
+  sigaction(SIGUSR1, &sa_usr1, NULL);
+  struct sigaction sa_term = {0};
+  sa_term.sa_handler = on_sigterm;
+  sigemptyset(&sa_term.sa_mask);
+  sigaction(SIGTERM, &sa_term, NULL);
+  struct sigaction sa_usr2 = {0};
+  sa_usr2.sa_handler = on_sigusr2;
+  sigemptyset(&sa_usr2.sa_mask);
+  sigaction(SIGUSR2, &sa_usr2, NULL);
+  g_uevent_fd = open_uevent();
+
+  /* Simple service loop */
+  while (!g_stop) {
+    check_flight_dump();
+    check_restore();
+    if (g_uevent_fd != -1 && !wait_listener())
+      continue;
+    int client_fd = transport_accept(&g_listen_addr, g_srv_fd);
     if (client_fd == -1) {
-      if (errno == EINTR)
+      if (errno == EINTR || errno == EAGAIN)
         continue;
-      /* Permanent failure – just restart loop; could also exit */
+      /* Transient failures (EMFILE, ECONNABORTED) just restart the loop; a
+       * listener that stopped accepting is replaced */
+      TLOG(TLOG_WARN, "accept failed: errno %lld", errno);
+      revalidate_listener();
       continue;
     }
+    ensure_worker();
 
     /* First message must be a handshake */
     char *msg = proto_recv_json(client_fd);
     int status_code = -1;
     bool handshake_ok = false;
+    handshake_msg hs = {0};
     if (msg) {
-      handshake_msg hs;
       handshake_ok = parse_handshake(msg, &hs);
-      free(msg);
+      sm_free(msg);
       status_code = handshake_ok ? 0 : -1;
     }
     char *status_msg = report_status(status_code);
@@ -159,58 +783,69 @@ int main(int argc, char *argv[]) {
       char final_msg[128];  // plenty for small JSON messages
       snprintf(final_msg, sizeof(final_msg), "%s%c", status_msg, '\0');
       send(client_fd, final_msg, strlen(final_msg) + 1, MSG_NOSIGNAL); // +1 to send the null
-      free(status_msg);
+      sm_free(status_msg);
     }
     if (!handshake_ok) {
+      TLOG(TLOG_WARN, "handshake rejected");
+      close(client_fd);
+      connection_closed();
+      continue;
+    }
+    if (hs.version >= PROTO_VERSION_SESSION) {
+      serve_session(client_fd);
       close(client_fd);
+      connection_closed();
       continue;
     }
 
     /* Wait for recipe */
     msg = proto_recv_json(client_fd);
     if (msg) {
+      size_t msg_len = strlen(msg);
+      uint64_t msg_hash = XXH64(msg, msg_len, 0);
       sm_instr *recipe = proto_parse_recipe(msg);
       if (recipe) {
-        cJSON *resp = cJSON_CreateArray();
-        sm_set_report_cb(g_sm_ctx, report_collect_cb, resp);
-        if (!sm_submit(g_sm_ctx, recipe)) {
-          free(msg);
-          sm_set_report_cb(g_sm_ctx, NULL, NULL);
-          cJSON_Delete(resp);
-          close(client_fd);
-          continue;
-        }
-        free(msg);
+        sm_free(msg);
+        sm_job_stats st;
         int ret = 0;
-        sm_wait(g_sm_ctx, &ret);
-        sm_set_report_cb(g_sm_ctx, NULL, NULL);
-        char *done = report_status(0);
-        if (done) {
-          cJSON *obj = cJSON_Parse(done);
-          if (obj)
-            cJSON_AddItemToArray(resp, obj);
-          free(done);
-        }
-        char *out = cJSON_PrintUnformatted(resp);
+        char *out = run_recipe(recipe, &st, &ret);
         if (out) {
-          size_t len = strlen(out);
-          char *tmp = realloc(out, len + 1);
-          if (tmp) {
-            out = tmp;
-            out[len] = '\0';
-            len += 1;
-          }
-          send(client_fd, out, len, MSG_NOSIGNAL);
-          free(out);
+          size_t len = strlen(out) + 1;
+          proto_send_frame(client_fd, out);
+          sm_free(out);
+          fr_record(msg_hash, (uint32_t)msg_len, &st, ret, (uint32_t)len);
         }
-        cJSON_Delete(resp);
       } else {
-        free(msg);
+        proto_msg ctl;
+        cJSON *req = cJSON_Parse(msg);
+        if (proto_msg_from_json(req, &ctl)) {
+          TLOG_S(TLOG_INFO, "control command %s", ctl.command);
+          cJSON *reply = handle_control(&ctl, req);
+          char *out = reply ? cJSON_PrintUnformatted(reply) : NULL;
+          proto_send_frame(client_fd, out);
+          sm_free(out);
+          cJSON_Delete(reply);
+        } else {
+          TLOG(TLOG_WARN, "unrecognised message after handshake");
+          fr_record(msg_hash, (uint32_t)msg_len, NULL, -1, 0);
+        }
+        cJSON_Delete(req);
+        sm_free(msg);
       }
     }
     close(client_fd);
+    connection_closed();
   }
 
-  /* never reached */
+  TLOG(TLOG_INFO, "stopping on SIGTERM");
+  close(g_srv_fd);
+  if (g_listen_addr.kind == TRANSPORT_UNIX)
+    unlink(g_listen_addr.path);
+  sched_stop();
+  sup_stop();
+  fill_release_all();
+  if (g_sm_ctx)
+    sm_thread_stop(g_sm_ctx);
+  tlog_stop();
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include "taskd_client.h"
+// clang-format off
+#include <sys/socket.h>
+#include "protocol.h"
+// clang-format on
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TDC_HELLO "{\"hello\":\"taskd_client\",\"version\":2}"
+
+typedef struct tdc_request {
+  uint64_t id;
+  tdc_reply_cb cb; /* NULL once the caller stopped waiting */
+  void *ud;
+  struct tdc_request *next;
+} tdc_request;
+
+typedef enum {
+  TDC_CONNECTING,
+  TDC_HANDSHAKE, /* hello sent, waiting for its status reply */
+  TDC_READY,
+  TDC_FAILED,
+} tdc_state;
+
+struct tdc_session {
+  tdc_pool *pool;
+  int fd;
+  tdc_state state;
+  bool closed;
+  uint32_t events; /* currently registered with epoll */
+  void *user;
+  proto_reader rd;
+  char *out; /* frames not yet written, flushed once READY */
+  size_t out_off, out_len, out_cap;
+  tdc_request *head, *tail; /* awaiting a reply, in send order */
+  size_t pending;
+  uint64_t next_id;
+  struct tdc_session *prev, *next;
+};
+
+struct tdc_pool {
+  int ep;
+  tdc_session *sessions;
+  tdc_session *graveyard; /* closed while dispatching, freed afterwards */
+  int dispatching;
+  size_t pending;
+};
+
+tdc_pool *tdc_pool_create(void) {
+  tdc_pool *p = sm_calloc(1, sizeof(*p));
+  if (!p)
+    return NULL;
+  p->ep = epoll_create1(EPOLL_CLOEXEC);
+  if (p->ep == -1) {
+    sm_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+int tdc_pool_fd(const tdc_pool *p) { return p ? p->ep : -1; }
+
+size_t tdc_pool_pending(const tdc_pool *p) { return p ? p->pending : 0; }
+
+static void update_events(tdc_session *s) {
+  if (s->fd == -1)
+    return;
+  uint32_t want = EPOLLIN;
+  if (s->state == TDC_CONNECTING ||
+      (s->state == TDC_READY && s->out_off < s->out_len))
+    want |= EPOLLOUT;
+  if (want == s->events)
+    return;
+  struct epoll_event ev = {.events = want, .data.ptr = s};
+  if (epoll_ctl(s->pool->ep, EPOLL_CTL_MOD, s->fd, &ev) == 0)
+    s->events = want;
+}
+
+/* Drop the connection and fail every outstanding request. Callbacks may
+ * close this or other sessions, so requests are unlinked one at a time. */
+static void fail_session(tdc_session *s) {
+  if (s->fd != -1) {
+    epoll_ctl(s->pool->ep, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+  }
+  s->state = TDC_FAILED;
+  s->out_off = s->out_len = 0;
+  while (s->head) {
+    tdc_request *r = s->head;
+    s->head = r->next;
+    if (!s->head)
+      s->tail = NULL;
+    s->pending--;
+    s->pool->pending--;
+    if (r->cb)
+      r->cb(s, r->id, NULL, r->ud);
+    sm_free(r);
+  }
+}
+
+static void free_session(tdc_session *s) {
+  proto_reader_free(&s->rd);
+  sm_free(s->out);
+  sm_free(s);
+}
+
+tdc_session *tdc_open(tdc_pool *p, const transport_addr *addr, void *user) {
+  if (!p || !addr)
+    return NULL;
+  tdc_session *s = sm_calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  s->pool = p;
+  s->user = user;
+  s->next_id = 1;
+  s->fd = transport_connect_async(addr);
+  if (s->fd == -1) {
+    sm_free(s);
+    return NULL;
+  }
+  s->events = EPOLLIN | EPOLLOUT;
+  struct epoll_event ev = {.events = s->events, .data.ptr = s};
+  if (epoll_ctl(p->ep, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+    close(s->fd);
+    sm_free(s);
+    return NULL;
+  }
+  s->next = p->sessions;
+  if (p->sessions)
+    p->sessions->prev = s;
+  p->sessions = s;
+  return s;
+}
+
+void tdc_close(tdc_session *s) {
+  if (!s || s->closed)
+    return;
+  s->closed = true;
+  fail_session(s);
+  tdc_pool *p = s->pool;
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    p->sessions = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  if (p->dispatching) {
+    s->next = p->graveyard;
+    p->graveyard = s;
+  } else {
+    free_session(s);
+  }
+}
+
+void tdc_pool_destroy(tdc_pool *p) {
+  if (!p)
+    return;
+  while (p->sessions)
+    tdc_close(p->sessions);
+  close(p->ep);
+  sm_free(p);
+}
+
+bool tdc_session_ok(const tdc_session *s) {
+  return s && s->state != TDC_FAILED;
+}
+
+bool tdc_session_ready(const tdc_session *s) {
+  return s && s->state == TDC_READY;
+}
+
+void *tdc_session_user(const tdc_session *s) { return s ? s->user : NULL; }
+
+size_t tdc_session_pending(const tdc_session *s) {
+  return s ? s->pending : 0;
+}
+
+static void flush_out(tdc_session *s) {
+  while (s->out_off < s->out_len) {
+    ssize_t n = send(s->fd, s->out + s->out_off, s->out_len - s->out_off,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      fail_session(s);
+      return;
+    }
+    s->out_off += (size_t)n;
+  }
+  if (s->out_off == s->out_len)
+    s->out_off = s->out_len = 0;
+  update_events(s);
+}
+
+static bool append_out(tdc_session *s, const char *data, size_t len) {
+  if (s->out_len + len > s->out_cap) {
+    size_t cap = s->out_cap ? s->out_cap : 4096;
+    while (cap < s->out_len + len)
+      cap *= 2;
+    char *tmp = sm_realloc(s->out, cap);
+    if (!tmp)
+      return false;
+    s->out = tmp;
+    s->out_cap = cap;
+  }
+  memcpy(s->out + s->out_len, data, len);
+  s->out_len += len;
+  return true;
+}
+
+/* Queue a complete frame (including its NUL) as request id. */
+static bool queue_request(tdc_session *s, uint64_t id, const char *frame,
+                          size_t len, tdc_reply_cb cb, void *ud) {
+  tdc_request *r = sm_malloc(sizeof(*r));
+  if (!r)
+    return false;
+  if (!append_out(s, frame, len)) {
+    sm_free(r);
+    return false;
+  }
+  r->id = id;
+  r->cb = cb;
+  r->ud = ud;
+  r->next = NULL;
+  if (s->tail)
+    s->tail->next = r;
+  else
+    s->head = r;
+  s->tail = r;
+  s->pending++;
+  s->pool->pending++;
+  if (s->state == TDC_READY)
+    flush_out(s);
+  return true;
+}
+
+bool tdc_submit(tdc_session *s, const char *recipe_json, tdc_reply_cb cb,
+                void *ud, uint64_t *id) {
+  if (!s || s->closed || s->state == TDC_FAILED || !recipe_json)
+    return false;
+  /* It is pasted into the frame as is: reject it here rather than send a
+   * frame taskd cannot parse */
+  cJSON *check = cJSON_Parse(recipe_json);
+  bool valid = cJSON_IsArray(check);
+  cJSON_Delete(check);
+  if (!valid)
+    return false;
+  char prefix[48];
+  uint64_t rid = s->next_id++;
+  int plen = snprintf(prefix, sizeof(prefix), "{\"id\":%llu,\"recipe\":",
+                      (unsigned long long)rid);
+  size_t rlen = strlen(recipe_json);
+  size_t len = (size_t)plen + rlen + 2;
+  char *frame = sm_malloc(len);
+  if (!frame)
+    return false;
+  memcpy(frame, prefix, (size_t)plen);
+  memcpy(frame + plen, recipe_json, rlen);
+  frame[len - 2] = '}';
+  frame[len - 1] = '\0';
+  bool ok = queue_request(s, rid, frame, len, cb, ud);
+  sm_free(frame);
+  if (ok && id)
+    *id = rid;
+  return ok;
+}
+
+bool tdc_control(tdc_session *s, const char *command, const char *value,
+                 tdc_reply_cb cb, void *ud, uint64_t *id) {
+  if (!s || s->closed || s->state == TDC_FAILED || !command)
+    return false;
+  uint64_t rid = s->next_id++;
+  cJSON *req = cJSON_CreateObject();
+  if (!req)
+    return false;
+  cJSON_AddNumberToObject(req, "id", (double)rid);
+  cJSON_AddStringToObject(req, "command", command);
+  cJSON_AddStringToObject(req, "value", value ? value : "");
+  char *frame = cJSON_PrintUnformatted(req);
+  cJSON_Delete(req);
+  if (!frame)
+    return false;
+  bool ok = queue_request(s, rid, frame, strlen(frame) + 1, cb, ud);
+  sm_free(frame);
+  if (ok && id)
+    *id = rid;
+  return ok;
+}
+
+/* Handle one reply frame. Returns the number of callbacks run. */
+static int handle_frame(tdc_session *s, const char *frame) {
+  cJSON *root = cJSON_Parse(frame);
+  if (s->state == TDC_HANDSHAKE) {
+    const cJSON *st = cJSON_GetObjectItemCaseSensitive(root, "status");
+    bool ok = cJSON_IsNumber(st) && st->valueint == 0;
+    cJSON_Delete(root);
+    if (!ok) {
+      fail_session(s);
+      return 0;
+    }
+    s->state = TDC_READY;
+    flush_out(s);
+    return 0;
+  }
+  /* Replies come back in order, so one without an id (taskd could not
+   * parse the frame far enough to find it) answers the oldest request. */
+  const cJSON *jid = cJSON_GetObjectItemCaseSensitive(root, "id");
+  uint64_t id = cJSON_IsNumber(jid) ? (uint64_t)jid->valuedouble
+                                    : (s->head ? s->head->id : 0);
+  tdc_request *prev = NULL, *r = s->head;
+  while (r && r->id != id) {
+    prev = r;
+    r = r->next;
+  }
+  if (!r) {
+    cJSON_Delete(root);
+    return 0;
+  }
+  if (prev)
+    prev->next = r->next;
+  else
+    s->head = r->next;
+  if (s->tail == r)
+    s->tail = prev;
+  s->pending--;
+  s->pool->pending--;
+  int ran = 0;
+  if (r->cb) {
+    r->cb(s, id, cJSON_GetObjectItemCaseSensitive(root, "result"), r->ud);
+    ran = 1;
+  }
+  sm_free(r);
+  cJSON_Delete(root);
+  return ran;
+}
+
+static int handle_readable(tdc_session *s) {
+  int ran = 0;
+  for (;;) {
+    ssize_t n = proto_reader_fill(&s->rd, s->fd);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return ran;
+    if (n <= 0) {
+      fail_session(s);
+      return ran;
+    }
+    char *frame;
+    while ((frame = proto_reader_next(&s->rd)) != NULL) {
+      ran += handle_frame(s, frame);
+      if (s->closed || s->state == TDC_FAILED)
+        return ran;
+    }
+  }
+}
+
+static void handle_connected(tdc_session *s) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+    fail_session(s);
+    return;
+  }
+  /* The daemon reads the hello with a single recv(), so nothing else may be
+   * sent until its reply arrives. */
+  ssize_t n = send(s->fd, TDC_HELLO, sizeof(TDC_HELLO), MSG_NOSIGNAL);
+  if (n != (ssize_t)sizeof(TDC_HELLO)) {
+    fail_session(s);
+    return;
+  }
+  s->state = TDC_HANDSHAKE;
+  update_events(s);
+}
+
+int tdc_pool_poll(tdc_pool *p, int timeout_ms) {
+  if (!p)
+    return -1;
+  struct epoll_event evs[64];
+  int n = epoll_wait(p->ep, evs, 64, timeout_ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+  int ran = 0;
+  p->dispatching++;
+  for (int i = 0; i < n; ++i) {
+    tdc_session *s = evs[i].data.ptr;
+    uint32_t e = evs[i].events;
+    if (s->closed || s->state == TDC_FAILED)
+      continue;
+    if (s->state == TDC_CONNECTING) {
+      handle_connected(s);
+      continue;
+    }
+    if (e & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      ran += handle_readable(s);
+    if ((e & EPOLLOUT) && !s->closed && s->state == TDC_READY)
+      flush_out(s);
+  }
+  if (--p->dispatching == 0) {
+    while (p->graveyard) {
+      tdc_session *s = p->graveyard;
+      p->graveyard = s->next;
+      free_session(s);
+    }
+  }
+  return ran;
+}
+
+typedef struct {
+  bool done;
+  cJSON *result;
+} call_state;
+
+static void call_cb(tdc_session *s, uint64_t id, const cJSON *result,
+                    void *ud) {
+  (void)s;
+  (void)id;
+  call_state *c = ud;
+  c->done = true;
+  c->result = result ? cJSON_Duplicate(result, 1) : NULL;
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+cJSON *tdc_call(tdc_session *s, const char *recipe_json, int timeout_ms) {
+  call_state c = {0};
+  uint64_t id;
+  if (!tdc_submit(s, recipe_json, call_cb, &c, &id))
+    return NULL;
+  tdc_pool *p = s->pool;
+  uint64_t deadline = now_ms() + (uint64_t)(timeout_ms < 0 ? 0 : timeout_ms);
+  while (!c.done) {
+    int wait = -1;
+    if (timeout_ms >= 0) {
+      uint64_t now = now_ms();
+      if (now >= deadline)
+        break;
+      wait = (int)(deadline - now);
+    }
+    if (tdc_pool_poll(p, wait) < 0)
+      break;
+  }
+  if (!c.done) {
+    /* The session is still alive (closing it would have run call_cb), so
+     * the request can be detached from our stack frame. */
+    for (tdc_request *r = s->head; r; r = r->next)
+      if (r->id == id)
+        r->cb = NULL;
+  }
+  return c.result;
+}
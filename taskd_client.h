@@ -0,0 +1,76 @@
+#ifndef TASKD_CLIENT_H
+#define TASKD_CLIENT_H
+
+#include "transport.h"
+#include <cJSON.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Host-side client for taskd (libtaskd_client).
+ *
+ * A pool owns one epoll instance and any number of sessions, normally one
+ * per guest. Sessions connect and perform the protocol v2 handshake without
+ * blocking; requests submitted before the handshake completes are queued.
+ * Every request carries an id and may be pipelined behind others on the
+ * same session; replies are matched by id and handed to the request's
+ * callback from tdc_pool_poll().
+ *
+ * The library is single threaded: call everything from the polling thread.
+ * tdc_pool_fd() can be added to an outer event loop; call tdc_pool_poll()
+ * with a zero timeout when it becomes readable.
+ */
+typedef struct tdc_pool tdc_pool;
+typedef struct tdc_session tdc_session;
+
+/* result is the reply body: the report array of a recipe, ending in
+ * {"status": 0}, or the reply object of a control command. It is NULL when
+ * the session failed before the reply arrived. result is owned by the
+ * library and only valid during the call. */
+typedef void (*tdc_reply_cb)(tdc_session *s, uint64_t id, const cJSON *result,
+                             void *ud);
+
+tdc_pool *tdc_pool_create(void);
+/* Close every session; their pending callbacks run with a NULL result. */
+void tdc_pool_destroy(tdc_pool *p);
+int tdc_pool_fd(const tdc_pool *p);
+/* Wait up to timeout_ms (-1 forever) for I/O and dispatch replies. Returns
+ * the number of callbacks run, or -1 on error. */
+int tdc_pool_poll(tdc_pool *p, int timeout_ms);
+/* Requests sent or queued and not yet answered, over all sessions. */
+size_t tdc_pool_pending(const tdc_pool *p);
+
+/* Start a session to addr. Returns NULL only if no socket could be created;
+ * later connection failures are reported through tdc_session_ok(). */
+tdc_session *tdc_open(tdc_pool *p, const transport_addr *addr, void *user);
+/* Close a session. Pending callbacks run with a NULL result. Safe to call
+ * from a callback. */
+void tdc_close(tdc_session *s);
+bool tdc_session_ok(const tdc_session *s);
+bool tdc_session_ready(const tdc_session *s);
+void *tdc_session_user(const tdc_session *s);
+size_t tdc_session_pending(const tdc_session *s);
+
+/* Queue a recipe (a JSON array, sent verbatim; anything else is refused)
+ * or a control command. The request id is stored in *id when id is
+ * non-NULL. */
+bool tdc_submit(tdc_session *s, const char *recipe_json, tdc_reply_cb cb,
+                void *ud, uint64_t *id);
+bool tdc_control(tdc_session *s, const char *command, const char *value,
+                 tdc_reply_cb cb, void *ud, uint64_t *id);
+
+/* Submit a recipe and poll the pool until its reply arrives or timeout_ms
+ * passes. Other sessions keep being served meanwhile. Returns a copy of the
+ * result for the caller to cJSON_Delete(), or NULL. */
+cJSON *tdc_call(tdc_session *s, const char *recipe_json, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TASKD_CLIENT_H */
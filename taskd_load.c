@@ -0,0 +1,488 @@
+/*
+ * taskd_load.c
+ *
+ * Load generator standing in for a fleet of host clients. Each of
+ * --concurrency threads plays one client: it connects to a taskd instance
+ * (threads are spread round-robin over the --target addresses), performs
+ * the handshake, sends a recipe, waits for the reply and disconnects, just
+ * like the host script does per VM.
+ *
+ * Closed loop (default): every thread issues its next request as soon as
+ * the previous one finished; latency is measured from connect to reply.
+ *
+ * Open loop (--rate R): request k is scheduled at start + k/R seconds and
+ * picked up by the next idle thread; latency is measured from the scheduled
+ * time, so a daemon that falls behind shows up as queueing delay instead of
+ * silently lowering the offered load. --concurrency bounds the number of
+ * requests in flight.
+ *
+ * Pipelined (--pipeline D): one protocol v2 session per target, driven from
+ * a single thread through libtaskd_client, each keeping D requests in
+ * flight. Latency is measured from submission to reply; --concurrency and
+ * --rate do not apply.
+ *
+ * Usage:
+ *   taskd_load --target unix:/tmp/taskd.sock --concurrency 256 \
+ *              --duration 30 recipes/
+ *   taskd_load --target tcp:7000 --target tcp:7001 --rate 500 recipe.json
+ *   taskd_load --target tcp:7000 --target tcp:7001 --pipeline 8 recipe.json
+ *
+ * The summary is printed to stdout as JSON.
+ */
+#define _GNU_SOURCE
+// clang-format off
+#include <sys/socket.h>
+#include "bench_util.h"
+#include "fs_utils.h"
+#include "protocol.h"
+#include "taskd_client.h"
+#include "transport.h"
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+// clang-format on
+
+#define LOAD_MAX_TARGETS 64
+
+typedef enum {
+  LOAD_OK,
+  LOAD_ERR_CONNECT,
+  LOAD_ERR_HANDSHAKE,
+  LOAD_ERR_IO,
+  LOAD_ERR_STATUS,
+  LOAD_RESULT_COUNT,
+} load_result;
+
+static const char *result_names[LOAD_RESULT_COUNT] = {
+    "ok", "connect", "handshake", "io", "status",
+};
+
+typedef struct {
+  transport_addr targets[LOAD_MAX_TARGETS];
+  int target_count;
+  char **recipes;
+  size_t recipe_count;
+  int concurrency;
+  double rate;      /* requests per second, 0 for closed loop */
+  int pipeline;     /* requests in flight per v2 session, 0 for v1 clients */
+  double duration;  /* seconds */
+  uint64_t max_requests; /* 0 for no limit */
+  int timeout_ms;
+  uint64_t start_ns;
+  _Atomic uint64_t next_request;
+} load_cfg;
+
+typedef struct {
+  load_cfg *cfg;
+  int index;
+  uint64_t *samples; /* latency of successful requests, ns */
+  size_t sample_count;
+  size_t sample_cap;
+  uint64_t counts[LOAD_RESULT_COUNT];
+} load_worker;
+
+static bool add_recipe(load_cfg *cfg, const char *path) {
+  char *json = fs_read(path);
+  if (!json) {
+    perror(path);
+    return false;
+  }
+  /* Pipelined sessions refuse anything but an array (tdc_submit) */
+  cJSON *check = cJSON_Parse(json);
+  bool valid = cJSON_IsArray(check);
+  cJSON_Delete(check);
+  if (!valid) {
+    fprintf(stderr, "%s: not a JSON recipe array\n", path);
+    sm_free(json);
+    return false;
+  }
+  char **r = sm_realloc(cfg->recipes, (cfg->recipe_count + 1) * sizeof(*r));
+  if (!r) {
+    sm_free(json);
+    return false;
+  }
+  cfg->recipes = r;
+  cfg->recipes[cfg->recipe_count++] = json;
+  return true;
+}
+
+static int json_filter(const struct dirent *d) {
+  size_t n = strlen(d->d_name);
+  return d->d_name[0] != '.' && n > 5 &&
+         strcmp(d->d_name + n - 5, ".json") == 0;
+}
+
+static bool add_path(load_cfg *cfg, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode))
+    return add_recipe(cfg, path);
+  struct dirent **list;
+  int n = scandir(path, &list, json_filter, alphasort);
+  if (n < 0) {
+    perror(path);
+    return false;
+  }
+  bool ok = true;
+  for (int i = 0; i < n; ++i) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s/%s", path, list[i]->d_name);
+    if (ok && !add_recipe(cfg, full))
+      ok = false;
+    free(list[i]);
+  }
+  free(list);
+  return ok;
+}
+
+/* Status of a reply: the "status" of the object itself (control replies)
+ * or of the last array element (recipe replies). -1 if malformed. */
+static int reply_status(const char *json) {
+  cJSON *root = cJSON_Parse(json);
+  const cJSON *obj = root;
+  if (cJSON_IsArray(root))
+    obj = cJSON_GetArrayItem(root, cJSON_GetArraySize(root) - 1);
+  const cJSON *st = cJSON_GetObjectItemCaseSensitive(obj, "status");
+  int status = cJSON_IsNumber(st) ? st->valueint : -1;
+  cJSON_Delete(root);
+  return status;
+}
+
+static load_result run_request(load_cfg *cfg, const transport_addr *target,
+                               const char *recipe) {
+  int fd = transport_connect(target);
+  if (fd == -1)
+    return LOAD_ERR_CONNECT;
+  struct timeval tv = {.tv_sec = cfg->timeout_ms / 1000,
+                       .tv_usec = (cfg->timeout_ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  load_result res = LOAD_ERR_HANDSHAKE;
+  char *reply = NULL;
+  if (!proto_send_frame(fd, "{\"hello\":\"taskd_load\",\"version\":1}"))
+    goto out;
+  reply = proto_recv_frame(fd);
+  if (!reply || reply_status(reply) != 0)
+    goto out;
+  sm_free(reply);
+  reply = NULL;
+
+  res = LOAD_ERR_IO;
+  if (!proto_send_frame(fd, recipe))
+    goto out;
+  reply = proto_recv_frame(fd);
+  if (!reply)
+    goto out;
+  res = reply_status(reply) == 0 ? LOAD_OK : LOAD_ERR_STATUS;
+out:
+  sm_free(reply);
+  close(fd);
+  return res;
+}
+
+static void sleep_until(uint64_t ns) {
+  struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000ull),
+                        .tv_nsec = (long)(ns % 1000000000ull)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static void add_sample(load_worker *w, uint64_t ns) {
+  if (w->sample_count == w->sample_cap) {
+    size_t cap = w->sample_cap ? w->sample_cap * 2 : 1024;
+    uint64_t *tmp = sm_realloc(w->samples, cap * sizeof(*tmp));
+    if (!tmp)
+      return;
+    w->samples = tmp;
+    w->sample_cap = cap;
+  }
+  w->samples[w->sample_count++] = ns;
+}
+
+static void *load_thread(void *arg) {
+  load_worker *w = arg;
+  load_cfg *cfg = w->cfg;
+  const transport_addr *target = &cfg->targets[w->index % cfg->target_count];
+  uint64_t end_ns = cfg->start_ns + (uint64_t)(cfg->duration * 1e9);
+  for (;;) {
+    uint64_t k = atomic_fetch_add(&cfg->next_request, 1);
+    if (cfg->max_requests && k >= cfg->max_requests)
+      break;
+    uint64_t start = bench_now_ns();
+    if (cfg->rate > 0) {
+      uint64_t sched = cfg->start_ns + (uint64_t)((double)k * 1e9 / cfg->rate);
+      if (sched >= end_ns)
+        break;
+      if (sched > start)
+        sleep_until(sched);
+      start = sched;
+    } else if (start >= end_ns) {
+      break;
+    }
+    load_result res =
+        run_request(cfg, target, cfg->recipes[k % cfg->recipe_count]);
+    w->counts[res]++;
+    if (res == LOAD_OK)
+      add_sample(w, bench_now_ns() - start);
+  }
+  return NULL;
+}
+
+typedef struct {
+  load_worker *w;
+  uint64_t *starts; /* submit time by id % pipeline; ids in flight are
+                       consecutive because replies come back in order */
+  bool stopping;
+} pipe_session;
+
+static bool pipe_submit(tdc_session *s);
+
+static void pipe_reply(tdc_session *s, uint64_t id, const cJSON *result,
+                       void *ud) {
+  pipe_session *ps = ud;
+  load_cfg *cfg = ps->w->cfg;
+  if (!result) {
+    ps->w->counts[LOAD_ERR_IO]++;
+    return;
+  }
+  const cJSON *last = cJSON_IsArray(result)
+                          ? cJSON_GetArrayItem(result,
+                                               cJSON_GetArraySize(result) - 1)
+                          : result;
+  const cJSON *st = cJSON_GetObjectItemCaseSensitive(last, "status");
+  if (cJSON_IsNumber(st) && st->valueint == 0) {
+    ps->w->counts[LOAD_OK]++;
+    add_sample(ps->w, bench_now_ns() - ps->starts[id % cfg->pipeline]);
+  } else {
+    ps->w->counts[LOAD_ERR_STATUS]++;
+  }
+  if (!ps->stopping)
+    pipe_submit(s);
+}
+
+static bool pipe_submit(tdc_session *s) {
+  pipe_session *ps = tdc_session_user(s);
+  load_cfg *cfg = ps->w->cfg;
+  uint64_t k = atomic_fetch_add(&cfg->next_request, 1);
+  uint64_t end_ns = cfg->start_ns + (uint64_t)(cfg->duration * 1e9);
+  if ((cfg->max_requests && k >= cfg->max_requests) ||
+      bench_now_ns() >= end_ns) {
+    ps->stopping = true;
+    return false;
+  }
+  uint64_t id;
+  uint64_t start = bench_now_ns();
+  if (!tdc_submit(s, cfg->recipes[k % cfg->recipe_count], pipe_reply, ps,
+                  &id))
+    return false;
+  ps->starts[id % cfg->pipeline] = start;
+  return true;
+}
+
+/* Drive one session per target from this thread until the duration or
+ * request budget is used up and every reply is in. */
+static void run_pipelined(load_cfg *cfg, load_worker *w) {
+  tdc_pool *pool = tdc_pool_create();
+  pipe_session *ps = sm_calloc(cfg->target_count, sizeof(*ps));
+  if (!pool || !ps) {
+    perror("tdc_pool_create");
+    exit(1);
+  }
+  for (int i = 0; i < cfg->target_count; ++i) {
+    ps[i].w = w;
+    ps[i].starts = sm_calloc(cfg->pipeline, sizeof(uint64_t));
+    tdc_session *s = tdc_open(pool, &cfg->targets[i], &ps[i]);
+    if (!s) {
+      w->counts[LOAD_ERR_CONNECT]++;
+      continue;
+    }
+    for (int d = 0; d < cfg->pipeline; ++d)
+      pipe_submit(s);
+  }
+  uint64_t end_ns = cfg->start_ns + (uint64_t)(cfg->duration * 1e9) +
+                    (uint64_t)cfg->timeout_ms * 1000000ull;
+  while (tdc_pool_pending(pool) > 0 && bench_now_ns() < end_ns)
+    if (tdc_pool_poll(pool, 100) < 0)
+      break;
+  w->counts[LOAD_ERR_IO] += tdc_pool_pending(pool);
+  for (int i = 0; i < cfg->target_count; ++i)
+    ps[i].stopping = true;
+  tdc_pool_destroy(pool);
+  for (int i = 0; i < cfg->target_count; ++i)
+    sm_free(ps[i].starts);
+  sm_free(ps);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s --target ADDR [--target ADDR...] [--concurrency N]\n"
+          "          [--rate RPS] [--duration SEC] [--requests N]\n"
+          "          [--pipeline DEPTH] [--timeout MS] RECIPE|DIR...\n"
+          "ADDR is PORT, vsock:CID:PORT, unix:PATH or tcp:PORT\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  sm_alloc_init();
+  load_cfg cfg = {.concurrency = 16, .duration = 10, .timeout_ms = 5000};
+  static const struct option opts[] = {
+      {"target", required_argument, NULL, 't'},
+      {"concurrency", required_argument, NULL, 'c'},
+      {"rate", required_argument, NULL, 'r'},
+      {"duration", required_argument, NULL, 'd'},
+      {"requests", required_argument, NULL, 'n'},
+      {"timeout", required_argument, NULL, 'T'},
+      {"pipeline", required_argument, NULL, 'p'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "t:c:r:d:n:T:p:h", opts, NULL)) != -1) {
+    switch (c) {
+    case 't':
+      if (cfg.target_count == LOAD_MAX_TARGETS ||
+          !transport_parse(optarg, &cfg.targets[cfg.target_count])) {
+        fprintf(stderr, "bad target %s\n", optarg);
+        return 1;
+      }
+      cfg.target_count++;
+      break;
+    case 'c':
+      cfg.concurrency = atoi(optarg);
+      break;
+    case 'r':
+      cfg.rate = atof(optarg);
+      break;
+    case 'd':
+      cfg.duration = atof(optarg);
+      break;
+    case 'n':
+      cfg.max_requests = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      cfg.timeout_ms = atoi(optarg);
+      break;
+    case 'p':
+      cfg.pipeline = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (cfg.target_count == 0 || cfg.concurrency <= 0 || cfg.rate < 0 ||
+      cfg.duration <= 0 || cfg.timeout_ms <= 0 || cfg.pipeline < 0 ||
+      optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (int i = optind; i < argc; ++i)
+    if (!add_path(&cfg, argv[i]))
+      return 1;
+  if (cfg.recipe_count == 0) {
+    fprintf(stderr, "no recipes found\n");
+    return 1;
+  }
+
+  if (cfg.pipeline > 0)
+    cfg.concurrency = 1;
+  load_worker *workers = sm_calloc(cfg.concurrency, sizeof(*workers));
+  pthread_t *threads = sm_calloc(cfg.concurrency, sizeof(*threads));
+  if (!workers || !threads) {
+    perror("calloc");
+    return 1;
+  }
+  cfg.start_ns = bench_now_ns();
+  int started = 0;
+  if (cfg.pipeline > 0) {
+    workers[0].cfg = &cfg;
+    run_pipelined(&cfg, &workers[0]);
+    started = 1;
+  } else {
+    /* Small stacks: a few hundred client threads should not need GBs of VM */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    for (; started < cfg.concurrency; ++started) {
+      workers[started].cfg = &cfg;
+      workers[started].index = started;
+      if (pthread_create(&threads[started], &attr, load_thread,
+                         &workers[started]) != 0)
+        break;
+    }
+    pthread_attr_destroy(&attr);
+    for (int i = 0; i < started; ++i)
+      pthread_join(threads[i], NULL);
+  }
+  double elapsed = (double)(bench_now_ns() - cfg.start_ns) / 1e9;
+
+  uint64_t counts[LOAD_RESULT_COUNT] = {0};
+  size_t total = 0;
+  for (int i = 0; i < started; ++i) {
+    for (int r = 0; r < LOAD_RESULT_COUNT; ++r)
+      counts[r] += workers[i].counts[r];
+    total += workers[i].sample_count;
+  }
+  uint64_t *all = sm_malloc((total ? total : 1) * sizeof(*all));
+  size_t off = 0;
+  for (int i = 0; i < started; ++i) {
+    if (all && workers[i].sample_count)
+      memcpy(all + off, workers[i].samples,
+             workers[i].sample_count * sizeof(*all));
+    off += workers[i].sample_count;
+    sm_free(workers[i].samples);
+  }
+
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddStringToObject(root, "mode", cfg.pipeline > 0 ? "pipelined"
+                                       : cfg.rate > 0     ? "open"
+                                                          : "closed");
+  if (cfg.pipeline > 0)
+    cJSON_AddNumberToObject(root, "pipeline", cfg.pipeline);
+  cJSON_AddNumberToObject(root, "threads", started);
+  cJSON_AddNumberToObject(root, "targets", cfg.target_count);
+  if (cfg.rate > 0)
+    cJSON_AddNumberToObject(root, "offered_rps", cfg.rate);
+  cJSON_AddNumberToObject(root, "elapsed_s", elapsed);
+  uint64_t sent = 0;
+  cJSON *res = cJSON_AddObjectToObject(root, "results");
+  for (int r = 0; r < LOAD_RESULT_COUNT; ++r) {
+    cJSON_AddNumberToObject(res, result_names[r], (double)counts[r]);
+    sent += counts[r];
+  }
+  cJSON_AddNumberToObject(root, "requests", (double)sent);
+  cJSON_AddNumberToObject(root, "throughput_rps",
+                          elapsed > 0 ? (double)counts[LOAD_OK] / elapsed : 0);
+  if (all)
+    bench_summary_to_json(cJSON_AddObjectToObject(root, "latency_ns"), all,
+                          total);
+  char *out = cJSON_Print(root);
+  if (out) {
+    printf("%s\n", out);
+    sm_free(out);
+  }
+  cJSON_Delete(root);
+  fprintf(stderr, "%llu requests, %llu ok, %.1f req/s\n",
+          (unsigned long long)sent, (unsigned long long)counts[LOAD_OK],
+          elapsed > 0 ? (double)counts[LOAD_OK] / elapsed : 0);
+
+  sm_free(all);
+  sm_free(workers);
+  sm_free(threads);
+  for (size_t i = 0; i < cfg.recipe_count; ++i)
+    sm_free(cfg.recipes[i]);
+  sm_free(cfg.recipes);
+  return counts[LOAD_OK] == sent ? 0 : 1;
+}
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include "taskd_log.h"
+#include "sm_alloc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TLOG_RING_SIZE 128 /* records per thread, power of two */
+#define TLOG_FLUSH_MS 100
+#define TLOG_BATCH_BYTES 16384
+
+typedef struct {
+  uint64_t ts_ns; /* CLOCK_REALTIME */
+  const char *fmt;
+  long long args[TLOG_MAX_ARGS];
+  uint32_t tid;
+  uint8_t level;
+  uint8_t has_str;
+  char str[TLOG_STR_MAX];
+} tlog_rec;
+
+/* Single-producer/single-consumer ring. head is written only by the owning
+ * thread, tail only by the flusher. */
+typedef struct tlog_ring {
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  _Atomic uint64_t dropped;
+  _Atomic bool in_use;
+  uint32_t tid;
+  struct tlog_ring *next;
+  tlog_rec recs[TLOG_RING_SIZE];
+} tlog_ring;
+
+_Atomic int tlog_cur_level = TLOG_OFF;
+
+static _Atomic(tlog_ring *) rings = NULL;
+static __thread tlog_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int log_fd = -1;
+static pthread_t flusher;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static bool flusher_running = false;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+
+/* Release the ring for reuse by a later thread once its owner exits. */
+static void ring_release(void *arg) {
+  tlog_ring *r = arg;
+  atomic_store_explicit(&r->in_use, false, memory_order_release);
+}
+
+static void ring_key_init(void) { pthread_key_create(&ring_key, ring_release); }
+
+static tlog_ring *ring_acquire(void) {
+  pthread_once(&ring_key_once, ring_key_init);
+  uint32_t tid = (uint32_t)gettid();
+  /* Reuse a ring left behind by an exited thread before allocating */
+  for (tlog_ring *r = atomic_load(&rings); r; r = r->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) {
+      r->tid = tid;
+      pthread_setspecific(ring_key, r);
+      return r;
+    }
+  }
+  tlog_ring *r = sm_calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+  r->tid = tid;
+  atomic_store(&r->in_use, true);
+  tlog_ring *old = atomic_load(&rings);
+  do {
+    r->next = old;
+  } while (!atomic_compare_exchange_weak(&rings, &old, r));
+  pthread_setspecific(ring_key, r);
+  return r;
+}
+
+void tlog_emit(tlog_level level, const char *fmt, const char *str,
+               const long long *args) {
+  tlog_ring *r = my_ring;
+  if (!r) {
+    r = my_ring = ring_acquire();
+    if (!r)
+      return;
+  }
+  uint32_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+  uint32_t t = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (h - t >= TLOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  tlog_rec *rec = &r->recs[h & (TLOG_RING_SIZE - 1)];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  rec->fmt = fmt;
+  memcpy(rec->args, args, sizeof(rec->args));
+  rec->tid = r->tid;
+  rec->level = (uint8_t)level;
+  rec->has_str = str != NULL;
+  if (str) {
+    size_t n = strnlen(str, TLOG_STR_MAX - 1);
+    memcpy(rec->str, str, n);
+    rec->str[n] = '\0';
+  }
+  atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+static size_t format_rec(char *buf, size_t cap, const tlog_rec *rec) {
+  time_t sec = (time_t)(rec->ts_ns / 1000000000ull);
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  int n = snprintf(buf, cap, "%04d-%02d-%02dT%02d:%02d:%02d.%06lluZ %-5s [%u] ",
+                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                   tm.tm_min, tm.tm_sec,
+                   (unsigned long long)(rec->ts_ns % 1000000000ull / 1000),
+                   level_names[rec->level < TLOG_OFF ? rec->level : TLOG_OFF],
+                   rec->tid);
+  if (n < 0 || (size_t)n >= cap)
+    return 0;
+  int m;
+  if (rec->has_str)
+    m = snprintf(buf + n, cap - (size_t)n, rec->fmt, rec->str, rec->args[0],
+                 rec->args[1], rec->args[2], rec->args[3]);
+  else
+    m = snprintf(buf + n, cap - (size_t)n, rec->fmt, rec->args[0],
+                 rec->args[1], rec->args[2], rec->args[3]);
+  if (m < 0)
+    m = 0;
+  size_t len = (size_t)n + (size_t)m;
+  if (len >= cap - 1)
+    len = cap - 2;
+  buf[len++] = '\n';
+  return len;
+}
+
+static void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(log_fd, buf, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += w;
+    len -= (size_t)w;
+  }
+}
+
+/* Drain every ring into the log file, batching writes. */
+static void drain_rings(void) {
+  static char batch[TLOG_BATCH_BYTES];
+  size_t used = 0;
+  char line[512];
+  for (tlog_ring *r = atomic_load(&rings); r; r = r->next) {
+    uint32_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+    for (; t != h; ++t) {
+      size_t n = format_rec(line, sizeof(line),
+                            &r->recs[t & (TLOG_RING_SIZE - 1)]);
+      if (used + n > sizeof(batch)) {
+        write_all(batch, used);
+        used = 0;
+      }
+      memcpy(batch + used, line, n);
+      used += n;
+    }
+    atomic_store_explicit(&r->tail, t, memory_order_release);
+    uint64_t dropped =
+        atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    if (dropped) {
+      int n = snprintf(line, sizeof(line), "taskd_log: dropped %llu records "
+                                           "from thread %u\n",
+                       (unsigned long long)dropped, r->tid);
+      if (n > 0 && used + (size_t)n > sizeof(batch)) {
+        write_all(batch, used);
+        used = 0;
+      }
+      if (n > 0) {
+        memcpy(batch + used, line, (size_t)n);
+        used += (size_t)n;
+      }
+    }
+  }
+  if (used)
+    write_all(batch, used);
+}
+
+static void *flusher_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&flush_lock);
+  while (flusher_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TLOG_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&flush_cond, &flush_lock, &deadline);
+    pthread_mutex_unlock(&flush_lock);
+    drain_rings();
+    pthread_mutex_lock(&flush_lock);
+  }
+  pthread_mutex_unlock(&flush_lock);
+  drain_rings();
+  return NULL;
+}
+
+bool tlog_start(const char *path) {
+  if (flusher_running || !path)
+    return false;
+  log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (log_fd < 0)
+    return false;
+  flusher_running = true;
+  if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+    flusher_running = false;
+    close(log_fd);
+    log_fd = -1;
+    return false;
+  }
+  tlog_set_level(TLOG_INFO);
+  return true;
+}
+
+void tlog_stop(void) {
+  pthread_mutex_lock(&flush_lock);
+  if (!flusher_running) {
+    pthread_mutex_unlock(&flush_lock);
+    return;
+  }
+  flusher_running = false;
+  pthread_cond_signal(&flush_cond);
+  pthread_mutex_unlock(&flush_lock);
+  pthread_join(flusher, NULL);
+  tlog_set_level(TLOG_OFF);
+  close(log_fd);
+  log_fd = -1;
+}
+
+void tlog_set_level(tlog_level level) {
+  if ((int)level < TLOG_DEBUG || level > TLOG_OFF)
+    return;
+  atomic_store_explicit(&tlog_cur_level, (int)level, memory_order_relaxed);
+}
+
+tlog_level tlog_get_level(void) {
+  return (tlog_level)atomic_load_explicit(&tlog_cur_level,
+                                          memory_order_relaxed);
+}
+
+const char *tlog_level_name(tlog_level level) {
+  return ((int)level >= TLOG_DEBUG && level <= TLOG_OFF) ? level_names[level]
+                                                          : "?";
+}
+
+bool tlog_level_from_string(const char *s, tlog_level *out) {
+  if (!s || !out)
+    return false;
+  for (int i = TLOG_DEBUG; i <= TLOG_OFF; ++i) {
+    if (strcasecmp(s, level_names[i]) == 0) {
+      *out = (tlog_level)i;
+      return true;
+    }
+  }
+  return false;
+}
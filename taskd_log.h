@@ -0,0 +1,75 @@
+#ifndef TASKD_LOG_H
+#define TASKD_LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TASKD_LOG_PATH "/root/task.log"
+
+typedef enum {
+  TLOG_DEBUG = 0,
+  TLOG_INFO = 1,
+  TLOG_WARN = 2,
+  TLOG_ERROR = 3,
+  TLOG_OFF = 4,
+} tlog_level;
+
+#define TLOG_MAX_ARGS 4
+#define TLOG_STR_MAX 48
+
+/*
+ * Deferred-format logger.
+ *
+ * Callers append fixed-size binary records to a ring owned by their thread;
+ * a background flusher formats and writes them to the log file in batches.
+ * The format string is stored by pointer and must be a string literal. It is
+ * applied later with up to TLOG_MAX_ARGS long long arguments, so numeric
+ * conversions must be %lld/%llu/%llx. TLOG_S additionally copies one string
+ * (truncated to TLOG_STR_MAX - 1 bytes), which must be the first conversion.
+ *
+ * When a ring is full new records are dropped and counted; the flusher
+ * reports the number of dropped records instead of blocking the producer.
+ */
+extern _Atomic int tlog_cur_level;
+
+static inline bool tlog_enabled(tlog_level level) {
+  return (int)level >=
+         atomic_load_explicit(&tlog_cur_level, memory_order_relaxed);
+}
+
+void tlog_emit(tlog_level level, const char *fmt, const char *str,
+               const long long *args);
+
+#define TLOG(level, fmt, ...)                                                  \
+  do {                                                                         \
+    if (tlog_enabled(level))                                                   \
+      tlog_emit((level), (fmt), NULL,                                          \
+                (const long long[TLOG_MAX_ARGS]){__VA_ARGS__});                \
+  } while (0)
+
+#define TLOG_S(level, fmt, str, ...)                                           \
+  do {                                                                         \
+    if (tlog_enabled(level))                                                   \
+      tlog_emit((level), (fmt), (str),                                         \
+                (const long long[TLOG_MAX_ARGS]){__VA_ARGS__});                \
+  } while (0)
+
+/* Open the log file and start the flusher thread. */
+bool tlog_start(const char *path);
+/* Drain every ring, stop the flusher and close the file. */
+void tlog_stop(void);
+
+void tlog_set_level(tlog_level level);
+tlog_level tlog_get_level(void);
+const char *tlog_level_name(tlog_level level);
+bool tlog_level_from_string(const char *s, tlog_level *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TASKD_LOG_H */
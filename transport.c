@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include "transport.h"
+// clang-format off
+#include <sys/socket.h>
+#include <linux/vm_sockets.h>
+// clang-format on
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool parse_uint(const char *s, unsigned int *out) {
+  if (!s || !*s)
+    return false;
+  char *end = NULL;
+  errno = 0;
+  unsigned long v = strtoul(s, &end, 10);
+  if (errno || *end != '\0' || v > 0xffffffffUL)
+    return false;
+  *out = (unsigned int)v;
+  return true;
+}
+
+bool transport_parse(const char *spec, transport_addr *out) {
+  if (!spec || !out)
+    return false;
+  memset(out, 0, sizeof(*out));
+  if (strncmp(spec, "unix:", 5) == 0) {
+    size_t len = strlen(spec + 5);
+    if (len == 0 || len >= sizeof(out->path))
+      return false;
+    out->kind = TRANSPORT_UNIX;
+    memcpy(out->path, spec + 5, len + 1);
+    return true;
+  }
+  if (strncmp(spec, "tcp:", 4) == 0) {
+    out->kind = TRANSPORT_TCP;
+    return parse_uint(spec + 4, &out->port) && out->port > 0 &&
+           out->port <= 65535;
+  }
+  if (strncmp(spec, "vsock:", 6) == 0)
+    spec += 6;
+  out->kind = TRANSPORT_VSOCK;
+  out->cid = VMADDR_CID_ANY;
+  const char *colon = strchr(spec, ':');
+  if (colon) {
+    char cid[16];
+    size_t n = (size_t)(colon - spec);
+    if (n == 0 || n >= sizeof(cid))
+      return false;
+    memcpy(cid, spec, n);
+    cid[n] = '\0';
+    if (!parse_uint(cid, &out->cid))
+      return false;
+    spec = colon + 1;
+  }
+  return parse_uint(spec, &out->port) && out->port > 0;
+}
+
+void transport_describe(const transport_addr *a, char *buf, size_t len) {
+  switch (a->kind) {
+  case TRANSPORT_UNIX:
+    snprintf(buf, len, "unix:%s", a->path);
+    break;
+  case TRANSPORT_TCP:
+    snprintf(buf, len, "tcp:%u", a->port);
+    break;
+  default:
+    if (a->cid == VMADDR_CID_ANY)
+      snprintf(buf, len, "vsock:%u", a->port);
+    else
+      snprintf(buf, len, "vsock:%u:%u", a->cid, a->port);
+    break;
+  }
+}
+
+/* Fill a sockaddr for the transport. listening selects the wildcard CID for
+ * vsock; tcp always uses loopback. */
+static socklen_t make_sockaddr(const transport_addr *a, bool listening,
+                               struct sockaddr_storage *ss) {
+  memset(ss, 0, sizeof(*ss));
+  switch (a->kind) {
+  case TRANSPORT_UNIX: {
+    struct sockaddr_un *un = (struct sockaddr_un *)ss;
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, a->path, strlen(a->path) + 1);
+    return sizeof(*un);
+  }
+  case TRANSPORT_TCP: {
+    struct sockaddr_in *in = (struct sockaddr_in *)ss;
+    in->sin_family = AF_INET;
+    in->sin_port = htons((uint16_t)a->port);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sizeof(*in);
+  }
+  default: {
+    struct sockaddr_vm *vm = (struct sockaddr_vm *)ss;
+    vm->svm_family = AF_VSOCK;
+    vm->svm_port = a->port;
+    if (listening)
+      vm->svm_cid = VMADDR_CID_ANY;
+    else /* from inside a guest, an address without a CID means the host */
+      vm->svm_cid = a->cid == VMADDR_CID_ANY ? VMADDR_CID_HOST : a->cid;
+    return sizeof(*vm);
+  }
+  }
+}
+
+static int family_of(const transport_addr *a) {
+  switch (a->kind) {
+  case TRANSPORT_UNIX:
+    return AF_UNIX;
+  case TRANSPORT_TCP:
+    return AF_INET;
+  default:
+    return AF_VSOCK;
+  }
+}
+
+/* Requests and replies are single small writes; do not let Nagle hold the
+ * reply back waiting for an ACK. */
+static void set_nodelay(const transport_addr *a, int fd) {
+  int one = 1;
+  if (a->kind == TRANSPORT_TCP)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int transport_listen(const transport_addr *a, int backlog) {
+  struct sockaddr_storage ss;
+  socklen_t len = make_sockaddr(a, true, &ss);
+  int fd = socket(family_of(a), SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (a->kind == TRANSPORT_TCP) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  } else if (a->kind == TRANSPORT_UNIX) {
+    unlink(a->path);
+  }
+  if (bind(fd, (struct sockaddr *)&ss, len) == -1 || listen(fd, backlog) == -1) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+int transport_accept(const transport_addr *a, int listen_fd) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd != -1)
+    set_nodelay(a, fd);
+  return fd;
+}
+
+static int connect_flags(const transport_addr *a, int flags) {
+  struct sockaddr_storage ss;
+  socklen_t len = make_sockaddr(a, false, &ss);
+  int fd = socket(family_of(a), SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&ss, len) == -1 &&
+      !((flags & SOCK_NONBLOCK) && errno == EINPROGRESS)) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  set_nodelay(a, fd);
+  return fd;
+}
+
+int transport_connect(const transport_addr *a) { return connect_flags(a, 0); }
+
+int transport_connect_async(const transport_addr *a) {
+  return connect_flags(a, SOCK_NONBLOCK);
+}
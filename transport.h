@@ -0,0 +1,60 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stream socket transports. taskd normally listens on AF_VSOCK inside the
+ * guest; AF_UNIX and TCP on 127.0.0.1 let the daemon and its clients run on
+ * an ordinary host for testing and benchmarking. Everything above the
+ * socket (framing, handshake, sessions) is identical for all of them.
+ *
+ * Address specs:
+ *   PORT | vsock:PORT | vsock:CID:PORT   AF_VSOCK (CID only used to connect;
+ *                                        without one, connect goes to the host)
+ *   unix:PATH                            AF_UNIX stream socket
+ *   tcp:PORT                             TCP on 127.0.0.1
+ */
+typedef enum {
+  TRANSPORT_VSOCK,
+  TRANSPORT_UNIX,
+  TRANSPORT_TCP,
+} transport_kind;
+
+typedef struct {
+  transport_kind kind;
+  unsigned int cid;  /* vsock peer for transport_connect() */
+  unsigned int port; /* vsock or tcp */
+  char path[108];    /* unix, sizeof(sun_path) */
+} transport_addr;
+
+/* Parse an address spec. Returns false on malformed input. */
+bool transport_parse(const char *spec, transport_addr *out);
+
+/* Format an address back into spec form for logs and messages. */
+void transport_describe(const transport_addr *a, char *buf, size_t len);
+
+/* Bound, listening socket or -1 with errno set. A stale unix socket file at
+ * the same path is removed first. */
+int transport_listen(const transport_addr *a, int backlog);
+
+/* Accept a connection and apply per-transport socket options. */
+int transport_accept(const transport_addr *a, int listen_fd);
+
+/* Connected socket or -1 with errno set. */
+int transport_connect(const transport_addr *a);
+
+/* Non-blocking socket with the connect started, or -1 with errno set. The
+ * connection is established once the fd polls writable with SO_ERROR 0. */
+int transport_connect_async(const transport_addr *a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRANSPORT_H */